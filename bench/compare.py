@@ -0,0 +1,45 @@
+#!/usr/bin/env python3
+"""Compare two bench JSON reports and fail if any median wall time regressed."""
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        return {b["name"]: b for b in json.load(f)["benchmarks"]}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("baseline")
+    parser.add_argument("current")
+    parser.add_argument("--threshold", type=float, default=5.0,
+                        help="allowed slowdown of the median, in percent (default 5)")
+    args = parser.parse_args()
+
+    baseline = load(args.baseline)
+    current = load(args.current)
+    regressed = False
+
+    print(f"{'benchmark':16} {'base ms':>10} {'new ms':>10} {'change':>8} {'instr change':>13}")
+    for name, bench in current.items():
+        if name not in baseline:
+            continue
+        old = baseline[name]["wall_ms"]["median"]
+        new = bench["wall_ms"]["median"]
+        change = (new - old) / old * 100 if old else 0.0
+        instr = ""
+        if baseline[name]["instructions"] and bench["instructions"]:
+            instr = f"{(bench['instructions'] - baseline[name]['instructions']) / baseline[name]['instructions'] * 100:+.2f}%"
+        flag = ""
+        if change > args.threshold:
+            flag = "  REGRESSION"
+            regressed = True
+        print(f"{name:16} {old:10.2f} {new:10.2f} {change:+7.2f}% {instr:>13}{flag}")
+
+    return 1 if regressed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,212 @@
+// Runs each benchmark script several times under the interpreter and
+// reports wall time percentiles, retired instructions, peak RSS and GC
+// pauses as JSON.
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+struct Run {
+    double wallMs = 0;
+    long long instructions = -1;
+    long peakRssKb = 0;
+    unsigned long long gcCollections = 0;
+    unsigned long long gcPauseTotalNs = 0;
+    unsigned long long gcPauseMaxNs = 0;
+    bool ok = false;
+};
+
+static int openInstructionCounter(pid_t pid) {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0));
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+static void parseGcLine(const std::string& output, Run& run) {
+    size_t at = output.rfind("gc collections=");
+    if (at == std::string::npos) return;
+    sscanf(output.c_str() + at, "gc collections=%llu pause_total_ns=%llu pause_max_ns=%llu",
+           &run.gcCollections, &run.gcPauseTotalNs, &run.gcPauseMaxNs);
+}
+
+static Run runOnce(const char* interpreter, const char* script) {
+    Run run;
+    int ready[2];
+    int errPipe[2];
+    if (pipe(ready) != 0 || pipe(errPipe) != 0) return run;
+
+    pid_t pid = fork();
+    if (pid < 0) return run;
+    if (pid == 0) {
+        close(ready[1]);
+        close(errPipe[0]);
+        char go;
+        if (read(ready[0], &go, 1) != 1) _exit(127);
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(errPipe[1], STDERR_FILENO);
+        execl(interpreter, interpreter, "--gc-stats", script, static_cast<char*>(nullptr));
+        _exit(127);
+    }
+
+    close(ready[0]);
+    close(errPipe[1]);
+    int counter = openInstructionCounter(pid);
+    auto start = std::chrono::steady_clock::now();
+    if (write(ready[1], "g", 1) != 1) {
+        kill(pid, SIGKILL);
+    }
+    close(ready[1]);
+
+    std::string errors;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(errPipe[0], buffer, sizeof(buffer))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        errors.append(buffer, static_cast<size_t>(n));
+    }
+    close(errPipe[0]);
+
+    int status = 0;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) < 0 && errno == EINTR) {}
+    auto end = std::chrono::steady_clock::now();
+
+    run.wallMs = std::chrono::duration<double, std::milli>(end - start).count();
+    run.peakRssKb = usage.ru_maxrss;
+    run.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (counter >= 0) {
+        long long count = 0;
+        if (read(counter, &count, sizeof(count)) == sizeof(count)) run.instructions = count;
+        close(counter);
+    }
+    parseGcLine(errors, run);
+    if (!run.ok) fprintf(stderr, "%s failed:\n%s", script, errors.c_str());
+    return run;
+}
+
+template <typename T>
+static T percentile(std::vector<T> values, double p) {
+    std::sort(values.begin(), values.end());
+    size_t rank = static_cast<size_t>(p / 100.0 * (values.size() - 1) + 0.5);
+    return values[std::min(rank, values.size() - 1)];
+}
+
+static std::string baseName(const std::string& path) {
+    size_t slash = path.find_last_of('/');
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    size_t dot = name.rfind('.');
+    return dot == std::string::npos ? name : name.substr(0, dot);
+}
+
+static int usage() {
+    fprintf(stderr, "Usage: intercpp_bench --interpreter <path> [--iterations N] [--json <file>] script...\n");
+    return 64;
+}
+
+int main(int argc, char* argv[]) {
+    const char* interpreter = nullptr;
+    const char* jsonPath = nullptr;
+    int iterations = 5;
+    std::vector<const char*> scripts;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--interpreter") == 0 && i + 1 < argc) {
+            interpreter = argv[++i];
+        } else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            jsonPath = argv[++i];
+        } else if (argv[i][0] == '-') {
+            return usage();
+        } else {
+            scripts.push_back(argv[i]);
+        }
+    }
+    if (interpreter == nullptr || scripts.empty()) return usage();
+
+    std::string json = "{\n  \"interpreter\": \"" + std::string(interpreter) + "\",\n";
+    json += "  \"iterations\": " + std::to_string(iterations) + ",\n  \"benchmarks\": [\n";
+    bool failed = false;
+
+    printf("%-16s %10s %10s %10s %14s %10s %8s %12s\n",
+           "benchmark", "median ms", "p90 ms", "max ms", "instructions", "rss KiB", "gc", "gc max ms");
+    for (size_t s = 0; s < scripts.size(); ++s) {
+        std::vector<double> wall;
+        std::vector<long long> instructions;
+        long peakRss = 0;
+        Run last;
+        for (int i = 0; i < iterations; ++i) {
+            Run run = runOnce(interpreter, scripts[s]);
+            if (!run.ok) failed = true;
+            wall.push_back(run.wallMs);
+            if (run.instructions >= 0) instructions.push_back(run.instructions);
+            peakRss = std::max(peakRss, run.peakRssKb);
+            last = run;
+        }
+
+        std::string name = baseName(scripts[s]);
+        double median = percentile(wall, 50);
+        double p90 = percentile(wall, 90);
+        double p99 = percentile(wall, 99);
+        double minimum = *std::min_element(wall.begin(), wall.end());
+        double maximum = *std::max_element(wall.begin(), wall.end());
+        long long medianInstructions = instructions.empty() ? -1 : percentile(instructions, 50);
+
+        printf("%-16s %10.2f %10.2f %10.2f %14lld %10ld %8llu %12.3f\n",
+               name.c_str(), median, p90, maximum, medianInstructions, peakRss,
+               last.gcCollections, last.gcPauseMaxNs / 1e6);
+
+        char entry[1024];
+        snprintf(entry, sizeof(entry),
+                 "    {\"name\": \"%s\", \"wall_ms\": {\"median\": %.3f, \"p90\": %.3f, \"p99\": %.3f, "
+                 "\"min\": %.3f, \"max\": %.3f}, \"instructions\": %s, \"peak_rss_kb\": %ld, "
+                 "\"gc\": {\"collections\": %llu, \"pause_total_ms\": %.3f, \"pause_max_ms\": %.3f}}%s\n",
+                 name.c_str(), median, p90, p99, minimum, maximum,
+                 medianInstructions < 0 ? "null" : std::to_string(medianInstructions).c_str(),
+                 peakRss, last.gcCollections, last.gcPauseTotalNs / 1e6, last.gcPauseMaxNs / 1e6,
+                 s + 1 < scripts.size() ? "," : "");
+        json += entry;
+    }
+    json += "  ]\n}\n";
+
+    if (jsonPath) {
+        FILE* file = fopen(jsonPath, "w");
+        if (!file) {
+            fprintf(stderr, "Could not write '%s'.\n", jsonPath);
+            return 74;
+        }
+        fputs(json.c_str(), file);
+        fclose(file);
+    }
+    return failed ? 1 : 0;
+}
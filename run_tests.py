@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+"""Run test_*.lox scripts and check their output against their comments.
+
+A line ending in `// expect: <text>` expects <text> as the next line of
+output, and `// expect runtime error: <message>` expects <message> as the
+first line of stderr, and each `// expect trace: <line>` the next line of the
+stack trace after it. Each `// expect stderr: <regex>` must match a whole
+line of stderr, in any order, for output such as profiles and counters.
+
+Each `// run: <flags>` line runs the script once more with those flags, in
+order. Without one the script runs once with no flags. Every run starts in a
+temporary directory kept for all runs of the script, which `{tmp}` in flags
+also names; `{dir}` names the script's own directory. A `// stderr into stdout` line sends both to one pipe, so the
+error and trace are expected right after the output.
+"""
+import argparse
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+EXPECT = re.compile(r"// expect: ?(.*)$")
+ERROR = re.compile(r"// expect runtime error: (.*)$")
+TRACE = re.compile(r"// expect trace: (.*)$")
+STDERR = re.compile(r"// expect stderr: (.*)$")
+RUN = re.compile(r"^// run:(.*)$")
+MERGE = "// stderr into stdout"
+
+
+def check(interpreter, script):
+    with open(script) as f:
+        lines = f.read().splitlines()
+    expected = [m.group(1) for m in map(EXPECT.search, lines) if m]
+    errors = [m.group(1) for m in map(ERROR.search, lines) if m]
+    errors += [m.group(1) for m in map(TRACE.search, lines) if m]
+    patterns = [m.group(1) for m in map(STDERR.search, lines) if m]
+    runs = [m.group(1).split() for m in map(RUN.match, lines) if m] or [[]]
+    merge = MERGE in lines
+
+    failures = []
+    with tempfile.TemporaryDirectory() as tmp:
+        for flags in runs:
+            flags = [flag.replace("{tmp}", tmp).replace("{dir}", os.path.dirname(os.path.abspath(script)))
+                     for flag in flags]
+            result = subprocess.run([interpreter, *flags, os.path.abspath(script)],
+                                    cwd=tmp, stdout=subprocess.PIPE,
+                                    stderr=subprocess.STDOUT if merge else subprocess.PIPE,
+                                    text=True, timeout=120)
+            label = " ".join(flags) or "default"
+            output = result.stdout.splitlines()
+            if merge:
+                if output[:len(expected) + len(errors)] != expected + errors:
+                    failures.append(f"{label}: expected {expected + errors}, got {output}")
+                continue
+            if output != expected:
+                failures.append(f"{label}: expected {expected}, got {output}")
+            stderr = result.stderr.splitlines()
+            for pattern in patterns:
+                if not any(re.fullmatch(pattern, line) for line in stderr):
+                    failures.append(f"{label}: no line of stderr matches {pattern!r}")
+            if errors and stderr[:len(errors)] != errors:
+                failures.append(f"{label}: expected error {errors}, got {stderr[:len(errors)]}")
+            if not errors and result.returncode != 0:
+                failures.append(f"{label}: exit {result.returncode}: {result.stderr.strip()}")
+    return failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("interpreter")
+    parser.add_argument("scripts", nargs="+")
+    args = parser.parse_args()
+    interpreter = os.path.abspath(args.interpreter)
+
+    failed = False
+    for script in args.scripts:
+        failures = check(interpreter, script)
+        for failure in failures:
+            print(f"FAIL {script}: {failure}")
+        failed = failed or bool(failures)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,247 @@
+#include "intercpp.h"
+#include "vm/vm.hpp"
+#include "vm/isolate.hpp"
+#include "vm/object/string.hpp"
+#include "vm/object/function.hpp"
+#include "vm/object/closure.hpp"
+#include "vm/object/native.hpp"
+#include <algorithm>
+
+struct IcppVM {
+    VM vm;
+    std::string error;
+    uint64_t failedCalls = 0;
+};
+
+// The cache is declared first so it outlives the isolates running its code.
+struct IcppPool {
+    CodeCache cache;
+    IsolatePool pool;
+
+    explicit IcppPool(size_t threads) : pool(threads) {}
+};
+
+static Value* slotAt(const IcppVM* handle, int index) {
+    const VM& vm = handle->vm;
+    if (index >= 0 || -index > vm.stackTop - vm.stack) return nullptr;
+    return vm.stackTop + index;
+}
+
+static int pushValue(IcppVM* handle, Value value) {
+    VM& vm = handle->vm;
+    if (!vm.ensureStack(1)) return 0;
+    vm.push(value);
+    return 1;
+}
+
+extern "C" {
+
+int icpp_api_version(void) {
+    return INTERCPP_API_VERSION;
+}
+
+IcppVM* icpp_new(void) {
+    return new IcppVM();
+}
+
+void icpp_free(IcppVM* vm) {
+    delete vm;
+}
+
+void icpp_set_memory_limit(IcppVM* vm, size_t bytes) {
+    vm->vm.memoryLimit = bytes;
+    if (bytes != 0) vm->vm.nextGC = std::min(vm->vm.nextGC, bytes);
+}
+
+size_t icpp_memory_used(const IcppVM* vm) {
+    return vm->vm.bytesAllocated;
+}
+
+void icpp_add_module_path(IcppVM* vm, const char* dir) {
+    vm->vm.modulePath.emplace_back(dir);
+}
+
+void icpp_set_module_cache(IcppVM* vm, const char* dir) {
+    vm->vm.moduleCache = dir ? dir : "";
+}
+
+IcppResult icpp_interpret(IcppVM* vm, const char* source, size_t length) {
+    if (icpp_load(vm, source, length) != ICPP_OK) return ICPP_COMPILE_ERROR;
+    IcppResult result = icpp_call(vm, 0);
+    if (result == ICPP_OK) vm->vm.pop();
+    return result;
+}
+
+IcppResult icpp_load(IcppVM* vm, const char* source, size_t length) {
+    ObjFunction* function = vm->vm.compile(std::string(source, length));
+    if (!function) return ICPP_COMPILE_ERROR;
+    if (!pushValue(vm, Value(function))) return ICPP_RUNTIME_ERROR;
+    ObjClosure* closure = vm->vm.newClosure(function);
+    vm->vm.stackTop[-1] = Value(closure);
+    return ICPP_OK;
+}
+
+IcppResult icpp_call(IcppVM* vm, int argCount) {
+    if (argCount < 0 || slotAt(vm, -argCount - 1) == nullptr) {
+        vm->vm.runtimeError("Call needs a callee and %d arguments on the stack.", argCount);
+        vm->failedCalls++;
+        return ICPP_RUNTIME_ERROR;
+    }
+    if (!vm->vm.callFromHost(argCount)) {
+        vm->failedCalls++;
+        return ICPP_RUNTIME_ERROR;
+    }
+    return ICPP_OK;
+}
+
+int icpp_push_nil(IcppVM* vm) {
+    return pushValue(vm, Value(nullptr));
+}
+
+int icpp_push_bool(IcppVM* vm, int value) {
+    return pushValue(vm, Value(value != 0));
+}
+
+int icpp_push_number(IcppVM* vm, double value) {
+    return pushValue(vm, Value(value));
+}
+
+int icpp_push_string(IcppVM* vm, const char* chars, size_t length) {
+    return pushValue(vm, Value(vm->vm.allocateString(std::string_view(chars, length))));
+}
+
+int icpp_push_value(IcppVM* vm, int index) {
+    Value* slot = slotAt(vm, index);
+    return pushValue(vm, slot ? *slot : Value(nullptr));
+}
+
+int icpp_get_top(const IcppVM* vm) {
+    return static_cast<int>(vm->vm.stackTop - vm->vm.stack);
+}
+
+void icpp_pop(IcppVM* vm, int count) {
+    count = std::max(0, std::min(count, icpp_get_top(vm)));
+    vm->vm.stackTop -= count;
+}
+
+IcppType icpp_type(const IcppVM* vm, int index) {
+    Value* slot = slotAt(vm, index);
+    if (slot == nullptr) return ICPP_TYPE_NONE;
+    if (std::holds_alternative<std::nullptr_t>(*slot)) return ICPP_TYPE_NIL;
+    if (std::holds_alternative<bool>(*slot)) return ICPP_TYPE_BOOL;
+    if (isNumber(*slot)) return ICPP_TYPE_NUMBER;
+    switch (AS_OBJ(*slot)->type()) {
+        case Obj::Type::STRING:
+            return ICPP_TYPE_STRING;
+        case Obj::Type::CLOSURE:
+        case Obj::Type::NATIVE:
+        case Obj::Type::BOUND_METHOD:
+        case Obj::Type::CLASS:
+            return ICPP_TYPE_CALLABLE;
+        default:
+            return ICPP_TYPE_OBJECT;
+    }
+}
+
+int icpp_to_bool(const IcppVM* vm, int index) {
+    Value* slot = slotAt(vm, index);
+    return slot && !isFalsey(*slot);
+}
+
+double icpp_to_number(const IcppVM* vm, int index) {
+    Value* slot = slotAt(vm, index);
+    return slot && isNumber(*slot) ? asNumber(*slot) : 0.0;
+}
+
+const char* icpp_to_string(const IcppVM* vm, int index, size_t* length) {
+    Value* slot = slotAt(vm, index);
+    if (slot == nullptr || !isObjType(*slot, Obj::Type::STRING)) return nullptr;
+    const ObjString* string = AS_STRING(*slot);
+    if (length) *length = string->length;
+    return string->c_str();
+}
+
+int icpp_get_global(IcppVM* vm, const char* name) {
+    auto it = vm->vm.globals.find(name);
+    bool found = it != vm->vm.globals.end();
+    int pushed = pushValue(vm, found ? it->second : Value(nullptr));
+    return found && pushed;
+}
+
+void icpp_set_global(IcppVM* vm, const char* name) {
+    if (icpp_get_top(vm) == 0) return;
+    vm->vm.globals[name] = vm->vm.pop();
+}
+
+void icpp_register_native(IcppVM* vm, const char* name, int arity,
+                          IcppNativeFn fn, void* userData) {
+    IcppVM* handle = vm;
+    NativeFn native = [handle, fn, userData](VM& machine, const std::vector<Value>& args) {
+        Value* top = machine.stackTop;
+        uint64_t failedCalls = handle->failedCalls;
+        handle->error.clear();
+
+        int pushed = fn(handle, static_cast<int>(args.size()), userData);
+        if (pushed < 0) {
+            if (!handle->error.empty()) return machine.nativeError(handle->error);
+            // A failed icpp_call() has already reported and unwound.
+            if (handle->failedCalls != failedCalls) return machine.nativeError("");
+            return machine.nativeError("Native function failed.");
+        }
+        Value result = pushed > 0 && machine.stackTop > top ? machine.stackTop[-1] : Value(nullptr);
+        machine.stackTop = top;
+        return result;
+    };
+    vm->vm.globals[name] = Value(vm->vm.newNative(native, arity));
+}
+
+void icpp_error(IcppVM* vm, const char* message) {
+    vm->error = message;
+}
+
+void icpp_flush(IcppVM* vm) {
+    vm->vm.out.flush();
+}
+
+IcppPool* icpp_pool_new(int threads) {
+    size_t count = threads > 0 ? static_cast<size_t>(threads) : std::thread::hardware_concurrency();
+    return new IcppPool(count);
+}
+
+void icpp_pool_free(IcppPool* pool) {
+    delete pool;
+}
+
+int icpp_pool_size(const IcppPool* pool) {
+    return static_cast<int>(pool->pool.size());
+}
+
+IcppScript* icpp_pool_compile(IcppPool* pool, const char* source, size_t length) {
+    ObjFunction* script = pool->cache.compile(std::string(source, length));
+    return reinterpret_cast<IcppScript*>(script);
+}
+
+void icpp_pool_submit(IcppPool* pool, IcppScript* script, const char* function,
+                      const char* const* args, int argCount,
+                      IcppPoolDoneFn done, void* userData) {
+    ObjFunction* code = reinterpret_cast<ObjFunction*>(script);
+    std::vector<std::string> strings(args, args + std::max(argCount, 0));
+    pool->pool.submit([code, name = std::string(function), strings = std::move(strings),
+                       done, userData](Isolate& isolate) {
+        std::string result;
+        bool ok = isolate.load(code) && isolate.call(name, strings, &result);
+        isolate.vm.out.flush();
+        if (done == nullptr) return;
+        if (ok) {
+            done(ICPP_OK, result.c_str(), result.size(), userData);
+        } else {
+            done(ICPP_RUNTIME_ERROR, nullptr, 0, userData);
+        }
+    });
+}
+
+void icpp_pool_wait(IcppPool* pool) {
+    pool->pool.wait();
+}
+
+}
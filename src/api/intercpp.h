@@ -0,0 +1,132 @@
+/* C API for embedding the interpreter.
+ *
+ * Values are exchanged through the VM stack: push arguments, call, read the
+ * result back with the icpp_to_* functions and pop it. Stack indices are
+ * negative and count down from the top, so -1 is the most recently pushed
+ * value. A VM must only be used by one thread at a time.
+ */
+#ifndef INTERCPP_H
+#define INTERCPP_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define INTERCPP_API_VERSION 2
+
+typedef struct IcppVM IcppVM;
+
+typedef enum {
+    ICPP_OK,
+    ICPP_COMPILE_ERROR,
+    ICPP_RUNTIME_ERROR
+} IcppResult;
+
+typedef enum {
+    ICPP_TYPE_NONE, /* index is outside the stack */
+    ICPP_TYPE_NIL,
+    ICPP_TYPE_BOOL,
+    ICPP_TYPE_NUMBER,
+    ICPP_TYPE_STRING,
+    ICPP_TYPE_CALLABLE,
+    ICPP_TYPE_OBJECT
+} IcppType;
+
+/* A native sees its argCount arguments at indices -argCount..-1. It returns
+ * 1 after pushing a result, 0 to return nil, or -1 to fail, either after
+ * icpp_error() or after an icpp_call() that did not return ICPP_OK. */
+typedef int (*IcppNativeFn)(IcppVM* vm, int argCount, void* userData);
+
+int icpp_api_version(void);
+
+IcppVM* icpp_new(void);
+void icpp_free(IcppVM* vm);
+
+/* Bytes of heap the VM may hold after a collection; 0 means unlimited.
+ * Exceeding it fails the running script with "Out of memory.". */
+void icpp_set_memory_limit(IcppVM* vm, size_t bytes);
+size_t icpp_memory_used(const IcppVM* vm);
+
+/* Adds a directory for `import` to search, after those added before. With
+ * none, imports resolve against the working directory. A module runs once
+ * per VM; later imports from any script the VM runs reuse it. */
+void icpp_add_module_path(IcppVM* vm, const char* dir);
+/* Keeps compiled modules in dir between runs; NULL turns that off. */
+void icpp_set_module_cache(IcppVM* vm, const char* dir);
+
+/* Compiles and runs source as a script. */
+IcppResult icpp_interpret(IcppVM* vm, const char* source, size_t length);
+/* Compiles source and pushes the script as a callable without running it. */
+IcppResult icpp_load(IcppVM* vm, const char* source, size_t length);
+/* Calls the value at -(argCount + 1) with the argCount values above it and
+ * replaces all of them with the result. On a runtime error the error is
+ * reported on stderr and the whole stack is reset. */
+IcppResult icpp_call(IcppVM* vm, int argCount);
+
+/* Pushes return 0 without pushing when the stack is full. */
+int icpp_push_nil(IcppVM* vm);
+int icpp_push_bool(IcppVM* vm, int value);
+int icpp_push_number(IcppVM* vm, double value);
+int icpp_push_string(IcppVM* vm, const char* chars, size_t length);
+/* Pushes a copy of the value at index. */
+int icpp_push_value(IcppVM* vm, int index);
+
+int icpp_get_top(const IcppVM* vm);
+void icpp_pop(IcppVM* vm, int count);
+
+IcppType icpp_type(const IcppVM* vm, int index);
+int icpp_to_bool(const IcppVM* vm, int index);
+double icpp_to_number(const IcppVM* vm, int index);
+/* Returns NULL if the value is not a string. The pointer stays valid while
+ * the value remains on the stack. */
+const char* icpp_to_string(const IcppVM* vm, int index, size_t* length);
+
+/* Pushes the global (nil if undefined) and returns whether it exists and
+ * was pushed. */
+int icpp_get_global(IcppVM* vm, const char* name);
+/* Pops the top value into the global. */
+void icpp_set_global(IcppVM* vm, const char* name);
+
+void icpp_register_native(IcppVM* vm, const char* name, int arity,
+                          IcppNativeFn fn, void* userData);
+/* Sets the message for a native that is about to return -1. */
+void icpp_error(IcppVM* vm, const char* message);
+
+/* Writes out anything the script printed that is still buffered. */
+void icpp_flush(IcppVM* vm);
+
+/* A pool runs one VM per thread. Scripts are compiled once for the whole
+ * pool and run once in each isolate before its first job that uses them. */
+typedef struct IcppPool IcppPool;
+typedef struct IcppScript IcppScript;
+
+/* Called on the worker thread when a job finishes. result is the printed
+ * form of the return value, or NULL if the job failed, and is only valid
+ * during the call. */
+typedef void (*IcppPoolDoneFn)(IcppResult status, const char* result,
+                               size_t length, void* userData);
+
+/* threads is the number of isolates; 0 means one per hardware thread. */
+IcppPool* icpp_pool_new(int threads);
+/* Finishes the queued jobs, then frees the pool and its scripts. */
+void icpp_pool_free(IcppPool* pool);
+int icpp_pool_size(const IcppPool* pool);
+
+/* Returns NULL on a compile error. Compiling the same source again returns
+ * the same script, which the pool owns. */
+IcppScript* icpp_pool_compile(IcppPool* pool, const char* source, size_t length);
+/* Queues a call of the global function defined by script with string
+ * arguments, which are copied. */
+void icpp_pool_submit(IcppPool* pool, IcppScript* script, const char* function,
+                      const char* const* args, int argCount,
+                      IcppPoolDoneFn done, void* userData);
+/* Blocks until every submitted job has finished. */
+void icpp_pool_wait(IcppPool* pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
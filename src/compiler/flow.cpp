@@ -0,0 +1,296 @@
+#include "flow.hpp"
+#include "../vm/object/function.hpp"
+#include <algorithm>
+
+void collectFunctions(ObjFunction* function, std::vector<ObjFunction*>& functions) {
+    functions.push_back(function);
+    for (const Value& constant : function->chunk.constants) {
+        if (isObjType(constant, Obj::Type::FUNCTION)) collectFunctions(AS_FUNCTION(constant), functions);
+    }
+}
+
+bool stackEffect(const Chunk& chunk, size_t offset, int& pops, int& pushes) {
+    switch (opAt(chunk, offset)) {
+        case OpCode::CONSTANT:
+        case OpCode::NIL:
+        case OpCode::TRUE:
+        case OpCode::FALSE:
+        case OpCode::GET_GLOBAL:
+        case OpCode::GET_LOCAL:
+        case OpCode::GET_UPVALUE:
+        case OpCode::CLASS:
+        case OpCode::CLOSURE:
+        case OpCode::GET_INDEX:
+        case OpCode::IMPORT:
+        case OpCode::NEGATE:
+        case OpCode::NOT:
+        case OpCode::BIT_NOT:
+        case OpCode::GET_PROPERTY:
+        case OpCode::YIELD:
+        case OpCode::CHECK_RANGE:
+        case OpCode::ADD:
+        case OpCode::SUBTRACT:
+        case OpCode::MULTIPLY:
+        case OpCode::DIVIDE:
+        case OpCode::MODULO:
+        case OpCode::POW:
+        case OpCode::BIT_AND:
+        case OpCode::BIT_OR:
+        case OpCode::BIT_XOR:
+        case OpCode::SHIFT_LEFT:
+        case OpCode::SHIFT_RIGHT:
+        case OpCode::EQUAL:
+        case OpCode::GREATER:
+        case OpCode::LESS:
+        case OpCode::SET_PROPERTY:
+        case OpCode::GET_SUPER:
+        case OpCode::GET_SUBSCRIPT:
+        case OpCode::RESUME:
+        case OpCode::SET_SUBSCRIPT:
+        case OpCode::CALL:
+        case OpCode::TAIL_CALL:
+        case OpCode::INVOKE:
+        case OpCode::BUILD_LIST:
+            pushes = 1;
+            break;
+        // These leave the slots below them as they were.
+        case OpCode::PRINT:
+        case OpCode::POP:
+        case OpCode::DEFINE_GLOBAL:
+        case OpCode::CLOSE_UPVALUE:
+        case OpCode::METHOD:
+        case OpCode::INHERIT:
+        case OpCode::SET_GLOBAL:
+        case OpCode::SET_LOCAL:
+        case OpCode::SET_UPVALUE:
+        case OpCode::JUMP_IF_FALSE:
+        case OpCode::JUMP:
+        case OpCode::LOOP:
+        case OpCode::INLINE_CALL:
+        case OpCode::INLINE_INVOKE:
+            pushes = 0;
+            break;
+        default:
+            return false;
+    }
+    pops = pushes - chunk.stackEffect(offset);
+    return true;
+}
+
+static bool merge(StackMap& map, size_t target, const std::vector<int>& stack, std::vector<size_t>& work) {
+    if (target >= map.reached.size()) return false;
+    if (!map.reached[target]) {
+        map.reached[target] = true;
+        map.before[target] = stack;
+        work.push_back(target);
+        return true;
+    }
+    std::vector<int>& known = map.before[target];
+    if (known.size() != stack.size()) return false;
+    bool changed = false;
+    for (size_t i = 0; i < known.size(); ++i) {
+        if (known[i] != stack[i] && known[i] != -1) {
+            known[i] = -1;
+            changed = true;
+        }
+    }
+    if (changed) work.push_back(target);
+    return true;
+}
+
+bool analyze(const ObjFunction* function, StackMap& map) {
+    const Chunk& chunk = function->chunk;
+    map.before.assign(chunk.code.size(), {});
+    map.reached.assign(chunk.code.size(), false);
+    map.maxDepth = function->arity + 1;
+    std::vector<size_t> work;
+    if (!merge(map, 0, std::vector<int>(function->arity + 1, -1), work)) return false;
+
+    while (!work.empty()) {
+        size_t offset = work.back();
+        work.pop_back();
+        OpCode op = opAt(chunk, offset);
+        if (op == OpCode::RETURN) continue;
+
+        int pops, pushes;
+        if (!stackEffect(chunk, offset, pops, pushes)) return false;
+        std::vector<int> stack = map.before[offset];
+        if (static_cast<int>(stack.size()) < pops) return false;
+        stack.resize(stack.size() - pops);
+        stack.insert(stack.end(), pushes, static_cast<int>(offset));
+        map.maxDepth = std::max(map.maxDepth, static_cast<int>(stack.size()));
+
+        size_t next = offset + chunk.instructionLength(offset);
+        switch (op) {
+            case OpCode::JUMP:
+                if (!merge(map, next + readShort(chunk, offset + 1), stack, work)) return false;
+                break;
+            case OpCode::JUMP_IF_FALSE:
+                if (!merge(map, next + readShort(chunk, offset + 1), stack, work)) return false;
+                if (!merge(map, next, stack, work)) return false;
+                break;
+            case OpCode::INLINE_CALL:
+            case OpCode::INLINE_INVOKE:
+                // The guard's skip operand ends the instruction.
+                if (!merge(map, next + readShort(chunk, next - 2), stack, work)) return false;
+                if (!merge(map, next, stack, work)) return false;
+                break;
+            case OpCode::LOOP:
+                if (readShort(chunk, offset + 1) > next) return false;
+                if (!merge(map, next - readShort(chunk, offset + 1), stack, work)) return false;
+                break;
+            default:
+                if (!merge(map, next, stack, work)) return false;
+                break;
+        }
+    }
+    return true;
+}
+
+bool relayout(Chunk& chunk, const std::unordered_map<size_t, Rewrite>& rewrites) {
+    Chunk rewritten;
+    // Where each old instruction's code starts, and where it starts for LOOPs,
+    // which land after any prefix.
+    std::vector<size_t> moved(chunk.code.size() + 1, 0);
+    std::vector<size_t> looped(chunk.code.size() + 1, 0);
+    std::vector<size_t> jumps;
+    for (size_t offset = 0; offset < chunk.code.size(); offset += chunk.instructionLength(offset)) {
+        moved[offset] = rewritten.code.size();
+        auto found = rewrites.find(offset);
+        const Rewrite* rewrite = found != rewrites.end() ? &found->second : nullptr;
+        if (rewrite) {
+            for (uint8_t byte : rewrite->prefix) {
+                rewritten.write(byte, chunk.getLine(offset), chunk.getColumn(offset));
+            }
+        }
+        looped[offset] = rewritten.code.size();
+
+        if (rewrite && rewrite->replaced) {
+            size_t inlinedEnd = rewrite->inlinedStart + rewrite->origins.size();
+            if (rewrite->inlined) {
+                rewritten.inlined.push_back({static_cast<uint32_t>(looped[offset] + rewrite->inlinedStart),
+                                             static_cast<uint32_t>(looped[offset] + inlinedEnd), rewrite->inlined});
+            }
+            for (size_t i = 0; i < rewrite->code.size(); ++i) {
+                if (rewrite->inlined && i >= rewrite->inlinedStart && i < inlinedEnd) {
+                    const Chunk& body = rewrite->inlined->chunk;
+                    size_t origin = rewrite->origins[i - rewrite->inlinedStart];
+                    rewritten.write(rewrite->code[i], body.getLine(origin), body.getColumn(origin));
+                } else {
+                    rewritten.write(rewrite->code[i], chunk.getLine(offset), chunk.getColumn(offset));
+                }
+            }
+            continue;
+        }
+        OpCode op = opAt(chunk, offset);
+        if (op == OpCode::JUMP || op == OpCode::JUMP_IF_FALSE || op == OpCode::LOOP) jumps.push_back(offset);
+        for (size_t i = 0; i < chunk.instructionLength(offset); ++i) {
+            rewritten.write(chunk.code[offset + i], chunk.getLine(offset + i), chunk.getColumn(offset + i));
+        }
+    }
+    moved[chunk.code.size()] = looped[chunk.code.size()] = rewritten.code.size();
+
+    for (size_t offset : jumps) {
+        size_t from = looped[offset] + 3;
+        size_t distance;
+        if (opAt(chunk, offset) == OpCode::LOOP) {
+            distance = from - looped[jumpTarget(chunk, offset)];
+        } else {
+            distance = moved[jumpTarget(chunk, offset)] - from;
+        }
+        if (distance > UINT16_MAX) return false;
+        rewritten.code[looped[offset] + 1] = static_cast<uint8_t>((distance >> 8) & 0xff);
+        rewritten.code[looped[offset] + 2] = static_cast<uint8_t>(distance & 0xff);
+    }
+
+    // Bodies inlined earlier move with the code around them.
+    for (const InlinedCode& code : chunk.inlined) {
+        rewritten.inlined.push_back({static_cast<uint32_t>(moved[code.start]),
+                                     static_cast<uint32_t>(moved[code.end]), code.function});
+    }
+    std::sort(rewritten.inlined.begin(), rewritten.inlined.end(),
+              [](const InlinedCode& a, const InlinedCode& b) { return a.start < b.start; });
+
+    chunk.code = std::move(rewritten.code);
+    chunk.lines = std::move(rewritten.lines);
+    chunk.columns = std::move(rewritten.columns);
+    chunk.inlined = std::move(rewritten.inlined);
+    return true;
+}
+
+bool widenJumps(Chunk& chunk, const std::unordered_map<size_t, size_t>& pending) {
+    struct Jump {
+        size_t offset;
+        size_t target;
+        bool backward;
+        bool wide;
+    };
+    std::vector<Jump> jumps;
+    for (size_t offset = 0; offset < chunk.code.size(); offset += chunk.instructionLength(offset)) {
+        uint32_t operand;
+        size_t start = chunk.readWide(offset, operand);
+        OpCode op = opAt(chunk, start);
+        if (op != OpCode::JUMP && op != OpCode::JUMP_IF_FALSE && op != OpCode::LOOP) continue;
+        size_t after = offset + chunk.instructionLength(offset);
+        size_t distance = (operand & ~0xffu) << 8 | readShort(chunk, start + 1);
+        auto found = pending.find(offset);
+        size_t target = found != pending.end() ? found->second
+                      : op == OpCode::LOOP ? after - distance : after + distance;
+        jumps.push_back({offset, target, op == OpCode::LOOP, start != offset});
+    }
+
+    // Widening a jump moves the code after it, which can push other jumps
+    // past 16 bits in turn, so lay out until nothing more needs widening.
+    std::vector<size_t> moved(chunk.code.size() + 1, 0);
+    for (bool changed = true; changed;) {
+        changed = false;
+        size_t next = 0;
+        size_t size = 0;
+        for (size_t offset = 0; offset < chunk.code.size(); offset += chunk.instructionLength(offset)) {
+            moved[offset] = size;
+            if (next < jumps.size() && jumps[next].offset == offset) {
+                size += jumps[next++].wide ? 5 : 3;
+            } else {
+                size += chunk.instructionLength(offset);
+            }
+        }
+        moved[chunk.code.size()] = size;
+        for (Jump& jump : jumps) {
+            size_t after = moved[jump.offset] + (jump.wide ? 5 : 3);
+            size_t distance = jump.backward ? after - moved[jump.target] : moved[jump.target] - after;
+            if (distance > 0xffffff) return false;
+            if (distance > UINT16_MAX && !jump.wide) {
+                jump.wide = true;
+                changed = true;
+            }
+        }
+    }
+
+    Chunk rewritten;
+    size_t next = 0;
+    for (size_t offset = 0; offset < chunk.code.size(); offset += chunk.instructionLength(offset)) {
+        if (next == jumps.size() || jumps[next].offset != offset) {
+            for (size_t i = 0; i < chunk.instructionLength(offset); ++i) {
+                rewritten.write(chunk.code[offset + i], chunk.getLine(offset + i), chunk.getColumn(offset + i));
+            }
+            continue;
+        }
+        const Jump& jump = jumps[next++];
+        size_t start = offset;
+        while (opAt(chunk, start) == OpCode::WIDE) start += 2;
+        size_t after = rewritten.code.size() + (jump.wide ? 5 : 3);
+        size_t distance = jump.backward ? after - moved[jump.target] : moved[jump.target] - after;
+        int line = chunk.getLine(start);
+        int column = chunk.getColumn(start);
+        if (jump.wide) {
+            rewritten.write(static_cast<uint8_t>(OpCode::WIDE), line, column);
+            rewritten.write(static_cast<uint8_t>((distance >> 16) & 0xff), line, column);
+        }
+        rewritten.write(chunk.code[start], line, column);
+        rewritten.write(static_cast<uint8_t>((distance >> 8) & 0xff), line, column);
+        rewritten.write(static_cast<uint8_t>(distance & 0xff), line, column);
+    }
+    chunk.code = std::move(rewritten.code);
+    chunk.lines = std::move(rewritten.lines);
+    return true;
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include "../vm/chunk.hpp"
+#include <unordered_map>
+#include <vector>
+
+class ObjFunction;
+
+// What the passes that rewrite compiled bytecode share: reading operands,
+// following the operand stack through a function, and laying a chunk out
+// again around new code.
+
+// GET_LOCAL and SET_LOCAL address a frame's slots with one byte.
+constexpr int MAX_LOCAL_SLOTS = UINT8_MAX + 1;
+
+inline OpCode opAt(const Chunk& chunk, size_t offset) {
+    return static_cast<OpCode>(chunk.code[offset]);
+}
+
+inline size_t readShort(const Chunk& chunk, size_t offset) {
+    return static_cast<size_t>(chunk.code[offset] << 8 | chunk.code[offset + 1]);
+}
+
+// Where the JUMP, JUMP_IF_FALSE or LOOP at offset lands.
+inline size_t jumpTarget(const Chunk& chunk, size_t offset) {
+    size_t after = offset + 3;
+    if (opAt(chunk, offset) == OpCode::LOOP) return after - readShort(chunk, offset + 1);
+    return after + readShort(chunk, offset + 1);
+}
+
+// The function and every function nested in it, outermost first.
+void collectFunctions(ObjFunction* function, std::vector<ObjFunction*>& functions);
+
+// How many values the instruction at offset pops and then pushes. False for
+// instructions the passes do not model, which keeps them out of the function.
+bool stackEffect(const Chunk& chunk, size_t offset, int& pops, int& pushes);
+
+// The operand stack before each reachable instruction, recorded as the
+// offset of the instruction that pushed each slot. Parameters, and slots
+// that different paths fill from different places, are -1.
+struct StackMap {
+    std::vector<std::vector<int>> before;
+    std::vector<bool> reached;
+    int maxDepth = 0;
+};
+
+bool analyze(const ObjFunction* function, StackMap& map);
+
+// New code for one instruction of a chunk being laid out again.
+struct Rewrite {
+    // Runs before the instruction when it is entered from above; LOOPs back
+    // to the instruction skip it.
+    std::vector<uint8_t> prefix;
+    // Whether code stands in for the instruction, which is otherwise copied.
+    bool replaced = false;
+    std::vector<uint8_t> code;
+    // A function whose body fills code from inlinedStart on, and the offset
+    // in it each of those bytes came from, for line numbers.
+    const ObjFunction* inlined = nullptr;
+    size_t inlinedStart = 0;
+    std::vector<size_t> origins;
+};
+
+// Applies rewrites, keyed by instruction offset, and retargets the jumps
+// that were copied. Jumps inside new code must already be relative to it.
+// False, leaving the chunk alone, if a jump no longer fits its operand.
+bool relayout(Chunk& chunk, const std::unordered_map<size_t, Rewrite>& rewrites);
+
+// Lays chunk out again with a WIDE prefix on each jump whose distance needs
+// more than 16 bits. pending holds the targets of jumps, keyed by offset,
+// whose operand the parser could not fill in. False if a jump needs more
+// than 24 bits.
+bool widenJumps(Chunk& chunk, const std::unordered_map<size_t, size_t>& pending);
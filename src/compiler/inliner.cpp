@@ -0,0 +1,292 @@
+#include "inliner.hpp"
+#include "flow.hpp"
+#include "../vm/object/function.hpp"
+#include "../vm/object/string.hpp"
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Callees whose code up to their RETURN is longer than this stay calls.
+static constexpr size_t MAX_INLINE_BYTES = 32;
+
+static std::string constantName(const Chunk& chunk, size_t offset) {
+    return std::string(AS_STRING(chunk.constants[chunk.code[offset + 1]])->view());
+}
+
+// A callee that can be copied into its callers: no upvalues, no calls, no
+// loops, and a single RETURN that every path reaches.
+struct Inlinee {
+    bool ok = false;
+    // Offset of that RETURN, which is also how much code is copied.
+    size_t length = 0;
+    // Stack depth at the RETURN, counting slot zero and the result.
+    int returnDepth = 0;
+    int maxDepth = 0;
+};
+
+static Inlinee examine(const ObjFunction* function) {
+    Inlinee inlinee;
+    const Chunk& chunk = function->chunk;
+    if (function->upvalueCount != 0) return inlinee;
+
+    size_t end = 0;
+    while (end < chunk.code.size() && opAt(chunk, end) != OpCode::RETURN) {
+        switch (opAt(chunk, end)) {
+            case OpCode::CONSTANT:
+            case OpCode::NIL:
+            case OpCode::TRUE:
+            case OpCode::FALSE:
+            case OpCode::ADD:
+            case OpCode::SUBTRACT:
+            case OpCode::MULTIPLY:
+            case OpCode::DIVIDE:
+            case OpCode::NEGATE:
+            case OpCode::MODULO:
+            case OpCode::POW:
+            case OpCode::BIT_AND:
+            case OpCode::BIT_OR:
+            case OpCode::BIT_XOR:
+            case OpCode::BIT_NOT:
+            case OpCode::SHIFT_LEFT:
+            case OpCode::SHIFT_RIGHT:
+            case OpCode::NOT:
+            case OpCode::EQUAL:
+            case OpCode::GREATER:
+            case OpCode::LESS:
+            case OpCode::PRINT:
+            case OpCode::POP:
+            case OpCode::GET_GLOBAL:
+            case OpCode::SET_GLOBAL:
+            case OpCode::GET_LOCAL:
+            case OpCode::SET_LOCAL:
+            case OpCode::GET_PROPERTY:
+            case OpCode::SET_PROPERTY:
+            case OpCode::BUILD_LIST:
+            case OpCode::GET_SUBSCRIPT:
+            case OpCode::SET_SUBSCRIPT:
+            case OpCode::JUMP_IF_FALSE:
+            case OpCode::JUMP:
+                break;
+            default:
+                return inlinee;
+        }
+        end += chunk.instructionLength(end);
+        if (end > MAX_INLINE_BYTES) return inlinee;
+    }
+    if (end >= chunk.code.size()) return inlinee;
+
+    // Forward jumps may land on the RETURN but not past it.
+    for (size_t offset = 0; offset < end; offset += chunk.instructionLength(offset)) {
+        OpCode op = opAt(chunk, offset);
+        if ((op == OpCode::JUMP || op == OpCode::JUMP_IF_FALSE) && offset + 3 + readShort(chunk, offset + 1) > end) {
+            return inlinee;
+        }
+    }
+
+    StackMap map;
+    if (!analyze(function, map) || !map.reached[end]) return inlinee;
+    inlinee.ok = true;
+    inlinee.length = end;
+    inlinee.returnDepth = static_cast<int>(map.before[end].size());
+    inlinee.maxDepth = map.maxDepth;
+    return inlinee;
+}
+
+// Functions a call or invoke could reach by name, or nullptr for names the
+// script binds to more than one thing.
+struct Targets {
+    std::unordered_map<std::string, ObjFunction*> globals;
+    std::unordered_map<std::string, ObjFunction*> methods;
+};
+
+static void addTarget(std::unordered_map<std::string, ObjFunction*>& targets, const std::string& name,
+                      ObjFunction* function) {
+    auto it = targets.find(name);
+    if (it == targets.end()) {
+        targets.emplace(name, function);
+    } else if (it->second != function) {
+        it->second = nullptr;
+    }
+}
+
+// Global functions, global classes' initializers and every method, found by
+// the instruction sequences the parser emits to define them.
+static void collectTargets(const std::vector<ObjFunction*>& functions, Targets& targets) {
+    for (const ObjFunction* function : functions) {
+        const Chunk& chunk = function->chunk;
+        ObjFunction* closure = nullptr;
+        std::string className;
+        bool globalClass = false;
+        OpCode previous = OpCode::RETURN;
+        for (size_t offset = 0; offset < chunk.code.size(); offset += chunk.instructionLength(offset)) {
+            OpCode op = opAt(chunk, offset);
+            switch (op) {
+                case OpCode::CLOSURE:
+                    closure = AS_FUNCTION(chunk.constants[chunk.code[offset + 1]]);
+                    break;
+                case OpCode::CLASS:
+                    className = constantName(chunk, offset);
+                    globalClass = false;
+                    break;
+                case OpCode::DEFINE_GLOBAL: {
+                    std::string name = constantName(chunk, offset);
+                    if (previous == OpCode::CLOSURE) {
+                        addTarget(targets.globals, name, closure);
+                    } else if (previous == OpCode::CLASS && name == className) {
+                        globalClass = true;
+                    } else {
+                        addTarget(targets.globals, name, nullptr);
+                    }
+                    break;
+                }
+                case OpCode::METHOD: {
+                    if (previous != OpCode::CLOSURE) break;
+                    std::string name = constantName(chunk, offset);
+                    addTarget(targets.methods, name, closure);
+                    if (globalClass && name == "init") addTarget(targets.globals, className, closure);
+                    break;
+                }
+                default:
+                    break;
+            }
+            previous = op;
+        }
+    }
+}
+
+// Index of value in chunk's constants, adding it if needed; -1 when full.
+static int constantIndex(Chunk& chunk, Value value) {
+    for (size_t i = 0; i < chunk.constants.size(); ++i) {
+        if (ConstantEqual()(chunk.constants[i], value)) return static_cast<int>(i);
+    }
+    if (chunk.constants.size() > UINT8_MAX) return -1;
+    return chunk.addConstant(value);
+}
+
+// Appends the callee's code up to its RETURN with its slots moved up to base
+// and its constants moved into chunk, then leaves the result in base.
+static bool emitBody(Chunk& chunk, const Inlinee& inlinee, int base, Rewrite& expansion) {
+    const Chunk& body = expansion.inlined->chunk;
+    std::vector<uint8_t>& out = expansion.code;
+    for (size_t offset = 0; offset < inlinee.length; offset += body.instructionLength(offset)) {
+        expansion.origins.resize(out.size() - expansion.inlinedStart + body.instructionLength(offset), offset);
+        out.push_back(body.code[offset]);
+        switch (opAt(body, offset)) {
+            case OpCode::GET_LOCAL:
+            case OpCode::SET_LOCAL:
+                out.push_back(static_cast<uint8_t>(body.code[offset + 1] + base));
+                break;
+            case OpCode::CONSTANT:
+            case OpCode::GET_GLOBAL:
+            case OpCode::SET_GLOBAL:
+            case OpCode::GET_PROPERTY:
+            case OpCode::SET_PROPERTY: {
+                int constant = constantIndex(chunk, body.constants[body.code[offset + 1]]);
+                if (constant < 0) return false;
+                out.push_back(static_cast<uint8_t>(constant));
+                break;
+            }
+            default:
+                for (size_t i = 1; i < body.instructionLength(offset); ++i) {
+                    out.push_back(body.code[offset + i]);
+                }
+                break;
+        }
+    }
+    out.push_back(static_cast<uint8_t>(OpCode::SET_LOCAL));
+    out.push_back(static_cast<uint8_t>(base));
+    for (int i = 1; i < inlinee.returnDepth; ++i) {
+        out.push_back(static_cast<uint8_t>(OpCode::POP));
+    }
+    expansion.origins.resize(out.size() - expansion.inlinedStart, inlinee.length);
+    return true;
+}
+
+// Builds the code that replaces the call at offset: a guard, the inlined
+// body, a jump past the original call, and the original call for the guard
+// to fall back on. False if the call is not worth or not safe to inline.
+static bool expandCall(Chunk& chunk, size_t offset, const std::vector<int>& stack, const Targets& targets,
+                       std::unordered_map<const ObjFunction*, Inlinee>& inlinees, Rewrite& expansion) {
+    OpCode op = opAt(chunk, offset);
+    int argCount;
+    ObjFunction* callee = nullptr;
+    if (op == OpCode::INVOKE) {
+        argCount = chunk.code[offset + 2];
+        auto it = targets.methods.find(constantName(chunk, offset));
+        if (it != targets.methods.end()) callee = it->second;
+    } else {
+        argCount = chunk.code[offset + 1];
+        int producer = stack[stack.size() - argCount - 1];
+        if (producer >= 0 && opAt(chunk, producer) == OpCode::GET_GLOBAL) {
+            auto it = targets.globals.find(constantName(chunk, producer));
+            if (it != targets.globals.end()) callee = it->second;
+        }
+    }
+    if (callee == nullptr || callee->arity != argCount) return false;
+
+    auto cached = inlinees.find(callee);
+    if (cached == inlinees.end()) cached = inlinees.emplace(callee, examine(callee)).first;
+    const Inlinee& inlinee = cached->second;
+    int base = static_cast<int>(stack.size()) - argCount - 1;
+    if (!inlinee.ok || base + inlinee.maxDepth > MAX_LOCAL_SLOTS) return false;
+
+    int function = constantIndex(chunk, Value(callee));
+    if (function < 0) return false;
+    std::vector<uint8_t>& out = expansion.code;
+    if (op == OpCode::INVOKE) {
+        out = {static_cast<uint8_t>(OpCode::INLINE_INVOKE), chunk.code[offset + 1], chunk.code[offset + 2]};
+    } else {
+        out = {static_cast<uint8_t>(OpCode::INLINE_CALL), chunk.code[offset + 1]};
+    }
+    out.push_back(static_cast<uint8_t>(function));
+    size_t skipAt = out.size();
+    out.resize(out.size() + 2);
+    expansion.inlinedStart = out.size();
+    expansion.inlined = callee;
+    if (!emitBody(chunk, inlinee, base, expansion)) return false;
+
+    size_t skip = out.size() - expansion.inlinedStart + 3;
+    out[skipAt] = static_cast<uint8_t>((skip >> 8) & 0xff);
+    out[skipAt + 1] = static_cast<uint8_t>(skip & 0xff);
+    size_t length = chunk.instructionLength(offset);
+    out.push_back(static_cast<uint8_t>(OpCode::JUMP));
+    out.push_back(static_cast<uint8_t>((length >> 8) & 0xff));
+    out.push_back(static_cast<uint8_t>(length & 0xff));
+    out.insert(out.end(), chunk.code.begin() + offset, chunk.code.begin() + offset + length);
+    return true;
+}
+
+static void inlineInto(ObjFunction* function, const Targets& targets,
+                       std::unordered_map<const ObjFunction*, Inlinee>& inlinees) {
+    Chunk& chunk = function->chunk;
+    StackMap map;
+    if (!analyze(function, map)) return;
+
+    std::unordered_map<size_t, Rewrite> expansions;
+    for (size_t offset = 0; offset < chunk.code.size(); offset += chunk.instructionLength(offset)) {
+        if (!map.reached[offset]) continue;
+        OpCode op = opAt(chunk, offset);
+        if (op != OpCode::CALL && op != OpCode::TAIL_CALL && op != OpCode::INVOKE) continue;
+        Rewrite expansion;
+        if (expandCall(chunk, offset, map.before[offset], targets, inlinees, expansion)) {
+            expansion.replaced = true;
+            expansions.emplace(offset, std::move(expansion));
+        }
+    }
+    if (!expansions.empty() && relayout(chunk, expansions)) {
+        function->maxSlots = chunk.maxStackDepth(function->arity);
+    }
+}
+
+void inlineCalls(ObjFunction* script) {
+    std::vector<ObjFunction*> functions;
+    collectFunctions(script, functions);
+    Targets targets;
+    collectTargets(functions, targets);
+
+    std::unordered_map<const ObjFunction*, Inlinee> inlinees;
+    for (ObjFunction* function : functions) {
+        inlineInto(function, targets, inlinees);
+    }
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+class ObjFunction;
+
+// Replaces calls to small leaf functions, methods and initializers that a
+// freshly compiled script defines with a copy of the callee's body. Each
+// copy sits behind an INLINE_CALL or INLINE_INVOKE guard that checks the
+// callee is still the inlined function and otherwise jumps to the original
+// call, so reassigning a global or overriding a method stays correct.
+void inlineCalls(ObjFunction* script);
@@ -0,0 +1,348 @@
+#include "loops.hpp"
+#include "flow.hpp"
+#include "../vm/object/function.hpp"
+#include "../vm/object/string.hpp"
+#include <algorithm>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// A loop as the parser lays out while and for: the condition starts at
+// header, its JUMP_IF_FALSE leaves for exit, where a POP drops it, and every
+// LOOP back into the loop sits between the two.
+struct Loop {
+    size_t header;
+    size_t exit;
+    // Stack depth at the header; the loop's own locals start here.
+    int depth;
+};
+
+static std::string_view constantName(const Chunk& chunk, size_t offset) {
+    return AS_STRING(chunk.constants[chunk.code[offset + 1]])->view();
+}
+
+static bool isJump(OpCode op) {
+    return op == OpCode::JUMP || op == OpCode::JUMP_IF_FALSE || op == OpCode::LOOP;
+}
+
+// Instructions that can run code the loop cannot see, which might assign the
+// globals and locals the optimizations rely on staying put.
+static bool runsOtherCode(OpCode op) {
+    switch (op) {
+        case OpCode::CALL:
+        case OpCode::TAIL_CALL:
+        case OpCode::INVOKE:
+        case OpCode::INLINE_CALL:
+        case OpCode::INLINE_INVOKE:
+        case OpCode::YIELD:
+        case OpCode::RESUME:
+        case OpCode::IMPORT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static std::vector<bool> jumpTargets(const Chunk& chunk) {
+    std::vector<bool> targets(chunk.code.size() + 1, false);
+    for (size_t offset = 0; offset < chunk.code.size(); offset += chunk.instructionLength(offset)) {
+        OpCode op = opAt(chunk, offset);
+        if (isJump(op)) {
+            targets[jumpTarget(chunk, offset)] = true;
+        } else if (op == OpCode::INLINE_CALL || op == OpCode::INLINE_INVOKE) {
+            size_t next = offset + chunk.instructionLength(offset);
+            targets[next + readShort(chunk, next - 2)] = true;
+        }
+    }
+    return targets;
+}
+
+// Whether [header, exit) is a loop the passes can rewrite: entered only at
+// its header, left only through exit or a RETURN, and free of calls.
+static bool isSimpleLoop(const Chunk& chunk, const StackMap& map, size_t header, size_t exit) {
+    if (exit >= chunk.code.size() || opAt(chunk, exit) != OpCode::POP) return false;
+    if (!map.reached[header] || !map.reached[exit]) return false;
+    if (map.before[exit].size() != map.before[header].size() + 1) return false;
+
+    bool leaves = false;
+    for (size_t offset = 0; offset < chunk.code.size(); offset += chunk.instructionLength(offset)) {
+        OpCode op = opAt(chunk, offset);
+        bool inside = offset >= header && offset < exit;
+        if (inside && runsOtherCode(op)) return false;
+        if (!isJump(op)) continue;
+        size_t target = jumpTarget(chunk, offset);
+        if (inside) {
+            if (target < header || target > exit) return false;
+            if (op == OpCode::JUMP_IF_FALSE && target == exit) leaves = true;
+        } else if (target > header && target < exit) {
+            return false;
+        } else if (target == header && op == OpCode::LOOP) {
+            return false;
+        }
+    }
+    return leaves;
+}
+
+// Simple loops, outermost first. The spans from each LOOP back to its target
+// are the loops, except that a for loop with an increment clause has two
+// spans that overlap without either containing the other.
+static std::vector<Loop> findLoops(const Chunk& chunk, const StackMap& map) {
+    std::vector<std::pair<size_t, size_t>> spans;
+    for (size_t offset = 0; offset < chunk.code.size(); offset += chunk.instructionLength(offset)) {
+        if (map.reached[offset] && opAt(chunk, offset) == OpCode::LOOP) {
+            spans.push_back({jumpTarget(chunk, offset), offset + 3});
+        }
+    }
+    for (size_t i = 0; i < spans.size(); ++i) {
+        for (size_t j = i + 1; j < spans.size(); ++j) {
+            auto [first, second] = std::minmax(spans[i], spans[j]);
+            if (second.first > first.first && second.first < first.second && second.second > first.second) {
+                spans[i] = {first.first, second.second};
+                spans.erase(spans.begin() + j);
+                j = i;
+            }
+        }
+    }
+    std::sort(spans.begin(), spans.end(), [](const auto& a, const auto& b) {
+        return a.first != b.first ? a.first < b.first : a.second > b.second;
+    });
+
+    std::vector<Loop> loops;
+    for (const auto& [header, exit] : spans) {
+        if (isSimpleLoop(chunk, map, header, exit)) {
+            loops.push_back({header, exit, static_cast<int>(map.before[header].size())});
+        }
+    }
+    return loops;
+}
+
+// Makes room for count hidden slots that prefix pushes ahead of the loop:
+// the loop's own locals move up past them and the exit pops them again.
+// Instructions already in rewrites are left as they are. Every slot stays
+// below maxDepth + count, so capping that keeps operands in a byte.
+static bool addSlots(const Chunk& chunk, const StackMap& map, const Loop& loop, int count,
+                     std::vector<uint8_t> prefix, std::unordered_map<size_t, Rewrite>& rewrites) {
+    if (map.maxDepth + count > MAX_LOCAL_SLOTS) return false;
+    for (size_t offset = loop.header; offset < loop.exit; offset += chunk.instructionLength(offset)) {
+        if (rewrites.count(offset)) continue;
+        OpCode op = opAt(chunk, offset);
+        if (op != OpCode::GET_LOCAL && op != OpCode::SET_LOCAL && op != OpCode::CLOSURE) continue;
+        Rewrite rewrite;
+        rewrite.replaced = true;
+        rewrite.code.assign(chunk.code.begin() + offset, chunk.code.begin() + offset + chunk.instructionLength(offset));
+        bool changed = false;
+        if (op == OpCode::CLOSURE) {
+            for (size_t i = 2; i < rewrite.code.size(); i += 2) {
+                bool local = static_cast<Capture>(rewrite.code[i]) != Capture::UPVALUE;
+                if (local && rewrite.code[i + 1] >= loop.depth) {
+                    rewrite.code[i + 1] = static_cast<uint8_t>(rewrite.code[i + 1] + count);
+                    changed = true;
+                }
+            }
+        } else if (rewrite.code[1] >= loop.depth) {
+            rewrite.code[1] = static_cast<uint8_t>(rewrite.code[1] + count);
+            changed = true;
+        }
+        if (changed) rewrites.emplace(offset, std::move(rewrite));
+    }
+
+    rewrites[loop.header].prefix = std::move(prefix);
+    Rewrite& exit = rewrites[loop.exit];
+    exit.replaced = true;
+    exit.code.assign(count + 1, static_cast<uint8_t>(OpCode::POP));
+    return true;
+}
+
+// Loads globals the script defined before the loop and the loop never
+// assigns once, into hidden slots, and reads those instead. Only scripts
+// qualify: a function can run before the globals it names exist.
+static bool hoistGlobals(ObjFunction* function, const StackMap& map, const Loop& loop) {
+    Chunk& chunk = function->chunk;
+    std::vector<std::string_view> defined;
+    std::vector<std::string_view> assigned;
+    for (size_t offset = 0; offset < loop.exit; offset += chunk.instructionLength(offset)) {
+        OpCode op = opAt(chunk, offset);
+        if (op == OpCode::DEFINE_GLOBAL && offset < loop.header && map.reached[offset]) {
+            defined.push_back(constantName(chunk, offset));
+        } else if ((op == OpCode::SET_GLOBAL || op == OpCode::DEFINE_GLOBAL) && offset >= loop.header) {
+            assigned.push_back(constantName(chunk, offset));
+        }
+    }
+
+    std::vector<std::string_view> hoisted;
+    std::vector<uint8_t> prefix;
+    std::unordered_map<size_t, Rewrite> rewrites;
+    for (size_t offset = loop.header; offset < loop.exit; offset += chunk.instructionLength(offset)) {
+        if (opAt(chunk, offset) != OpCode::GET_GLOBAL) continue;
+        std::string_view name = constantName(chunk, offset);
+        if (std::find(defined.begin(), defined.end(), name) == defined.end() ||
+            std::find(assigned.begin(), assigned.end(), name) != assigned.end()) {
+            continue;
+        }
+        auto slot = std::find(hoisted.begin(), hoisted.end(), name);
+        if (slot == hoisted.end()) {
+            slot = hoisted.insert(hoisted.end(), name);
+            prefix.push_back(static_cast<uint8_t>(OpCode::GET_GLOBAL));
+            prefix.push_back(chunk.code[offset + 1]);
+        }
+        Rewrite& load = rewrites[offset];
+        load.replaced = true;
+        load.code = {static_cast<uint8_t>(OpCode::GET_LOCAL),
+                     static_cast<uint8_t>(loop.depth + (slot - hoisted.begin()))};
+    }
+
+    int count = static_cast<int>(hoisted.size());
+    if (count == 0 || !addSlots(chunk, map, loop, count, std::move(prefix), rewrites)) return false;
+    return relayout(chunk, rewrites);
+}
+
+// The parts of a counted for loop:
+//
+//   header:    GET_LOCAL i, CONSTANT n or GET_LOCAL n, LESS, JUMP_IF_FALSE exit, POP, JUMP body
+//   increment: GET_LOCAL i, CONSTANT step, ADD, SET_LOCAL i, POP, LOOP header
+//   body:      ..., LOOP increment
+//
+// With i and n locals from outside the loop, a positive step, and no other
+// assignment to either, i only grows from its value on entry and is below
+// n throughout the body.
+struct CountedLoop {
+    uint8_t index;
+    // The instruction that pushes the bound, to be repeated before the loop.
+    size_t bound;
+    size_t increment;
+    size_t body;
+};
+
+static bool assignsLocal(const Chunk& chunk, const Loop& loop, uint8_t slot, size_t except) {
+    for (size_t offset = loop.header; offset < loop.exit; offset += chunk.instructionLength(offset)) {
+        if (offset != except && opAt(chunk, offset) == OpCode::SET_LOCAL && chunk.code[offset + 1] == slot) return true;
+    }
+    return false;
+}
+
+static bool isPositiveNumber(const Value& value) {
+    return isNumber(value) && asNumber(value) > 0;
+}
+
+static bool matchCounted(const Chunk& chunk, const Loop& loop, CountedLoop& counted) {
+    // Walks the fixed sequence, failing on the first instruction that differs.
+    size_t offset = loop.header;
+    auto expect = [&](OpCode op) {
+        if (offset >= loop.exit || opAt(chunk, offset) != op) return false;
+        offset += chunk.instructionLength(offset);
+        return true;
+    };
+
+    if (opAt(chunk, offset) != OpCode::GET_LOCAL) return false;
+    counted.index = chunk.code[offset + 1];
+    if (counted.index >= loop.depth) return false;
+    offset += 2;
+    counted.bound = offset;
+    OpCode boundOp = opAt(chunk, offset);
+    if (boundOp == OpCode::CONSTANT) {
+        if (!isNumber(chunk.constants[chunk.code[offset + 1]])) return false;
+    } else if (boundOp == OpCode::GET_LOCAL) {
+        uint8_t bound = chunk.code[offset + 1];
+        if (bound >= loop.depth || bound == counted.index || assignsLocal(chunk, loop, bound, chunk.code.size())) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    offset += 2;
+    if (!expect(OpCode::LESS)) return false;
+    size_t exitJump = offset;
+    if (!expect(OpCode::JUMP_IF_FALSE) || jumpTarget(chunk, exitJump) != loop.exit) return false;
+    if (!expect(OpCode::POP)) return false;
+    size_t bodyJump = offset;
+    if (!expect(OpCode::JUMP)) return false;
+
+    counted.increment = offset;
+    if (!expect(OpCode::GET_LOCAL) || chunk.code[offset - 1] != counted.index) return false;
+    if (!expect(OpCode::CONSTANT) || !isPositiveNumber(chunk.constants[chunk.code[offset - 1]])) return false;
+    if (!expect(OpCode::ADD)) return false;
+    size_t store = offset;
+    if (!expect(OpCode::SET_LOCAL) || chunk.code[offset - 1] != counted.index) return false;
+    if (!expect(OpCode::POP)) return false;
+    size_t backToHeader = offset;
+    if (!expect(OpCode::LOOP) || jumpTarget(chunk, backToHeader) != loop.header) return false;
+
+    counted.body = offset;
+    if (jumpTarget(chunk, bodyJump) != counted.body) return false;
+    if (opAt(chunk, loop.exit - 3) != OpCode::LOOP || jumpTarget(chunk, loop.exit - 3) != counted.increment) {
+        return false;
+    }
+    return !assignsLocal(chunk, loop, counted.index, store);
+}
+
+// Rewrites `list[i]` in the body of a counted loop, where list is a local
+// from outside the loop that it never assigns, into a GET_INDEX that reads
+// both slots directly. Ahead of the loop, CHECK_RANGE records in a hidden
+// slot per list whether i starts at zero or more and n is at most the
+// list's length; lists never change length, so while that holds every
+// access is in bounds and GET_INDEX skips its checks.
+static bool proveRanges(ObjFunction* function, const StackMap& map, const Loop& loop) {
+    Chunk& chunk = function->chunk;
+    CountedLoop counted;
+    if (!matchCounted(chunk, loop, counted)) return false;
+
+    std::vector<bool> targets = jumpTargets(chunk);
+    std::vector<uint8_t> lists;
+    std::unordered_map<size_t, Rewrite> rewrites;
+    size_t bodyEnd = loop.exit - 3;
+    for (size_t offset = counted.body; offset < bodyEnd; offset += chunk.instructionLength(offset)) {
+        if (!map.reached[offset] || opAt(chunk, offset) != OpCode::GET_LOCAL) continue;
+        size_t index = offset + 2;
+        size_t subscript = index + 2;
+        if (subscript >= bodyEnd || targets[index] || targets[subscript]) continue;
+        if (opAt(chunk, index) != OpCode::GET_LOCAL || chunk.code[index + 1] != counted.index) continue;
+        if (opAt(chunk, subscript) != OpCode::GET_SUBSCRIPT) continue;
+        uint8_t list = chunk.code[offset + 1];
+        if (list >= loop.depth || list == counted.index || assignsLocal(chunk, loop, list, chunk.code.size())) continue;
+
+        auto slot = std::find(lists.begin(), lists.end(), list);
+        if (slot == lists.end()) slot = lists.insert(lists.end(), list);
+        // GET_INDEX takes the subscript's place so errors point at it.
+        rewrites[offset].replaced = true;
+        rewrites[index].replaced = true;
+        Rewrite& get = rewrites[subscript];
+        get.replaced = true;
+        get.code = {static_cast<uint8_t>(OpCode::GET_INDEX), list, counted.index,
+                    static_cast<uint8_t>(loop.depth + (slot - lists.begin()))};
+    }
+
+    int count = static_cast<int>(lists.size());
+    if (count == 0) return false;
+    std::vector<uint8_t> prefix;
+    for (uint8_t list : lists) {
+        prefix.push_back(chunk.code[counted.bound]);
+        prefix.push_back(chunk.code[counted.bound + 1]);
+        prefix.push_back(static_cast<uint8_t>(OpCode::CHECK_RANGE));
+        prefix.push_back(list);
+        prefix.push_back(counted.index);
+    }
+    if (!addSlots(chunk, map, loop, count, std::move(prefix), rewrites)) return false;
+    return relayout(chunk, rewrites);
+}
+
+// Applies the first rewrite that any loop still admits, so the next one
+// starts from a fresh analysis.
+static bool optimizeOnce(ObjFunction* function, bool script) {
+    StackMap map;
+    if (!analyze(function, map)) return false;
+    for (const Loop& loop : findLoops(function->chunk, map)) {
+        if (script && hoistGlobals(function, map, loop)) return true;
+        if (proveRanges(function, map, loop)) return true;
+    }
+    return false;
+}
+
+void optimizeLoops(ObjFunction* script) {
+    std::vector<ObjFunction*> functions;
+    collectFunctions(script, functions);
+    for (ObjFunction* function : functions) {
+        bool changed = false;
+        while (optimizeOnce(function, function == script)) changed = true;
+        if (changed) function->maxSlots = function->chunk.maxStackDepth(function->arity);
+    }
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+class ObjFunction;
+
+// Optimizes the while and for loops of a freshly compiled script and the
+// functions in it that make no calls: loads of globals the script has
+// already defined and the loop never assigns are hoisted into hidden slots
+// ahead of the loop, and in a counted loop `list[i]` skips its type and
+// bounds checks when one CHECK_RANGE before the loop proves every index the
+// loop can reach is in range.
+void optimizeLoops(ObjFunction* script);
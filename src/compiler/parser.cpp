@@ -1,21 +1,80 @@
 #include "parser.hpp"
+#include "flow.hpp"
 #include "../common/debug.hpp"
 #include "../vm/object/string.hpp"
 #include "../vm/object/function.hpp"
 #include <cstring>
 
-Parser::Parser(VM& v, const std::string& src) : vm(v), scanner(src) {
+Parser::Parser(VM& v, const std::string& src) : vm(v), scanner(std::make_shared<const std::string>(src)) {
+    advance();
+}
+
+Parser::Parser(VM& v, const DeferredBody& body)
+    : vm(v), scanner(body.source, {body.offset, body.line, body.lineStart}, body.end) {
     advance();
 }
 
 ObjFunction* Parser::compile() {
-    compiling = vm.newFunction();
-    locals.push_back({"", 0, true});
+    FunctionState script;
+    beginFunction(script, FunctionType::SCRIPT);
     while (!match(TokenType::TOKEN_EOF)) {
         declaration();
     }
+    ObjFunction* function = endCompiler();
+    return hadError ? nullptr : function;
+}
+
+// The deferred function is compiled as if it were still where the script
+// declared it: directly inside the script, possibly in a class, and with
+// `super` as its one upvalue if it is a method of a subclass.
+bool Parser::compileDeferred(ObjFunction* function) {
+    const DeferredBody& body = *function->deferred;
+    FunctionState script;
+    script.locals.push_back({"", 0, true});
+    if (body.capturesSuper) {
+        script.scopeDepth = 1;
+        script.locals.push_back({"super", 1, true});
+    }
+    state = &script;
+
+    FunctionType type = static_cast<FunctionType>(body.type);
+    ClassCompiler klass;
+    klass.hasSuperclass = body.capturesSuper;
+    if (type == FunctionType::METHOD || type == FunctionType::INITIALIZER) classCompiler = &klass;
+
+    FunctionState compiler;
+    compiler.enclosing = state;
+    compiler.function = function;
+    compiler.type = type;
+    compiler.locals.push_back({type == FunctionType::FUNCTION ? "" : "this", 0, true});
+    state = &compiler;
+    if (body.capturesSuper) addUpvalue(state, 1, true);
+
+    int arity = function->arity;
+    function->arity = 0;
+    functionBody();
     endCompiler();
-    return hadError ? nullptr : compiling;
+    classCompiler = nullptr;
+    if (hadError) {
+        function->arity = arity;
+        function->chunk = Chunk();
+        return false;
+    }
+    function->deferred.reset();
+    return true;
+}
+
+void Parser::beginFunction(FunctionState& function, FunctionType type) {
+    function.enclosing = state;
+    function.function = vm.newFunction();
+    function.type = type;
+    state = &function;
+
+    if (type != FunctionType::SCRIPT) {
+        state->function->name = vm.allocateString(std::string_view(previous.start, previous.length));
+    }
+    const char* slotZero = type == FunctionType::FUNCTION || type == FunctionType::SCRIPT ? "" : "this";
+    state->locals.push_back({slotZero, 0, true});
 }
 
 void Parser::advance() {
@@ -79,6 +138,7 @@ void Parser::synchronize() {
             case TokenType::WHILE:
             case TokenType::PRINT:
             case TokenType::RETURN:
+            case TokenType::IMPORT:
                 return;
             default:
                 ;
@@ -91,7 +151,7 @@ void Parser::declaration() {
     if (match(TokenType::CLASS)) {
         classDeclaration();
     } else if (match(TokenType::FUN)) {
-        funDeclaration("function");
+        funDeclaration();
     } else if (match(TokenType::VAR)) {
         varDeclaration();
     } else {
@@ -104,10 +164,11 @@ void Parser::declaration() {
 void Parser::classDeclaration() {
     consume(TokenType::IDENTIFIER, "Expect class name.");
     Token className = previous;
-    uint8_t nameConstant = makeConstant(Value(vm.allocateString(std::string(className.start, className.length))));
-    emitBytes(static_cast<uint8_t>(OpCode::CLASS), nameConstant);
+    int nameConstant = identifierConstant(className);
+    declareVariable();
 
-    defineMethod(vm.allocateString(std::string(className.start, className.length)));
+    emitOperand(OpCode::CLASS, nameConstant);
+    defineVariable(nameConstant);
 
     ClassCompiler classCompiler;
     classCompiler.enclosing = this->classCompiler;
@@ -115,21 +176,28 @@ void Parser::classDeclaration() {
 
     if (match(TokenType::LESS)) {
         consume(TokenType::IDENTIFIER, "Expect superclass name.");
+        variable(false);
 
         if (className.length == previous.length && memcmp(className.start, previous.start, className.length) == 0) {
             error("A class cannot inherit from itself.");
         }
+
         beginScope();
+        addLocal("super");
+        markInitialized();
 
-        emitBytes(static_cast<uint8_t>(OpCode::GET_GLOBAL), makeConstant(Value(vm.allocateString(std::string(previous.start, previous.length)))));
+        namedVariable(className, false);
+        emitByte(static_cast<uint8_t>(OpCode::INHERIT));
         this->classCompiler->hasSuperclass = true;
     }
 
+    namedVariable(className, false);
     consume(TokenType::LEFT_BRACE, "Expect '{' before class body.");
     while (!check(TokenType::RIGHT_BRACE) && !check(TokenType::TOKEN_EOF)) {
-        funDeclaration("method");
+        method();
     }
     consume(TokenType::RIGHT_BRACE, "Expect '}' after class body.");
+    emitByte(static_cast<uint8_t>(OpCode::POP));
 
     if (this->classCompiler->hasSuperclass) {
         endScope();
@@ -138,31 +206,109 @@ void Parser::classDeclaration() {
     this->classCompiler = classCompiler.enclosing;
 }
 
-void Parser::funDeclaration(const std::string& kind) {
-    uint8_t global = 0;
-    consume(TokenType::IDENTIFIER, ("Expect " + kind + " name.").c_str());
-
-    std::string name(previous.start, previous.length);
-    global = makeConstant(Value(vm.allocateString(name)));
+void Parser::method() {
+    consume(TokenType::IDENTIFIER, "Expect method name.");
+    int constant = identifierConstant(previous);
+    FunctionType type = FunctionType::METHOD;
+    if (previous.length == 4 && memcmp(previous.start, "init", 4) == 0) {
+        type = FunctionType::INITIALIZER;
+    }
+    function(type);
+    emitOperand(OpCode::METHOD, constant);
+}
 
-    ObjFunction* function = vm.newFunction();
+void Parser::funDeclaration() {
+    int global = parseVariable("Expect function name.");
+    markInitialized();
+    function(FunctionType::FUNCTION);
+    defineVariable(global);
+}
 
+void Parser::function(FunctionType type) {
+    if (canDefer()) {
+        deferFunction(type);
+        return;
+    }
+    FunctionState compiler;
+    beginFunction(compiler, type);
+    functionBody();
+
+    std::vector<Upvalue> captures = state->upvalues;
+    ObjFunction* compiled = endCompiler();
+    emitOperand(OpCode::CLOSURE, makeConstant(Value(compiled)));
+    for (const Upvalue& upvalue : captures) {
+        if (upvalue.isLocal) state->locals[upvalue.index].captures.push_back(currentChunk()->code.size());
+        emitByte(static_cast<uint8_t>(upvalue.isLocal ? Capture::LOCAL : Capture::UPVALUE));
+        emitByte(upvalue.index);
+    }
+}
 
-    consume(TokenType::LEFT_PAREN, ("Expect '(' after " + kind + " name.").c_str());
+void Parser::functionBody() {
+    beginScope();
+    consume(TokenType::LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(TokenType::RIGHT_PAREN)) {
+        do {
+            state->function->arity++;
+            if (state->function->arity > 255) {
+                errorAtCurrent("Can't have more than 255 parameters.");
+            }
+            int constant = parseVariable("Expect parameter name.");
+            defineVariable(constant);
+        } while (match(TokenType::COMMA));
+    }
     consume(TokenType::RIGHT_PAREN, "Expect ')' after parameters.");
-    consume(TokenType::LEFT_BRACE, ("Expect '{' before " + kind + " body.").c_str());
+    consume(TokenType::LEFT_BRACE, "Expect '{' before function body.");
     block();
+}
 
-
+// Functions declared directly in the script can capture nothing but a
+// subclass's `super`, so their upvalues are known without reading the body.
+bool Parser::canDefer() const {
+    if (!vm.lazyCompile || state->type != FunctionType::SCRIPT) return false;
+    return state->locals.size() == 1 || (state->locals.size() == 2 && state->locals[1].name == "super");
 }
 
-void Parser::varDeclaration() {
-    consume(TokenType::IDENTIFIER, "Expect variable name.");
-    Token nameToken = previous;
+// Skips the body after counting the parameters, and emits a closure over a
+// function that compiles it on its first call.
+void Parser::deferFunction(FunctionType type) {
+    ObjFunction* function = vm.newFunction();
+    function->name = vm.allocateString(std::string_view(previous.start, previous.length));
+    ScanPoint from = scanner.pointOf(current);
+    bool capturesSuper = state->locals.size() == 2;
 
-    if (scopeDepth > 0) {
-        locals.push_back({std::string(nameToken.start, nameToken.length), scopeDepth, false});
+    consume(TokenType::LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(TokenType::RIGHT_PAREN)) {
+        do {
+            function->arity++;
+            if (function->arity > 255) {
+                errorAtCurrent("Can't have more than 255 parameters.");
+            }
+            consume(TokenType::IDENTIFIER, "Expect parameter name.");
+        } while (match(TokenType::COMMA));
+    }
+    consume(TokenType::RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(TokenType::LEFT_BRACE, "Expect '{' before function body.");
+    int depth = 1;
+    while (depth > 0 && !check(TokenType::TOKEN_EOF)) {
+        if (check(TokenType::LEFT_BRACE)) depth++;
+        if (check(TokenType::RIGHT_BRACE)) depth--;
+        advance();
+    }
+    if (depth > 0) errorAtCurrent("Expect '}' after block.");
+
+    function->deferred.reset(new DeferredBody{scanner.text(), from.offset, from.line, from.lineStart,
+                                              scanner.endOf(previous), static_cast<uint8_t>(type), capturesSuper});
+    emitOperand(OpCode::CLOSURE, makeConstant(Value(function)));
+    if (capturesSuper) {
+        state->locals[1].isCaptured = true;
+        state->locals[1].captures.push_back(currentChunk()->code.size());
+        function->upvalueCount = 1;
+        emitBytes(static_cast<uint8_t>(Capture::LOCAL), 1);
     }
+}
+
+void Parser::varDeclaration() {
+    int global = parseVariable("Expect variable name.");
 
     if (match(TokenType::EQUAL)) {
         expression();
@@ -171,12 +317,53 @@ void Parser::varDeclaration() {
     }
     consume(TokenType::SEMICOLON, "Expect ';' after variable declaration.");
 
-    if (scopeDepth > 0) {
-        locals.back().initialized = true;
-    } else {
-        uint8_t global = makeConstant(Value(vm.allocateString(std::string(nameToken.start, nameToken.length))));
-        emitBytes(static_cast<uint8_t>(OpCode::DEFINE_GLOBAL), global);
+    defineVariable(global);
+}
+
+int Parser::parseVariable(const char* message) {
+    consume(TokenType::IDENTIFIER, message);
+    declareVariable();
+    if (state->scopeDepth > 0) return 0;
+    return identifierConstant(previous);
+}
+
+int Parser::identifierConstant(const Token& name) {
+    return makeConstant(Value(vm.allocateString(std::string_view(name.start, name.length))));
+}
+
+void Parser::declareVariable() {
+    if (state->scopeDepth == 0) return;
+
+    std::string name(previous.start, previous.length);
+    for (int i = static_cast<int>(state->locals.size()) - 1; i >= 0; i--) {
+        const Local& local = state->locals[i];
+        if (local.depth != -1 && local.depth < state->scopeDepth) break;
+        if (local.name == name) {
+            error("Already a variable with this name in this scope.");
+        }
+    }
+    addLocal(std::move(name));
+}
+
+void Parser::addLocal(std::string name) {
+    if (state->locals.size() > UINT8_MAX) {
+        error("Too many local variables in function.");
+        return;
+    }
+    state->locals.push_back({std::move(name), state->scopeDepth, false});
+}
+
+void Parser::markInitialized() {
+    if (state->scopeDepth == 0) return;
+    state->locals.back().initialized = true;
+}
+
+void Parser::defineVariable(int global) {
+    if (state->scopeDepth > 0) {
+        markInitialized();
+        return;
     }
+    emitOperand(OpCode::DEFINE_GLOBAL, global);
 }
 
 void Parser::statement() {
@@ -188,6 +375,8 @@ void Parser::statement() {
         ifStatement();
     } else if (match(TokenType::RETURN)) {
         returnStatement();
+    } else if (match(TokenType::IMPORT)) {
+        importStatement();
     } else if (match(TokenType::WHILE)) {
         whileStatement();
     } else if (match(TokenType::LEFT_BRACE)) {
@@ -205,6 +394,14 @@ void Parser::printStatement() {
     emitByte(static_cast<uint8_t>(OpCode::PRINT));
 }
 
+void Parser::importStatement() {
+    consume(TokenType::STRING, "Expect module name string after 'import'.");
+    int name = makeConstant(Value(vm.allocateString(std::string_view(previous.start + 1, previous.length - 2))));
+    consume(TokenType::SEMICOLON, "Expect ';' after module name.");
+    emitOperand(OpCode::IMPORT, name);
+    emitByte(static_cast<uint8_t>(OpCode::POP));
+}
+
 void Parser::expressionStatement() {
     expression();
     consume(TokenType::SEMICOLON, "Expect ';' after expression.");
@@ -290,8 +487,23 @@ void Parser::returnStatement() {
     if (match(TokenType::SEMICOLON)) {
         emitReturn();
     } else {
+        if (state->type == FunctionType::INITIALIZER) {
+            error("Can't return a value from an initializer.");
+        }
         expression();
         consume(TokenType::SEMICOLON, "Expect ';' after return value.");
+        // The RETURN stays: jumps past the call land on it, and a tail call
+        // to a native falls through to it.
+        Chunk* chunk = currentChunk();
+        size_t end = chunk->code.size();
+        if (state->lastCall >= 0 && static_cast<size_t>(state->lastCall) + 2 == end) {
+            chunk->code[state->lastCall] = static_cast<uint8_t>(OpCode::TAIL_CALL);
+        }
+        for (const auto& branch : state->branchCalls) {
+            size_t target = branch.second + 2 + ((chunk->code[branch.second] << 8) | chunk->code[branch.second + 1]);
+            if (target == end) chunk->code[branch.first] = static_cast<uint8_t>(OpCode::TAIL_CALL);
+        }
+        state->branchCalls.clear();
         emitByte(static_cast<uint8_t>(OpCode::RETURN));
     }
 }
@@ -329,8 +541,8 @@ void Parser::parsePrecedence(Precedence precedence) {
     }
 }
 
-Parser::ParseRule* Parser::getRule(TokenType type) {
-    static ParseRule rules[] = {
+const Parser::ParseRule* Parser::getRule(TokenType type) {
+    static const ParseRule rules[] = {
         {&Parser::grouping, &Parser::call, Precedence::CALL},
         {nullptr, nullptr, Precedence::NONE},
         {nullptr, nullptr, Precedence::NONE},
@@ -383,6 +595,8 @@ Parser::ParseRule* Parser::getRule(TokenType type) {
         {nullptr, nullptr, Precedence::NONE},
         {nullptr, &Parser::ternary, Precedence::TERNARY},
         {nullptr, nullptr, Precedence::NONE},
+        {&Parser::yield_, nullptr, Precedence::NONE},
+        {&Parser::resume, nullptr, Precedence::NONE},
     };
     return &rules[static_cast<int>(type)];
 }
@@ -405,7 +619,7 @@ void Parser::unary(bool canAssign) {
 
 void Parser::binary(bool canAssign) {
     TokenType operatorType = previous.type;
-    ParseRule* rule = getRule(operatorType);
+    const ParseRule* rule = getRule(operatorType);
     parsePrecedence(static_cast<Precedence>(static_cast<int>(rule->precedence) + 1));
 
     switch (operatorType) {
@@ -436,7 +650,9 @@ void Parser::ternary(bool canAssign) {
 
     consume(TokenType::COLON, "Expect ':' after '?' branch.");
 
+    bool thenCalls = state->lastCall >= 0 && static_cast<size_t>(state->lastCall) + 2 == currentChunk()->code.size();
     int elseJump = emitJump(static_cast<uint8_t>(OpCode::JUMP));
+    if (thenCalls) state->branchCalls.emplace_back(state->lastCall, elseJump);
 
     patchJump(thenJump);
     emitByte(static_cast<uint8_t>(OpCode::POP));
@@ -453,6 +669,10 @@ void Parser::pow(bool canAssign) {
 
 void Parser::number(bool canAssign) {
     double value = std::stod(std::string(previous.start, previous.length));
+    if (memchr(previous.start, '.', previous.length) == nullptr && value <= INT32_MAX) {
+        emitConstant(Value(static_cast<int32_t>(value)));
+        return;
+    }
     emitConstant(Value(value));
 }
 
@@ -466,7 +686,7 @@ void Parser::literal(bool canAssign) {
 }
 
 void Parser::string(bool canAssign) {
-    emitConstant(Value(vm.allocateString(std::string(previous.start + 1, previous.length - 2))));
+    emitConstant(Value(vm.allocateString(std::string_view(previous.start + 1, previous.length - 2))));
 }
 
 void Parser::variable(bool canAssign) {
@@ -474,25 +694,31 @@ void Parser::variable(bool canAssign) {
 }
 
 void Parser::namedVariable(const Token& name, bool canAssign) {
-
-    uint8_t arg = 0;
-    int local = resolveLocal(std::string(name.start, name.length));
+    std::string identifier(name.start, name.length);
+    int arg = 0;
     OpCode getOp, setOp;
+    int local = resolveLocal(state, identifier);
     if (local != -1) {
         getOp = OpCode::GET_LOCAL;
         setOp = OpCode::SET_LOCAL;
-        arg = (uint8_t)local;
+        arg = local;
+    } else if ((local = resolveUpvalue(state, identifier)) != -1) {
+        getOp = OpCode::GET_UPVALUE;
+        setOp = OpCode::SET_UPVALUE;
+        arg = local;
     } else {
-        arg = makeConstant(Value(vm.allocateString(std::string(name.start, name.length))));
+        arg = identifierConstant(name);
         getOp = OpCode::GET_GLOBAL;
         setOp = OpCode::SET_GLOBAL;
     }
 
     if (canAssign && match(TokenType::EQUAL)) {
         expression();
-        emitBytes(static_cast<uint8_t>(setOp), arg);
+        if (setOp == OpCode::SET_LOCAL) state->locals[arg].isAssigned = true;
+        if (setOp == OpCode::SET_UPVALUE) markUpvalueAssigned(state, arg);
+        emitOperand(setOp, arg);
     } else {
-        emitBytes(static_cast<uint8_t>(getOp), arg);
+        emitOperand(getOp, arg);
     }
 }
 
@@ -514,31 +740,56 @@ void Parser::or_(bool canAssign) {
 
 void Parser::call(bool canAssign) {
     uint8_t argCount = argumentList();
+    state->lastCall = static_cast<int>(currentChunk()->code.size());
     emitBytes(static_cast<uint8_t>(OpCode::CALL), argCount);
 }
 
 void Parser::dot(bool canAssign) {
     consume(TokenType::IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = makeConstant(Value(vm.allocateString(std::string(previous.start, previous.length))));
+    int name = identifierConstant(previous);
 
     if (canAssign && match(TokenType::EQUAL)) {
         expression();
-        emitBytes(static_cast<uint8_t>(OpCode::SET_PROPERTY), name);
+        emitOperand(OpCode::SET_PROPERTY, name);
     } else if (match(TokenType::LEFT_PAREN)) {
         uint8_t argCount = argumentList();
-        emitBytes(static_cast<uint8_t>(OpCode::INVOKE), name);
+        emitOperand(OpCode::INVOKE, name);
         emitByte(argCount);
     } else {
-        emitBytes(static_cast<uint8_t>(OpCode::GET_PROPERTY), name);
+        emitOperand(OpCode::GET_PROPERTY, name);
     }
 }
 
 void Parser::this_(bool canAssign) {
-
+    if (classCompiler == nullptr) {
+        error("Can't use 'this' outside of a class.");
+        return;
+    }
+    variable(false);
 }
 
 void Parser::super_(bool canAssign) {
+    if (classCompiler == nullptr) {
+        error("Can't use 'super' outside of a class.");
+    } else if (!classCompiler->hasSuperclass) {
+        error("Can't use 'super' in a class with no superclass.");
+    }
+
+    consume(TokenType::DOT, "Expect '.' after 'super'.");
+    consume(TokenType::IDENTIFIER, "Expect superclass method name.");
+    int name = identifierConstant(previous);
+
+    namedVariable(syntheticToken("this"), false);
+    namedVariable(syntheticToken("super"), false);
+    emitOperand(OpCode::GET_SUPER, name);
+    if (match(TokenType::LEFT_PAREN)) {
+        uint8_t argCount = argumentList();
+        emitBytes(static_cast<uint8_t>(OpCode::CALL), argCount);
+    }
+}
 
+Token Parser::syntheticToken(const char* text) {
+    return Token(TokenType::IDENTIFIER, text, static_cast<int>(strlen(text)), previous.line, previous.column);
 }
 
 void Parser::list(bool canAssign) {
@@ -556,6 +807,32 @@ void Parser::list(bool canAssign) {
     emitBytes(static_cast<uint8_t>(OpCode::BUILD_LIST), static_cast<uint8_t>(count));
 }
 
+// `yield value` suspends the running fiber and evaluates to whatever the
+// next resume passes in. The value may be omitted.
+void Parser::yield_(bool canAssign) {
+    if (check(TokenType::SEMICOLON) || check(TokenType::RIGHT_PAREN) || check(TokenType::RIGHT_BRACKET) ||
+        check(TokenType::COMMA) || check(TokenType::COLON)) {
+        emitByte(static_cast<uint8_t>(OpCode::NIL));
+    } else {
+        parsePrecedence(Precedence::TERNARY);
+    }
+    emitByte(static_cast<uint8_t>(OpCode::YIELD));
+}
+
+// `resume(fiber, value)` runs the fiber until it yields or returns and
+// evaluates to that value.
+void Parser::resume(bool canAssign) {
+    consume(TokenType::LEFT_PAREN, "Expect '(' after 'resume'.");
+    expression();
+    if (match(TokenType::COMMA)) {
+        expression();
+    } else {
+        emitByte(static_cast<uint8_t>(OpCode::NIL));
+    }
+    consume(TokenType::RIGHT_PAREN, "Expect ')' after resume arguments.");
+    emitByte(static_cast<uint8_t>(OpCode::RESUME));
+}
+
 void Parser::subscript(bool canAssign) {
     expression();
     consume(TokenType::RIGHT_BRACKET, "Expect ']' after index.");
@@ -567,15 +844,70 @@ void Parser::subscript(bool canAssign) {
     }
 }
 
-int Parser::resolveLocal(const std::string& name) {
-    for (int i = locals.size() - 1; i >= 0; i--) {
-        if (locals[i].name == name) {
+int Parser::resolveLocal(FunctionState* function, const std::string& name) {
+    for (int i = static_cast<int>(function->locals.size()) - 1; i >= 0; i--) {
+        const Local& local = function->locals[i];
+        if (local.name == name) {
+            if (!local.initialized) {
+                error("Can't read local variable in its own initializer.");
+            }
             return i;
         }
     }
     return -1;
 }
 
+int Parser::resolveUpvalue(FunctionState* function, const std::string& name) {
+    if (function->enclosing == nullptr) return -1;
+
+    int local = resolveLocal(function->enclosing, name);
+    if (local != -1) {
+        function->enclosing->locals[local].isCaptured = true;
+        return addUpvalue(function, static_cast<uint8_t>(local), true);
+    }
+
+    int upvalue = resolveUpvalue(function->enclosing, name);
+    if (upvalue != -1) {
+        return addUpvalue(function, static_cast<uint8_t>(upvalue), false);
+    }
+    return -1;
+}
+
+int Parser::addUpvalue(FunctionState* function, uint8_t index, bool isLocal) {
+    std::vector<Upvalue>& upvalues = function->upvalues;
+    for (size_t i = 0; i < upvalues.size(); i++) {
+        if (upvalues[i].index == index && upvalues[i].isLocal == isLocal) {
+            return static_cast<int>(i);
+        }
+    }
+    if (upvalues.size() > UINT8_MAX) {
+        error("Too many closure variables in function.");
+        return 0;
+    }
+    upvalues.push_back({index, isLocal});
+    function->function->upvalueCount = static_cast<int>(upvalues.size());
+    return static_cast<int>(upvalues.size()) - 1;
+}
+
+void Parser::markUpvalueAssigned(FunctionState* function, int index) {
+    const Upvalue& upvalue = function->upvalues[index];
+    if (upvalue.isLocal) {
+        function->enclosing->locals[upvalue.index].isAssigned = true;
+    } else {
+        markUpvalueAssigned(function->enclosing, upvalue.index);
+    }
+}
+
+// Once a captured local's scope ends and nothing has assigned it, the
+// closures over it can hold copies of its value instead of a shared box.
+bool Parser::captureByValue(const Local& local) {
+    if (!local.isCaptured || local.isAssigned) return false;
+    for (int offset : local.captures) {
+        currentChunk()->code[offset] = static_cast<uint8_t>(Capture::LOCAL_VALUE);
+    }
+    return true;
+}
+
 uint8_t Parser::argumentList() {
     uint8_t argCount = 0;
     if (!check(TokenType::RIGHT_PAREN)) {
@@ -592,11 +924,11 @@ uint8_t Parser::argumentList() {
 }
 
 Chunk* Parser::currentChunk() {
-    return &compiling->chunk;
+    return &state->function->chunk;
 }
 
 void Parser::emitByte(uint8_t byte) {
-    currentChunk()->write(byte, previous.line);
+    currentChunk()->write(byte, previous.line, previous.column);
 }
 
 void Parser::emitBytes(uint8_t a, uint8_t b) {
@@ -604,8 +936,19 @@ void Parser::emitBytes(uint8_t a, uint8_t b) {
     emitByte(b);
 }
 
+// Operands past a byte get a WIDE prefix for each higher byte they need.
+void Parser::emitOperand(OpCode op, int operand) {
+    if (operand > UINT16_MAX) emitBytes(static_cast<uint8_t>(OpCode::WIDE), (operand >> 16) & 0xff);
+    if (operand > UINT8_MAX) emitBytes(static_cast<uint8_t>(OpCode::WIDE), (operand >> 8) & 0xff);
+    emitBytes(static_cast<uint8_t>(op), operand & 0xff);
+}
+
 void Parser::emitReturn() {
-    emitByte(static_cast<uint8_t>(OpCode::NIL));
+    if (state->type == FunctionType::INITIALIZER) {
+        emitBytes(static_cast<uint8_t>(OpCode::GET_LOCAL), 0);
+    } else {
+        emitByte(static_cast<uint8_t>(OpCode::NIL));
+    }
     emitByte(static_cast<uint8_t>(OpCode::RETURN));
 }
 
@@ -616,26 +959,33 @@ int Parser::emitJump(uint8_t instruction) {
     return currentChunk()->code.size() - 2;
 }
 
+// A jump too long for its operand is left at zero and widened when the
+// function is finished, since its prefix would move the code it jumps over.
 void Parser::patchJump(int offset) {
     int jump = currentChunk()->code.size() - offset - 2;
     if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
+        state->longJumps[offset - 1] = currentChunk()->code.size();
+        jump = 0;
     }
     currentChunk()->code[offset] = (jump >> 8) & 0xff;
     currentChunk()->code[offset + 1] = jump & 0xff;
 }
 
 void Parser::emitLoop(int loopStart) {
+    int offset = currentChunk()->code.size() - loopStart + 3;
+    if (offset > UINT16_MAX) {
+        offset += 2;
+        if (offset > 0xffffff) error("Loop body too large.");
+        emitBytes(static_cast<uint8_t>(OpCode::WIDE), (offset >> 16) & 0xff);
+    }
     emitByte(static_cast<uint8_t>(OpCode::LOOP));
-    int offset = currentChunk()->code.size() - loopStart + 2;
-    if (offset > UINT16_MAX) error("Loop body too large.");
     emitByte((offset >> 8) & 0xff);
     emitByte(offset & 0xff);
 }
 
 int Parser::makeConstant(Value value) {
     int constant = currentChunk()->addConstant(value);
-    if (constant > UINT8_MAX) {
+    if (constant > 0xffffff) {
         error("Too many constants in one chunk.");
         return 0;
     }
@@ -643,26 +993,38 @@ int Parser::makeConstant(Value value) {
 }
 
 void Parser::emitConstant(Value value) {
-    emitBytes(static_cast<uint8_t>(OpCode::CONSTANT), makeConstant(value));
+    emitOperand(OpCode::CONSTANT, makeConstant(value));
 }
 
 void Parser::beginScope() {
-    scopeDepth++;
+    state->scopeDepth++;
 }
 
 void Parser::endScope() {
-    scopeDepth--;
-    while (locals.size() > 0 && locals.back().depth > scopeDepth) {
-        emitByte(static_cast<uint8_t>(OpCode::POP));
+    state->scopeDepth--;
+    std::vector<Local>& locals = state->locals;
+    while (locals.size() > 0 && locals.back().depth > state->scopeDepth) {
+        if (locals.back().isCaptured && !captureByValue(locals.back())) {
+            emitByte(static_cast<uint8_t>(OpCode::CLOSE_UPVALUE));
+        } else {
+            emitByte(static_cast<uint8_t>(OpCode::POP));
+        }
         locals.pop_back();
     }
 }
 
-void Parser::defineMethod(ObjString* name) {
-    uint8_t constant = makeConstant(Value(name));
-    emitBytes(static_cast<uint8_t>(OpCode::METHOD), constant);
-}
-
-void Parser::endCompiler() {
+ObjFunction* Parser::endCompiler() {
+    for (const Local& local : state->locals) {
+        captureByValue(local);
+    }
     emitReturn();
+    if (!state->longJumps.empty() && !widenJumps(*currentChunk(), state->longJumps)) {
+        error("Too much code to jump over.");
+    }
+    ObjFunction* function = state->function;
+    function->upvalueCount = static_cast<int>(state->upvalues.size());
+    function->maxSlots = function->chunk.maxStackDepth(function->arity);
+    function->chunk.finish();
+    state = state->enclosing;
+    return function;
 }
@@ -1,6 +1,7 @@
 #pragma once
 #include "scanner.hpp"
 #include "vm/vm.hpp"
+#include "vm/object/function.hpp"
 
 class Parser {
 public:
@@ -11,7 +12,13 @@ public:
     bool panicMode = false;
 
     Parser(VM& v, const std::string& source);
+    // Starts at the parameter list of a function whose compilation was
+    // deferred.
+    Parser(VM& v, const DeferredBody& body);
     ObjFunction* compile();
+    // Compiles the deferred body of function into it; false on a compile
+    // error, which leaves it deferred.
+    bool compileDeferred(ObjFunction* function);
 
 private:
     void advance();
@@ -25,16 +32,24 @@ private:
 
     void expression();
     void statement();
+    enum class FunctionType { FUNCTION, INITIALIZER, METHOD, SCRIPT };
+
     void declaration();
     void varDeclaration();
-    void funDeclaration(const std::string& kind);
+    void funDeclaration();
     void classDeclaration();
+    void method();
+    void function(FunctionType type);
+    void functionBody();
+    bool canDefer() const;
+    void deferFunction(FunctionType type);
     void printStatement();
     void expressionStatement();
     void ifStatement();
     void whileStatement();
     void forStatement();
     void returnStatement();
+    void importStatement();
     void block();
 
     enum class Precedence {
@@ -50,7 +65,7 @@ private:
     };
 
     void parsePrecedence(Precedence precedence);
-    ParseRule* getRule(TokenType type);
+    const ParseRule* getRule(TokenType type);
     void grouping(bool canAssign);
     void unary(bool canAssign);
     void binary(bool canAssign);
@@ -69,31 +84,74 @@ private:
     void super_(bool canAssign);
     void list(bool canAssign);
     void subscript(bool canAssign);
+    void yield_(bool canAssign);
+    void resume(bool canAssign);
+
+    Token syntheticToken(const char* text);
+
+    struct Local {
+        Local(std::string name, int depth, bool initialized)
+            : name(std::move(name)), depth(depth), initialized(initialized) {}
+
+        std::string name;
+        int depth;
+        bool initialized;
+        bool isCaptured = false;
+        bool isAssigned = false;
+        // Offsets of the kind bytes of the CLOSUREs that capture it.
+        std::vector<int> captures;
+    };
+    struct Upvalue { uint8_t index; bool isLocal; };
+
+    // Per-function compiler state; nested function declarations push a new
+    // one whose enclosing link is used to resolve upvalues.
+    struct FunctionState {
+        FunctionState* enclosing = nullptr;
+        ObjFunction* function = nullptr;
+        FunctionType type = FunctionType::SCRIPT;
+        std::vector<Local> locals;
+        std::vector<Upvalue> upvalues;
+        int scopeDepth = 0;
+        // Offset of the latest CALL, which a return can turn into a tail call.
+        int lastCall = -1;
+        // Calls ending a ternary's then-branch, with the offset of the jump
+        // that skips the else-branch. They are in tail position if that jump
+        // lands on a RETURN.
+        std::vector<std::pair<int, int>> branchCalls;
+        // Jumps whose distance patchJump could not encode, by offset, with
+        // their targets.
+        std::unordered_map<size_t, size_t> longJumps;
+    };
 
     void emitConstant(Value value);
     void beginScope();
     void endScope();
-    int resolveLocal(const std::string& name);
+    int parseVariable(const char* message);
+    int identifierConstant(const Token& name);
+    void declareVariable();
+    void addLocal(std::string name);
+    void markInitialized();
+    void defineVariable(int global);
+    int resolveLocal(FunctionState* function, const std::string& name);
+    int resolveUpvalue(FunctionState* function, const std::string& name);
+    int addUpvalue(FunctionState* function, uint8_t index, bool isLocal);
+    void markUpvalueAssigned(FunctionState* function, int index);
+    bool captureByValue(const Local& local);
     uint8_t argumentList();
 
     Chunk* currentChunk();
     void emitByte(uint8_t byte);
     void emitBytes(uint8_t a, uint8_t b);
+    void emitOperand(OpCode op, int operand);
     void emitReturn();
     int emitJump(uint8_t instruction);
     void patchJump(int offset);
     void emitLoop(int loopStart);
     int makeConstant(Value value);
-    void defineMethod(ObjString* name);
-    void endCompiler();
+    void beginFunction(FunctionState& function, FunctionType type);
+    ObjFunction* endCompiler();
 
-    ObjFunction* compiling = nullptr;
-    struct Local { std::string name; int depth; bool initialized; };
-    std::vector<Local> locals;
-    int scopeDepth = 0;
-
-    struct Upvalue { uint8_t index; bool isLocal; };
-    std::vector<Upvalue> upvalues;
+    FunctionState* state = nullptr;
 
     class ClassCompiler {
     public:
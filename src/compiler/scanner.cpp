@@ -2,7 +2,18 @@
 #include <cstring>
 #include <cctype>
 
-Scanner::Scanner(const std::string& source) : source(source) {}
+Scanner::Scanner(std::shared_ptr<const std::string> source, ScanPoint from, int end)
+    : sourceText(std::move(source)), source(*sourceText), current(from.offset), line(from.line),
+      lineStart(from.lineStart), end(end < 0 ? static_cast<int>(this->source.length()) : end) {}
+
+ScanPoint Scanner::pointOf(const Token& token) const {
+    int offset = static_cast<int>(token.start - source.c_str());
+    return {offset, token.line, offset - (token.column - 1)};
+}
+
+int Scanner::endOf(const Token& token) const {
+    return static_cast<int>(token.start - source.c_str()) + token.length;
+}
 
 Token Scanner::scanToken() {
     skipWhitespace();
@@ -48,7 +59,7 @@ Token Scanner::scanToken() {
 }
 
 bool Scanner::isAtEnd() const {
-    return current >= source.length();
+    return current >= end;
 }
 
 char Scanner::advance() {
@@ -56,6 +67,11 @@ char Scanner::advance() {
     return source[current - 1];
 }
 
+void Scanner::newline() {
+    line++;
+    lineStart = current;
+}
+
 bool Scanner::match(char expected) {
     if (isAtEnd()) return false;
     if (source[current] != expected) return false;
@@ -69,7 +85,7 @@ char Scanner::peek() const {
 }
 
 char Scanner::peekNext() const {
-    if (current + 1 >= source.length()) return '\0';
+    if (current + 1 >= end) return '\0';
     return source[current + 1];
 }
 
@@ -83,8 +99,8 @@ void Scanner::skipWhitespace() {
                 advance();
                 break;
             case '\n':
-                line++;
                 advance();
+                newline();
                 break;
             case '/':
                 if (peekNext() == '/') {
@@ -93,8 +109,7 @@ void Scanner::skipWhitespace() {
                     advance(); 
                     advance(); 
                     while (!(peek() == '*' && peekNext() == '/') && !isAtEnd()) {
-                        if (peek() == '\n') line++;
-                        advance();
+                        if (advance() == '\n') newline();
                     }
                     if (!isAtEnd()) {
                         advance(); 
@@ -112,8 +127,7 @@ void Scanner::skipWhitespace() {
 
 Token Scanner::string() {
     while (peek() != '"' && !isAtEnd()) {
-        if (peek() == '\n') line++;
-        advance();
+        if (advance() == '\n') newline();
     }
 
     if (isAtEnd()) return errorToken("Unterminated string.");
@@ -147,22 +161,25 @@ TokenType Scanner::identifierType() {
     if (text == "fun") return TokenType::FUN;
     if (text == "for") return TokenType::FOR;
     if (text == "if") return TokenType::IF;
+    if (text == "import") return TokenType::IMPORT;
     if (text == "nil") return TokenType::NIL;
     if (text == "or") return TokenType::OR;
     if (text == "print") return TokenType::PRINT;
+    if (text == "resume") return TokenType::RESUME;
     if (text == "return") return TokenType::RETURN;
     if (text == "super") return TokenType::SUPER;
     if (text == "this") return TokenType::THIS;
     if (text == "true") return TokenType::TRUE;
     if (text == "var") return TokenType::VAR;
     if (text == "while") return TokenType::WHILE;
+    if (text == "yield") return TokenType::YIELD;
     return TokenType::IDENTIFIER;
 }
 
 Token Scanner::makeToken(TokenType type) {
-    return Token(type, source.c_str() + start, current - start, line);
+    return Token(type, source.c_str() + start, current - start, line, start - lineStart + 1);
 }
 
 Token Scanner::errorToken(const char* message) {
-    return Token(TokenType::ERROR, message, (int)strlen(message), line);
+    return Token(TokenType::ERROR, message, (int)strlen(message), line, current - lineStart + 1);
 }
@@ -1,4 +1,5 @@
 #pragma once
+#include <memory>
 #include <string>
 #include <vector>
 #include <unordered_map>
@@ -14,7 +15,8 @@ enum class TokenType {
     AND, CLASS, ELSE, FALSE, FUN, FOR, IF, NIL, OR,
     PRINT, RETURN, SUPER, THIS, TRUE, VAR, WHILE,
     ERROR, TOKEN_EOF,
-    QUESTION, COLON
+    QUESTION, COLON,
+    YIELD, RESUME, IMPORT
 };
 
 struct Token {
@@ -22,17 +24,32 @@ struct Token {
     const char* start;
     int length;
     int line;
+    int column;
     Token() = default;
-    Token(TokenType type, const char* start, int length, int line)
-        : type(type), start(start), length(length), line(line) {}
+    Token(TokenType type, const char* start, int length, int line, int column)
+        : type(type), start(start), length(length), line(line), column(column) {}
     std::string toString() const;
 };
 
+// A place in the source to start scanning from: the offset of a token, its
+// line, and the offset that line starts at.
+struct ScanPoint {
+    int offset = 0;
+    int line = 1;
+    int lineStart = 0;
+};
+
 class Scanner {
 public:
-    Scanner(const std::string& source);
+    // Scans from from up to end, or to the end of the source if end is -1.
+    explicit Scanner(std::shared_ptr<const std::string> source, ScanPoint from = {}, int end = -1);
     Token scanToken();
     bool isAtEnd() const;
+    const std::shared_ptr<const std::string>& text() const { return sourceText; }
+    // Where token, which this scanner returned, starts.
+    ScanPoint pointOf(const Token& token) const;
+    // The offset just past token.
+    int endOf(const Token& token) const;
 
 private:
     void skipWhitespace();
@@ -41,6 +58,7 @@ private:
     Token makeToken(TokenType type);
     Token errorToken(const char* message);
     char advance();
+    void newline();
     bool match(char expected);
     char peek() const;
     char peekNext() const;
@@ -48,6 +66,9 @@ private:
     Token number();
     Token identifier();
 
-    const std::string source;
-    int start = 0, current = 0, line = 1;
+    // Shared with the functions whose compilation is deferred; see
+    // VM::lazyCompile.
+    std::shared_ptr<const std::string> sourceText;
+    const std::string& source;
+    int start = 0, current = 0, line = 1, lineStart = 0, end;
 };
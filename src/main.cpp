@@ -1,26 +1,115 @@
 #include "vm/vm.hpp"
 #include <fstream>
 #include <sstream>
+#include <cstring>
+#include <cstdlib>
+
+static int usage() {
+    std::cerr << "Usage: intercpp [--profile[=file]] [--opstats] [--gc-stats] [--max-frames=n] [--no-quicken] [--no-inline] [--no-loop-opt] [--lazy] [--module-path=dirs] [--module-cache=dir] [path]\n";
+    return 64;
+}
 
 int main(int argc, char* argv[]) {
     VM vm;
+    const char* path = nullptr;
+    const char* profilePath = nullptr;
+    bool opStats = false;
+    bool gcStats = false;
+    std::vector<std::string> modulePath;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--profile") == 0) {
+            profilePath = "profile.folded";
+        } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            profilePath = argv[i] + 10;
+        } else if (strcmp(argv[i], "--opstats") == 0) {
+            opStats = true;
+        } else if (strcmp(argv[i], "--gc-stats") == 0) {
+            gcStats = true;
+        } else if (strncmp(argv[i], "--max-frames=", 13) == 0) {
+            vm.maxFrames = atoi(argv[i] + 13);
+            if (vm.maxFrames < 1) return usage();
+        } else if (strcmp(argv[i], "--no-quicken") == 0) {
+            vm.quicken = false;
+        } else if (strcmp(argv[i], "--no-inline") == 0) {
+            vm.inlining = false;
+        } else if (strcmp(argv[i], "--no-loop-opt") == 0) {
+            vm.loopOptimization = false;
+        } else if (strcmp(argv[i], "--lazy") == 0) {
+            vm.lazyCompile = true;
+        } else if (strncmp(argv[i], "--module-path=", 14) == 0) {
+            std::stringstream dirs(argv[i] + 14);
+            for (std::string dir; std::getline(dirs, dir, ':');) {
+                if (!dir.empty()) modulePath.push_back(dir);
+            }
+        } else if (strncmp(argv[i], "--module-cache=", 15) == 0) {
+            vm.moduleCache = argv[i] + 15;
+            if (vm.moduleCache.empty()) return usage();
+        } else if (argv[i][0] == '-' || path != nullptr) {
+            return usage();
+        } else {
+            path = argv[i];
+        }
+    }
+
+    Profiler profiler;
+    if (profilePath) {
+        if (!profiler.start()) {
+            std::cerr << "Could not start the profiler.\n";
+            return 70;
+        }
+        vm.profiler = &profiler;
+    }
+
+    OpStats stats;
+    if (opStats) vm.opStats = &stats;
+
+    // Imports look next to the script first, then in --module-path.
+    if (path != nullptr) {
+        const char* slash = strrchr(path, '/');
+        vm.modulePath.push_back(slash ? std::string(path, slash - path + (slash == path)) : ".");
+    } else if (!modulePath.empty()) {
+        vm.modulePath.push_back(".");
+    }
+    vm.modulePath.insert(vm.modulePath.end(), modulePath.begin(), modulePath.end());
 
-    if (argc == 1) {
+    if (path == nullptr) {
         std::string line;
         while (true) {
-            std::cout << "> ";
+            vm.out.write("> ");
+            vm.out.flush();
             if (!std::getline(std::cin, line)) break;
             if (line.empty()) continue;
             vm.interpret(line);
         }
-    } else if (argc == 2) {
-        std::ifstream file(argv[1]);
+    } else {
+        std::ifstream file(path);
         std::stringstream buffer;
         buffer << file.rdbuf();
         vm.interpret(buffer.str());
-    } else {
-        std::cerr << "Usage: intercpp [path]\n";
-        return 64;
+    }
+
+    if (gcStats) {
+        vm.out.flush();
+        fprintf(stderr, "gc collections=%llu pause_total_ns=%llu pause_max_ns=%llu\n",
+                static_cast<unsigned long long>(vm.gcStats.collections),
+                static_cast<unsigned long long>(vm.gcStats.totalPauseNs),
+                static_cast<unsigned long long>(vm.gcStats.maxPauseNs));
+    }
+
+    if (opStats) {
+        vm.out.flush();
+        stats.print(stderr);
+    }
+
+    if (profilePath) {
+        profiler.stop();
+        vm.profiler = nullptr;
+        if (!profiler.write(profilePath)) {
+            std::cerr << "Could not write profile to '" << profilePath << "'.\n";
+            return 74;
+        }
+        std::cerr << "Wrote " << profiler.sampleCount() << " samples to " << profilePath << "\n";
     }
     return 0;
 }
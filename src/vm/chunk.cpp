@@ -1,25 +1,293 @@
 #include "chunk.hpp"
+#include "object/function.hpp"
+#include "object/string.hpp"
+#include <algorithm>
+#include <cstring>
 
-void Chunk::write(uint8_t byte, int line) {
+const char* opcodeName(OpCode op) {
+    static const char* const names[OPCODE_COUNT] = {
+        "CONSTANT", "NIL", "TRUE", "FALSE",
+        "ADD", "SUBTRACT", "MULTIPLY", "DIVIDE", "NEGATE", "MODULO", "POW",
+        "BIT_AND", "BIT_OR", "BIT_XOR", "BIT_NOT", "SHIFT_LEFT", "SHIFT_RIGHT",
+        "NOT", "EQUAL", "GREATER", "LESS",
+        "PRINT", "POP", "DEFINE_GLOBAL", "GET_GLOBAL", "SET_GLOBAL",
+        "GET_LOCAL", "SET_LOCAL", "JUMP_IF_FALSE", "JUMP", "LOOP",
+        "CALL", "TAIL_CALL", "CLOSURE", "GET_UPVALUE", "SET_UPVALUE", "CLOSE_UPVALUE",
+        "CLASS", "SET_PROPERTY", "GET_PROPERTY", "METHOD", "INVOKE", "INHERIT", "GET_SUPER", "BUILD_LIST", "GET_SUBSCRIPT", "SET_SUBSCRIPT",
+        "YIELD", "RESUME", "IMPORT", "WIDE",
+        "INLINE_CALL", "INLINE_INVOKE", "CHECK_RANGE", "GET_INDEX",
+        "ADD_NUM", "ADD_STR", "LESS_NUM", "GREATER_NUM", "GET_FIELD", "CALL_CLOSURE",
+        "RETURN"
+    };
+    int index = static_cast<int>(op);
+    return index < OPCODE_COUNT ? names[index] : "UNKNOWN";
+}
+
+void Chunk::write(uint8_t byte, int line, int column) {
+    if (lines.empty() || lines.back().line != line) {
+        lines.push_back({static_cast<uint32_t>(code.size()), line});
+    }
+    if (columns.empty() || columns.back().column != column) {
+        columns.push_back({static_cast<uint32_t>(code.size()), column});
+    }
     code.push_back(byte);
-    if (lines.empty() || lines.back() != line) {
-        lines.push_back(line);
-    } else {
-        lines.back() = line;
+}
+
+static uint64_t constantBits(const Value& value) {
+    uint64_t bits = 0;
+    std::visit([&bits](auto v) {
+        if constexpr (!std::is_same_v<decltype(v), std::nullptr_t>) std::memcpy(&bits, &v, sizeof v);
+    }, value);
+    return bits;
+}
+
+size_t ConstantHash::operator()(const Value& value) const {
+    if (isObjType(value, Obj::Type::STRING)) {
+        return ObjStringHash()(AS_STRING(value));
     }
+    return std::hash<uint64_t>()(constantBits(value)) ^ value.index();
+}
+
+bool ConstantEqual::operator()(const Value& a, const Value& b) const {
+    if (isObjType(a, Obj::Type::STRING) && isObjType(b, Obj::Type::STRING)) {
+        return ObjStringEqual()(AS_STRING(a), AS_STRING(b));
+    }
+    return a.index() == b.index() && constantBits(a) == constantBits(b);
 }
 
 int Chunk::addConstant(Value value) {
+    auto found = constantIndices.find(value);
+    if (found != constantIndices.end()) return found->second;
     constants.push_back(value);
-    return static_cast<int>(constants.size()) - 1;
+    int index = static_cast<int>(constants.size()) - 1;
+    constantIndices[value] = index;
+    return index;
+}
+
+void Chunk::finish() {
+    constantIndices = {};
+}
+
+// The entry of a run table that covers offset.
+template <typename Start>
+static const Start* findStart(const std::vector<Start>& starts, size_t offset) {
+    if (starts.empty()) return nullptr;
+    auto it = std::upper_bound(starts.begin(), starts.end(), offset,
+        [](size_t offset, const Start& start) { return offset < start.offset; });
+    if (it == starts.begin()) return &starts.front();
+    return &*(it - 1);
 }
 
 int Chunk::getLine(size_t offset) const {
-    size_t i = 0;
-    for (size_t idx = 0; idx < lines.size(); ++idx) {
-        size_t next = (idx + 1 < lines.size()) ? (i + 1) : code.size();
-        if (offset < next) return lines[idx];
-        i = next;
+    const LineStart* start = findStart(lines, offset);
+    return start ? start->line : 0;
+}
+
+int Chunk::getColumn(size_t offset) const {
+    const ColumnStart* start = findStart(columns, offset);
+    return start ? start->column : 0;
+}
+
+const InlinedCode* Chunk::findInlined(size_t offset) const {
+    auto it = std::upper_bound(inlined.begin(), inlined.end(), offset,
+        [](size_t offset, const InlinedCode& code) { return offset < code.start; });
+    if (it == inlined.begin() || offset >= (it - 1)->end) return nullptr;
+    return &*(it - 1);
+}
+
+size_t Chunk::readWide(size_t offset, uint32_t& operand) const {
+    operand = 0;
+    while (static_cast<OpCode>(code[offset]) == OpCode::WIDE) {
+        operand = (operand | code[offset + 1]) << 8;
+        offset += 2;
+    }
+    if (offset + 1 < code.size()) operand |= code[offset + 1];
+    return offset;
+}
+
+size_t Chunk::instructionLength(size_t offset) const {
+    switch (static_cast<OpCode>(code[offset])) {
+        case OpCode::CONSTANT:
+        case OpCode::DEFINE_GLOBAL:
+        case OpCode::GET_GLOBAL:
+        case OpCode::SET_GLOBAL:
+        case OpCode::GET_LOCAL:
+        case OpCode::SET_LOCAL:
+        case OpCode::CALL:
+        case OpCode::TAIL_CALL:
+        case OpCode::GET_UPVALUE:
+        case OpCode::SET_UPVALUE:
+        case OpCode::CLASS:
+        case OpCode::SET_PROPERTY:
+        case OpCode::GET_PROPERTY:
+        case OpCode::GET_FIELD:
+        case OpCode::CALL_CLOSURE:
+        case OpCode::METHOD:
+        case OpCode::GET_SUPER:
+        case OpCode::BUILD_LIST:
+        case OpCode::IMPORT:
+            return 2;
+        case OpCode::JUMP_IF_FALSE:
+        case OpCode::JUMP:
+        case OpCode::LOOP:
+        case OpCode::INVOKE:
+        case OpCode::CHECK_RANGE:
+            return 3;
+        case OpCode::GET_INDEX:
+            return 4;
+        case OpCode::INLINE_CALL:
+            return 5;
+        case OpCode::INLINE_INVOKE:
+            return 6;
+        case OpCode::CLOSURE: {
+            ObjFunction* function = AS_FUNCTION(constants[code[offset + 1]]);
+            return 2 + 2 * static_cast<size_t>(function->upvalueCount);
+        }
+        case OpCode::WIDE: {
+            uint32_t operand;
+            size_t start = readWide(offset, operand);
+            if (static_cast<OpCode>(code[start]) == OpCode::CLOSURE) {
+                ObjFunction* function = AS_FUNCTION(constants[operand]);
+                return start - offset + 2 + 2 * static_cast<size_t>(function->upvalueCount);
+            }
+            return start - offset + instructionLength(start);
+        }
+        default:
+            return 1;
+    }
+}
+
+int Chunk::stackEffect(size_t offset) const {
+    switch (static_cast<OpCode>(code[offset])) {
+        case OpCode::CONSTANT:
+        case OpCode::NIL:
+        case OpCode::TRUE:
+        case OpCode::FALSE:
+        case OpCode::GET_GLOBAL:
+        case OpCode::GET_LOCAL:
+        case OpCode::CLOSURE:
+        case OpCode::GET_UPVALUE:
+        case OpCode::CLASS:
+        case OpCode::GET_INDEX:
+        case OpCode::IMPORT:
+            return 1;
+        case OpCode::NEGATE:
+        case OpCode::BIT_NOT:
+        case OpCode::NOT:
+        case OpCode::SET_GLOBAL:
+        case OpCode::SET_LOCAL:
+        case OpCode::JUMP_IF_FALSE:
+        case OpCode::JUMP:
+        case OpCode::LOOP:
+        case OpCode::SET_UPVALUE:
+        case OpCode::GET_PROPERTY:
+        case OpCode::GET_FIELD:
+        case OpCode::YIELD:
+        case OpCode::INLINE_CALL:
+        case OpCode::INLINE_INVOKE:
+        case OpCode::RETURN:
+            return 0;
+        case OpCode::ADD:
+        case OpCode::SUBTRACT:
+        case OpCode::MULTIPLY:
+        case OpCode::DIVIDE:
+        case OpCode::MODULO:
+        case OpCode::POW:
+        case OpCode::BIT_AND:
+        case OpCode::BIT_OR:
+        case OpCode::BIT_XOR:
+        case OpCode::SHIFT_LEFT:
+        case OpCode::SHIFT_RIGHT:
+        case OpCode::EQUAL:
+        case OpCode::GREATER:
+        case OpCode::LESS:
+        case OpCode::PRINT:
+        case OpCode::POP:
+        case OpCode::DEFINE_GLOBAL:
+        case OpCode::CLOSE_UPVALUE:
+        case OpCode::SET_PROPERTY:
+        case OpCode::METHOD:
+        case OpCode::INHERIT:
+        case OpCode::GET_SUPER:
+        case OpCode::GET_SUBSCRIPT:
+        case OpCode::RESUME:
+        case OpCode::ADD_NUM:
+        case OpCode::ADD_STR:
+        case OpCode::LESS_NUM:
+        case OpCode::GREATER_NUM:
+            return -1;
+        case OpCode::SET_SUBSCRIPT:
+            return -2;
+        case OpCode::CALL:
+        case OpCode::TAIL_CALL:
+        case OpCode::CALL_CLOSURE:
+            return -code[offset + 1];
+        case OpCode::INVOKE:
+            return -code[offset + 2];
+        case OpCode::BUILD_LIST:
+            return 1 - code[offset + 1];
+        case OpCode::WIDE: {
+            // Only the first operand is widened, and no count is one.
+            uint32_t operand;
+            return stackEffect(readWide(offset, operand));
+        }
+    }
+    return 0;
+}
+
+// Walks every path through the code once. The compiler leaves the stack
+// the same height wherever paths meet, so the first height that reaches an
+// offset is its only one.
+int Chunk::maxStackDepth(int arity) const {
+    std::vector<int> heights(code.size(), -1);
+    std::vector<size_t> pending;
+    int deepest = arity + 1;
+    auto reach = [&](size_t offset, int height) {
+        if (offset >= code.size() || heights[offset] >= 0) return;
+        heights[offset] = height;
+        pending.push_back(offset);
+    };
+    reach(0, deepest);
+
+    auto jump = [&](size_t operand) { return static_cast<size_t>((code[operand] << 8) | code[operand + 1]); };
+    while (!pending.empty()) {
+        size_t offset = pending.back();
+        pending.pop_back();
+        int height = heights[offset] + stackEffect(offset);
+        deepest = std::max(deepest, height);
+        // GET_INDEX falls back by pushing the list and index to subscript.
+        if (static_cast<OpCode>(code[offset]) == OpCode::GET_INDEX) {
+            deepest = std::max(deepest, heights[offset] + 2);
+        }
+        size_t next = offset + instructionLength(offset);
+        // Read through any WIDE prefixes, which supply a jump's bytes above
+        // its 16-bit operand.
+        uint32_t high;
+        size_t start = readWide(offset, high);
+        auto distance = [&] { return static_cast<size_t>(high << 8 | code[start + 2]); };
+        switch (static_cast<OpCode>(code[start])) {
+            case OpCode::RETURN:
+                continue;
+            case OpCode::JUMP:
+                reach(next + distance(), height);
+                continue;
+            case OpCode::LOOP:
+                reach(next - distance(), height);
+                continue;
+            case OpCode::JUMP_IF_FALSE:
+                reach(next + distance(), height);
+                break;
+            // A failed guard skips the inlined body to the original call.
+            case OpCode::INLINE_CALL:
+                reach(next + jump(offset + 3), height);
+                break;
+            case OpCode::INLINE_INVOKE:
+                reach(next + jump(offset + 4), height);
+                break;
+            default:
+                break;
+        }
+        reach(next, height);
     }
-    return lines.back();
+    return deepest;
 }
@@ -2,6 +2,14 @@
 #include "common/common.hpp"
 #include "value.hpp"
 
+// RETURN stays last: OPCODE_COUNT and the name table depend on it.
+// INLINE_CALL and INLINE_INVOKE come from the inliner, and CHECK_RANGE and
+// GET_INDEX from the loop optimizer, not the parser.
+// ADD_NUM through CALL_CLOSURE are never emitted by the compiler; the VM
+// quickens generic instructions into them at run time.
+// WIDE b prefixes an instruction whose first operand does not fit its
+// encoding and supplies the operand's next higher byte; prefixes chain, so
+// an operand of one byte can reach 24 bits and a jump's 16-bit one 32.
 enum class OpCode : uint8_t {
     CONSTANT, NIL, TRUE, FALSE,
     ADD, SUBTRACT, MULTIPLY, DIVIDE, NEGATE, MODULO, POW,
@@ -9,17 +17,92 @@ enum class OpCode : uint8_t {
     NOT, EQUAL, GREATER, LESS,
     PRINT, POP, DEFINE_GLOBAL, GET_GLOBAL, SET_GLOBAL,
     GET_LOCAL, SET_LOCAL, JUMP_IF_FALSE, JUMP, LOOP,
-    CALL, CLOSURE, GET_UPVALUE, SET_UPVALUE, CLOSE_UPVALUE,
-    CLASS, SET_PROPERTY, GET_PROPERTY, METHOD, INVOKE, INHERIT, GET_SUPER, BUILD_LIST, GET_SUBSCRIPT, SET_SUBSCRIPT, RETURN
+    CALL, TAIL_CALL, CLOSURE, GET_UPVALUE, SET_UPVALUE, CLOSE_UPVALUE,
+    CLASS, SET_PROPERTY, GET_PROPERTY, METHOD, INVOKE, INHERIT, GET_SUPER, BUILD_LIST, GET_SUBSCRIPT, SET_SUBSCRIPT,
+    YIELD, RESUME, IMPORT, WIDE,
+    INLINE_CALL, INLINE_INVOKE, CHECK_RANGE, GET_INDEX,
+    ADD_NUM, ADD_STR, LESS_NUM, GREATER_NUM, GET_FIELD, CALL_CLOSURE,
+    RETURN
+};
+
+constexpr int OPCODE_COUNT = static_cast<int>(OpCode::RETURN) + 1;
+
+// The first byte of each (kind, index) pair that follows CLOSURE: copy the
+// enclosing closure's upvalue index, box the enclosing frame's slot index,
+// or copy that slot's value, for a variable nothing assigns after its
+// declaration.
+enum class Capture : uint8_t { UPVALUE, LOCAL, LOCAL_VALUE };
+
+const char* opcodeName(OpCode op);
+
+// One entry per run of bytecode from the same source line; offsets are
+// increasing, so lookups are a binary search.
+struct LineStart {
+    uint32_t offset;
+    int line;
+};
+
+// Columns change at almost every instruction, so they get a run table of
+// their own and leave the line runs long.
+struct ColumnStart {
+    uint32_t offset;
+    int column;
+};
+
+class ObjFunction;
+
+// A body the inliner copied into this chunk. Its lines are the callee's, so
+// traces and profiles can still show the callee as a frame of its own.
+struct InlinedCode {
+    uint32_t start;
+    uint32_t end;
+    const ObjFunction* function;
+};
+
+// Constants are compared by bits, so that 0 and -0 stay apart, strings by
+// their characters, since every string literal allocates its own object,
+// and other objects by identity.
+struct ConstantHash {
+    size_t operator()(const Value& value) const;
+};
+
+struct ConstantEqual {
+    bool operator()(const Value& a, const Value& b) const;
 };
 
 class Chunk {
 public:
     std::vector<uint8_t> code;
     std::vector<Value> constants;
-    std::vector<int> lines;
+    std::vector<LineStart> lines;
+    std::vector<ColumnStart> columns;
+    // In increasing order of offset.
+    std::vector<InlinedCode> inlined;
 
-    void write(uint8_t byte, int line);
+    void write(uint8_t byte, int line, int column = 0);
+    // The index of an equal constant already in the chunk, if any. Only
+    // constants added since the last finish() are found.
     int addConstant(Value value);
+    // Drops the constant index once the function is compiled.
+    void finish();
     int getLine(size_t offset) const;
+    int getColumn(size_t offset) const;
+    // Size of the instruction at offset, operands included. WIDE prefixes
+    // count as part of the instruction they extend.
+    size_t instructionLength(size_t offset) const;
+    // How much the instruction at offset grows (or shrinks) the stack.
+    int stackEffect(size_t offset) const;
+    // The most values a frame running this code holds at once, counting the
+    // callee and arity arguments it starts with.
+    int maxStackDepth(int arity) const;
+    // Where the instruction that any WIDE prefixes at offset extend starts,
+    // with its first one-byte operand read through them into operand.
+    size_t readWide(size_t offset, uint32_t& operand) const;
+    // The inlined body containing offset, or nullptr.
+    const InlinedCode* findInlined(size_t offset) const;
+
+private:
+    std::unordered_map<Value, int, ConstantHash, ConstantEqual> constantIndices;
+
+    const LineStart* findLine(size_t offset) const;
 };
@@ -0,0 +1,419 @@
+#include "event_loop.hpp"
+#include "vm.hpp"
+#include "object/string.hpp"
+#include "object/closure.hpp"
+#include "object/list.hpp"
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+EventLoop::EventLoop() {
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+}
+
+EventLoop::~EventLoop() {
+    if (epollFd >= 0) close(epollFd);
+}
+
+void EventLoop::spawn(ObjFiber* fiber) {
+    ready.push_back({fiber, Value(nullptr)});
+}
+
+Value EventLoop::await(VM& vm, int fd, uint32_t events, Attempt attempt) {
+    Value result;
+    if (attempt(vm, result)) return result;
+    return wait(vm, fd, events, Clock::time_point::max(), std::move(attempt));
+}
+
+Value EventLoop::sleep(VM& vm, double milliseconds) {
+    auto delay = std::chrono::duration<double, std::milli>(std::max(0.0, milliseconds));
+    Clock::time_point deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(delay);
+    return wait(vm, -1, 0, deadline, [](VM&, Value& result) {
+        result = Value(nullptr);
+        return true;
+    });
+}
+
+Value EventLoop::wait(VM& vm, int fd, uint32_t events, Clock::time_point deadline, Attempt attempt) {
+    Waiter waiter;
+    waiter.attempt = std::move(attempt);
+    if (vm.canPark()) {
+        waiter.fiber = vm.fiber;
+        add(fd, events, deadline, std::move(waiter));
+        vm.park();
+        return Value(nullptr);
+    }
+
+    bool done = false;
+    Value result;
+    waiter.done = &done;
+    waiter.result = &result;
+    add(fd, events, deadline, std::move(waiter));
+    if (!runUntil(vm, &done)) return vm.nativeError("");
+    return result;
+}
+
+void EventLoop::add(int fd, uint32_t events, Clock::time_point deadline, Waiter waiter) {
+    if (fd < 0) {
+        timers.emplace(deadline, std::move(waiter));
+        return;
+    }
+    descriptors[fd].emplace_back(events, std::move(waiter));
+    updateInterest(fd);
+}
+
+void EventLoop::complete(Waiter& waiter, Value result) {
+    if (waiter.fiber) {
+        ready.push_back({waiter.fiber, result});
+    } else {
+        *waiter.result = result;
+        *waiter.done = true;
+    }
+}
+
+void EventLoop::updateInterest(int fd) {
+    uint32_t events = 0;
+    auto it = descriptors.find(fd);
+    if (it != descriptors.end()) {
+        for (auto& entry : it->second) events |= entry.first;
+    }
+
+    auto known = registered.find(fd);
+    if (events == 0) {
+        if (it != descriptors.end()) descriptors.erase(it);
+        if (known != registered.end()) {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+            registered.erase(known);
+        }
+        return;
+    }
+    if (known != registered.end() && known->second == events) return;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = fd;
+    int op = known == registered.end() ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (epoll_ctl(epollFd, op, fd, &event) == 0) {
+        registered[fd] = events;
+        return;
+    }
+
+    // Not pollable (or already closed): give every waiter its answer now.
+    std::vector<std::pair<uint32_t, Waiter>> waiters = std::move(it->second);
+    descriptors.erase(it);
+    for (auto& entry : waiters) complete(entry.second, Value(nullptr));
+}
+
+void EventLoop::forget(int fd) {
+    auto it = descriptors.find(fd);
+    if (it != descriptors.end()) {
+        std::vector<std::pair<uint32_t, Waiter>> waiters = std::move(it->second);
+        descriptors.erase(it);
+        for (auto& entry : waiters) complete(entry.second, Value(nullptr));
+    }
+    auto known = registered.find(fd);
+    if (known != registered.end()) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        registered.erase(known);
+    }
+}
+
+bool EventLoop::pending() const {
+    return !ready.empty() || !descriptors.empty() || !timers.empty();
+}
+
+bool EventLoop::run(VM& vm) {
+    return runUntil(vm, nullptr);
+}
+
+bool EventLoop::runUntil(VM& vm, const bool* done) {
+    while (done ? !*done : pending()) {
+        if (!pending()) break;
+        if (!step(vm)) {
+            clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+// Resumes the tasks that were runnable on entry, then waits for I/O or the
+// next timer. Waiting is skipped while more tasks are runnable.
+bool EventLoop::step(VM& vm) {
+    for (size_t count = ready.size(); count > 0 && !ready.empty(); --count) {
+        Ready next = ready.front();
+        ready.pop_front();
+        if (next.fiber->state == ObjFiber::State::WAITING) {
+            next.fiber->state = ObjFiber::State::SUSPENDED;
+        }
+        if (next.fiber->state != ObjFiber::State::NEW && next.fiber->state != ObjFiber::State::SUSPENDED) {
+            continue;
+        }
+        if (!vm.resumeFromHost(next.fiber, next.value)) return false;
+        // A task that yields gives the others a turn and goes to the back.
+        if (next.fiber->state == ObjFiber::State::SUSPENDED) ready.push_back({next.fiber, Value(nullptr)});
+    }
+
+    int timeout = -1;
+    if (!ready.empty()) {
+        timeout = 0;
+    } else if (!timers.empty()) {
+        auto remaining = std::chrono::duration<double, std::milli>(timers.begin()->first - Clock::now());
+        timeout = static_cast<int>(std::ceil(std::max(0.0, remaining.count())));
+    } else if (descriptors.empty()) {
+        return true;
+    }
+    poll(vm, timeout);
+    return true;
+}
+
+void EventLoop::poll(VM& vm, int timeoutMs) {
+    struct epoll_event events[64];
+    int count = epoll_wait(epollFd, events, 64, timeoutMs);
+    for (int i = 0; i < count; ++i) {
+        int fd = events[i].data.fd;
+        auto it = descriptors.find(fd);
+        if (it == descriptors.end()) continue;
+
+        uint32_t fired = events[i].events;
+        std::vector<std::pair<uint32_t, Waiter>>& waiters = it->second;
+        for (size_t w = 0; w < waiters.size();) {
+            Value result;
+            if ((waiters[w].first & fired) == 0 && (fired & (EPOLLERR | EPOLLHUP)) == 0) {
+                ++w;
+            } else if (waiters[w].second.attempt(vm, result)) {
+                complete(waiters[w].second, result);
+                waiters.erase(waiters.begin() + static_cast<std::ptrdiff_t>(w));
+            } else {
+                ++w;
+            }
+        }
+        updateInterest(fd);
+    }
+
+    Clock::time_point now = Clock::now();
+    while (!timers.empty() && timers.begin()->first <= now) {
+        Waiter waiter = std::move(timers.begin()->second);
+        timers.erase(timers.begin());
+        Value result;
+        waiter.attempt(vm, result);
+        complete(waiter, result);
+    }
+}
+
+void EventLoop::clear() {
+    for (auto& entry : registered) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, entry.first, nullptr);
+    }
+    registered.clear();
+    descriptors.clear();
+    timers.clear();
+    ready.clear();
+}
+
+void EventLoop::forEachRoot(const std::function<void(Obj*)>& mark,
+                            const std::function<void(const Value&)>& markValue) const {
+    for (const Ready& entry : ready) {
+        mark(reinterpret_cast<Obj*>(entry.fiber));
+        markValue(entry.value);
+    }
+    for (const auto& fd : descriptors) {
+        for (const auto& entry : fd.second) {
+            if (entry.second.fiber) mark(reinterpret_cast<Obj*>(entry.second.fiber));
+        }
+    }
+    for (const auto& timer : timers) {
+        if (timer.second.fiber) mark(reinterpret_cast<Obj*>(timer.second.fiber));
+    }
+}
+
+EventLoop& VM::eventLoop() {
+    if (!loop) loop = std::make_unique<EventLoop>();
+    return *loop;
+}
+
+static bool fdArg(const std::vector<Value>& args, size_t index, int& fd) {
+    if (args.size() <= index || !isNumber(args[index])) return false;
+    fd = toInt(args[index]);
+    return fd >= 0;
+}
+
+static Value fdValue(int fd) {
+    return fd < 0 ? Value(nullptr) : Value(static_cast<int32_t>(fd));
+}
+
+// Readiness check that also works on descriptors left in blocking mode,
+// such as stdin.
+static bool isReady(int fd, short events) {
+    struct pollfd p = {fd, events, 0};
+    return ::poll(&p, 1, 0) != 0;
+}
+
+Value VM::spawnNative(VM& vm, const std::vector<Value>& args) {
+    if (args.empty() || !isObjType(args[0], Obj::Type::CLOSURE)) {
+        return vm.nativeError("spawn expects a function.");
+    }
+    ObjFiber* task = vm.newFiber(AS_CLOSURE(args[0]));
+    task->task = true;
+    vm.eventLoop().spawn(task);
+    return Value(task);
+}
+
+Value VM::sleepNative(VM& vm, const std::vector<Value>& args) {
+    if (args.empty() || !isNumber(args[0])) return Value(nullptr);
+    return vm.eventLoop().sleep(vm, asNumber(args[0]));
+}
+
+Value VM::runLoopNative(VM& vm, const std::vector<Value>&) {
+    if (!vm.eventLoop().run(vm)) return vm.nativeError("");
+    return Value(nullptr);
+}
+
+Value VM::readFdNative(VM& vm, const std::vector<Value>& args) {
+    int fd;
+    if (!fdArg(args, 0, fd)) return Value(nullptr);
+    size_t limit = 65536;
+    if (args.size() > 1 && isNumber(args[1]) && asNumber(args[1]) >= 1) {
+        limit = static_cast<size_t>(asNumber(args[1]));
+    }
+    return vm.eventLoop().await(vm, fd, EPOLLIN, [fd, limit](VM& vm, Value& result) {
+        if (!isReady(fd, POLLIN)) return false;
+        std::string buffer(limit, '\0');
+        ssize_t n;
+        do {
+            n = read(fd, &buffer[0], limit);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+        if (n <= 0) {
+            result = Value(nullptr);
+        } else {
+            buffer.resize(static_cast<size_t>(n));
+            result = Value(vm.allocateString(buffer));
+        }
+        return true;
+    });
+}
+
+Value VM::writeFdNative(VM& vm, const std::vector<Value>& args) {
+    int fd;
+    if (!fdArg(args, 0, fd) || args.size() < 2) return Value(nullptr);
+    auto data = std::make_shared<std::string>(isObjType(args[1], Obj::Type::STRING)
+        ? std::string(AS_STRING(args[1])->view()) : valueToString(args[1]));
+    auto written = std::make_shared<size_t>(0);
+    return vm.eventLoop().await(vm, fd, EPOLLOUT, [fd, data, written](VM&, Value& result) {
+        while (*written < data->size()) {
+            if (!isReady(fd, POLLOUT)) return false;
+            const char* chunk = data->data() + *written;
+            size_t length = data->size() - *written;
+            ssize_t n = send(fd, chunk, length, MSG_NOSIGNAL);
+            if (n < 0 && errno == ENOTSOCK) n = write(fd, chunk, length);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+                result = Value(nullptr);
+                return true;
+            }
+            *written += static_cast<size_t>(n);
+        }
+        result = Value(static_cast<double>(*written));
+        return true;
+    });
+}
+
+Value VM::closeFdNative(VM& vm, const std::vector<Value>& args) {
+    int fd;
+    if (!fdArg(args, 0, fd)) return Value(false);
+    if (vm.loop) vm.loop->forget(fd);
+    return Value(close(fd) == 0);
+}
+
+Value VM::openFdNative(VM&, const std::vector<Value>& args) {
+    if (args.empty() || !isObjType(args[0], Obj::Type::STRING)) return Value(nullptr);
+    std::string_view mode = args.size() > 1 && isObjType(args[1], Obj::Type::STRING) ? AS_STRING(args[1])->view() : "r";
+    int flags = O_CLOEXEC | O_NONBLOCK;
+    if (mode == "r") {
+        flags |= O_RDONLY;
+    } else if (mode == "w") {
+        flags |= O_WRONLY | O_CREAT | O_TRUNC;
+    } else if (mode == "a") {
+        flags |= O_WRONLY | O_CREAT | O_APPEND;
+    } else {
+        return Value(nullptr);
+    }
+    return fdValue(open(AS_CSTRING(args[0]), flags, 0644));
+}
+
+static Value fdPair(VM& vm, int fds[2]) {
+    ObjList* list = vm.newList();
+    list->elements.push_back(fdValue(fds[0]));
+    list->elements.push_back(fdValue(fds[1]));
+    return Value(list);
+}
+
+Value VM::pipeNative(VM& vm, const std::vector<Value>&) {
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0) return Value(nullptr);
+    return fdPair(vm, fds);
+}
+
+Value VM::socketPairNative(VM& vm, const std::vector<Value>&) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) != 0) return Value(nullptr);
+    return fdPair(vm, fds);
+}
+
+static bool unixAddress(const Value& path, struct sockaddr_un& address) {
+    if (!isObjType(path, Obj::Type::STRING)) return false;
+    std::string_view str = AS_STRING(path)->view();
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (str.empty() || str.size() >= sizeof(address.sun_path)) return false;
+    memcpy(address.sun_path, str.data(), str.size());
+    return true;
+}
+
+Value VM::listenUnixNative(VM&, const std::vector<Value>& args) {
+    struct sockaddr_un address;
+    if (args.empty() || !unixAddress(args[0], address)) return Value(nullptr);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return Value(nullptr);
+    unlink(address.sun_path);
+    if (bind(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0 || listen(fd, 128) != 0) {
+        close(fd);
+        return Value(nullptr);
+    }
+    return fdValue(fd);
+}
+
+// Local connects complete immediately or fail, so this one does not go
+// through the loop.
+Value VM::connectUnixNative(VM&, const std::vector<Value>& args) {
+    struct sockaddr_un address;
+    if (args.empty() || !unixAddress(args[0], address)) return Value(nullptr);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return Value(nullptr);
+    if (connect(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0) {
+        close(fd);
+        return Value(nullptr);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fdValue(fd);
+}
+
+Value VM::acceptNative(VM& vm, const std::vector<Value>& args) {
+    int fd;
+    if (!fdArg(args, 0, fd)) return Value(nullptr);
+    return vm.eventLoop().await(vm, fd, EPOLLIN, [fd](VM&, Value& result) {
+        int client = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return false;
+        result = fdValue(client);
+        return true;
+    });
+}
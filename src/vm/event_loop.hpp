@@ -0,0 +1,70 @@
+#pragma once
+#include "common/common.hpp"
+#include "value.hpp"
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+
+class VM;
+class Obj;
+class ObjFiber;
+
+// epoll-based scheduler for spawned fibers. A native that would block hands
+// the loop an attempt function. A spawned task parks and the loop resumes
+// it with the attempt's result once the descriptor is ready. Any other
+// fiber waits in place while the loop keeps running the tasks.
+class EventLoop {
+public:
+    using Clock = std::chrono::steady_clock;
+    // Tries the operation without blocking; returns true once result is set.
+    using Attempt = std::function<bool(VM& vm, Value& result)>;
+
+    EventLoop();
+    ~EventLoop();
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    void spawn(ObjFiber* fiber);
+    // events is EPOLLIN or EPOLLOUT.
+    Value await(VM& vm, int fd, uint32_t events, Attempt attempt);
+    Value sleep(VM& vm, double milliseconds);
+
+    // Runs until no task is runnable or waiting. False after a runtime error.
+    bool run(VM& vm);
+    bool pending() const;
+    // Wakes everything waiting on fd with nil; called before it is closed.
+    void forget(int fd);
+
+    void forEachRoot(const std::function<void(Obj*)>& mark, const std::function<void(const Value&)>& markValue) const;
+
+private:
+    struct Waiter {
+        ObjFiber* fiber = nullptr;
+        Attempt attempt;
+        // Set instead of fiber when a fiber waits in place.
+        bool* done = nullptr;
+        Value* result = nullptr;
+    };
+    struct Ready {
+        ObjFiber* fiber;
+        Value value;
+    };
+
+    Value wait(VM& vm, int fd, uint32_t events, Clock::time_point deadline, Attempt attempt);
+    void add(int fd, uint32_t events, Clock::time_point deadline, Waiter waiter);
+    void complete(Waiter& waiter, Value result);
+    bool runUntil(VM& vm, const bool* done);
+    bool step(VM& vm);
+    void poll(VM& vm, int timeoutMs);
+    void updateInterest(int fd);
+    // Drops every task and waiter after a runtime error unwound them.
+    void clear();
+
+    int epollFd = -1;
+    std::deque<Ready> ready;
+    std::map<int, std::vector<std::pair<uint32_t, Waiter>>> descriptors;
+    std::multimap<Clock::time_point, Waiter> timers;
+    std::map<int, uint32_t> registered;
+};
@@ -0,0 +1,96 @@
+#include "isolate.hpp"
+#include "object/string.hpp"
+#include "object/function.hpp"
+
+ObjFunction* CodeCache::compile(const std::string& source) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = scripts.find(source);
+    if (it != scripts.end()) return it->second;
+
+    ObjFunction* function = owner.compile(source);
+    if (!function) return nullptr;
+    // Objects from earlier scripts are already marked and other threads may
+    // be reading their headers, so only the new ones are written.
+    for (Obj* object = owner.objects; object != nullptr; object = object->next()) {
+        if (!object->marked()) object->setMarked(true);
+    }
+    scripts.emplace(source, function);
+    return function;
+}
+
+bool Isolate::load(ObjFunction* script) {
+    if (loaded.count(script)) return true;
+    if (!vm.interpret(script)) return false;
+    loaded.insert(script);
+    return true;
+}
+
+bool Isolate::call(const std::string& function, const std::vector<std::string>& args,
+                   std::string* result) {
+    auto it = vm.globals.find(function);
+    if (it == vm.globals.end()) {
+        vm.runtimeError("Undefined variable '%s'.", function.c_str());
+        return false;
+    }
+    if (!vm.ensureStack(static_cast<int>(args.size()) + 1)) {
+        vm.runtimeError("Stack overflow.");
+        return false;
+    }
+    vm.push(it->second);
+    for (const std::string& arg : args) {
+        vm.push(Value(vm.allocateString(arg)));
+    }
+    if (!vm.callFromHost(static_cast<int>(args.size()))) return false;
+    if (result) *result = valueToString(vm.peek(0));
+    vm.pop();
+    return true;
+}
+
+IsolatePool::IsolatePool(size_t count) {
+    count = std::max<size_t>(count, 1);
+    for (size_t i = 0; i < count; ++i) {
+        isolates.push_back(std::make_unique<Isolate>());
+    }
+    for (auto& isolate : isolates) {
+        threads.emplace_back(&IsolatePool::work, this, std::ref(*isolate));
+    }
+}
+
+IsolatePool::~IsolatePool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    available.notify_all();
+    for (std::thread& thread : threads) thread.join();
+}
+
+void IsolatePool::submit(Job job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+    }
+    available.notify_one();
+}
+
+void IsolatePool::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this] { return jobs.empty() && busy == 0; });
+}
+
+void IsolatePool::work(Isolate& isolate) {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        available.wait(lock, [this] { return stopping || !jobs.empty(); });
+        if (jobs.empty()) return;
+
+        Job job = std::move(jobs.front());
+        jobs.pop_front();
+        busy++;
+        lock.unlock();
+        job(isolate);
+        lock.lock();
+        busy--;
+        if (jobs.empty() && busy == 0) idle.notify_all();
+    }
+}
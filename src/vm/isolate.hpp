@@ -0,0 +1,67 @@
+#pragma once
+#include "vm.hpp"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+
+// Compiles each script once for every isolate in the process. The cache owns
+// the compiled objects in a private heap whose objects are left permanently
+// marked: an isolate's collector stops at them and its sweep never sees
+// them, so they are shared read-only without locking. The cache must outlive
+// every VM that runs its scripts.
+class CodeCache {
+public:
+    // Returns the compiled script for source, or nullptr on a compile error.
+    ObjFunction* compile(const std::string& source);
+
+private:
+    std::mutex mutex;
+    VM owner;
+    std::unordered_map<std::string, ObjFunction*> scripts;
+};
+
+// A VM plus the cached scripts that have already run in it.
+class Isolate {
+public:
+    VM vm;
+
+    // Runs script once in this isolate so the globals it defines exist.
+    bool load(ObjFunction* script);
+    // Calls the global function with string arguments and stores the printed
+    // form of its result.
+    bool call(const std::string& function, const std::vector<std::string>& args,
+              std::string* result = nullptr);
+
+private:
+    std::unordered_set<ObjFunction*> loaded;
+};
+
+// N isolates on N threads. Jobs go to whichever isolate is idle; each
+// isolate is only ever touched by its own thread, so the interpreter itself
+// takes no locks.
+class IsolatePool {
+public:
+    using Job = std::function<void(Isolate&)>;
+
+    explicit IsolatePool(size_t count = std::thread::hardware_concurrency());
+    ~IsolatePool();
+
+    void submit(Job job);
+    // Blocks until every submitted job has finished.
+    void wait();
+    size_t size() const { return isolates.size(); }
+
+private:
+    void work(Isolate& isolate);
+
+    std::vector<std::unique_ptr<Isolate>> isolates;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable available;
+    std::condition_variable idle;
+    std::deque<Job> jobs;
+    size_t busy = 0;
+    bool stopping = false;
+};
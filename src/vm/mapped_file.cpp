@@ -0,0 +1,145 @@
+#include "mapped_file.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static bool readAll(int fd, std::string& out) {
+    char chunk[LineReader::CHUNK_SIZE];
+    for (;;) {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (n == 0) return true;
+        out.append(chunk, static_cast<size_t>(n));
+    }
+}
+
+MappedFile::~MappedFile() {
+    if (mapped) munmap(const_cast<char*>(data), length);
+}
+
+std::unique_ptr<MappedFile> MappedFile::open(const char* path) {
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+
+    std::unique_ptr<MappedFile> file(new MappedFile());
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && static_cast<size_t>(st.st_size) >= MAP_THRESHOLD) {
+        void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base != MAP_FAILED) {
+            madvise(base, st.st_size, MADV_SEQUENTIAL);
+            file->data = static_cast<const char*>(base);
+            file->length = st.st_size;
+            file->mapped = true;
+            close(fd);
+            return file;
+        }
+    }
+
+    bool ok = readAll(fd, file->buffer);
+    close(fd);
+    if (!ok) return nullptr;
+    file->data = file->buffer.data();
+    file->length = file->buffer.size();
+    return file;
+}
+
+LineReader::~LineReader() {
+    if (fd >= 0) close(fd);
+}
+
+std::unique_ptr<LineReader> LineReader::open(const char* path) {
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+
+    std::unique_ptr<LineReader> reader(new LineReader());
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        close(fd);
+        reader->file = MappedFile::open(path);
+        if (!reader->file) return nullptr;
+        reader->rest = reader->file->contents();
+        reader->eof = true;
+        return reader;
+    }
+
+    reader->fd = fd;
+    return reader;
+}
+
+bool LineReader::fill() {
+    if (position > 0) {
+        buffer.erase(0, position);
+        position = 0;
+    }
+    size_t used = buffer.size();
+    buffer.resize(used + CHUNK_SIZE);
+    for (;;) {
+        ssize_t n = read(fd, &buffer[used], CHUNK_SIZE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            buffer.resize(used);
+            eof = true;
+            return false;
+        }
+        buffer.resize(used + static_cast<size_t>(n));
+        return true;
+    }
+}
+
+bool LineReader::next(std::string_view& line) {
+    if (file) {
+        if (rest.empty()) return false;
+        size_t newline = rest.find('\n');
+        if (newline == std::string_view::npos) {
+            line = rest;
+            rest = std::string_view();
+        } else {
+            line = rest.substr(0, newline);
+            rest.remove_prefix(newline + 1);
+        }
+        return true;
+    }
+
+    size_t scanned = position;
+    for (;;) {
+        const void* found = memchr(buffer.data() + scanned, '\n', buffer.size() - scanned);
+        if (found != nullptr) {
+            size_t newline = static_cast<const char*>(found) - buffer.data();
+            line = std::string_view(buffer.data() + position, newline - position);
+            position = newline + 1;
+            return true;
+        }
+        if (eof) break;
+        scanned = buffer.size() - position;
+        fill();
+    }
+
+    if (position == buffer.size()) return false;
+    line = std::string_view(buffer.data() + position, buffer.size() - position);
+    position = buffer.size();
+    return true;
+}
+
+bool writeWholeFile(const char* path, std::string_view contents) {
+    int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    const char* data = contents.data();
+    size_t remaining = contents.size();
+    while (remaining > 0) {
+        ssize_t n = write(fd, data, remaining);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            close(fd);
+            return false;
+        }
+        data += n;
+        remaining -= static_cast<size_t>(n);
+    }
+    return close(fd) == 0;
+}
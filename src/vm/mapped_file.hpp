@@ -0,0 +1,52 @@
+#pragma once
+#include "common/common.hpp"
+#include <string_view>
+
+class MappedFile {
+public:
+    static constexpr size_t MAP_THRESHOLD = 64 * 1024;
+
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    static std::unique_ptr<MappedFile> open(const char* path);
+
+    std::string_view contents() const { return std::string_view(data, length); }
+
+private:
+    MappedFile() = default;
+
+    const char* data = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+    std::string buffer;
+};
+
+class LineReader {
+public:
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+    ~LineReader();
+
+    LineReader(const LineReader&) = delete;
+    LineReader& operator=(const LineReader&) = delete;
+
+    static std::unique_ptr<LineReader> open(const char* path);
+
+    bool next(std::string_view& line);
+
+private:
+    LineReader() = default;
+    bool fill();
+
+    int fd = -1;
+    std::unique_ptr<MappedFile> file;
+    std::string_view rest;
+    std::string buffer;
+    size_t position = 0;
+    bool eof = false;
+};
+
+bool writeWholeFile(const char* path, std::string_view contents);
@@ -0,0 +1,345 @@
+#include "module.hpp"
+#include "vm.hpp"
+#include "mapped_file.hpp"
+#include "object/string.hpp"
+#include "object/function.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr char MAGIC[4] = {'L', 'O', 'X', 'C'};
+// Bump whenever the layout below or the meaning of an opcode changes.
+constexpr uint32_t FORMAT_VERSION = 2;
+constexpr uint64_t FNV_OFFSET = 14695981039346656037ull;
+constexpr uint64_t FNV_PRIME = 1099511628211ull;
+
+enum class Tag : uint8_t { NUMBER, BOOL, NIL, INT, STRING, FUNCTION };
+
+uint64_t fnv1a(uint64_t hash, std::string_view bytes) {
+    for (char c : bytes) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+class Writer {
+public:
+    std::string bytes;
+
+    template <typename T>
+    void put(T value) { bytes.append(reinterpret_cast<const char*>(&value), sizeof value); }
+    void putBytes(std::string_view data) {
+        put(static_cast<uint32_t>(data.size()));
+        bytes.append(data);
+    }
+};
+
+// Reads past the end leave failed set and return zeros.
+class Reader {
+public:
+    explicit Reader(std::string_view bytes) : rest(bytes) {}
+
+    bool failed = false;
+
+    template <typename T>
+    T get() {
+        T value{};
+        if (rest.size() < sizeof value) {
+            failed = true;
+            return value;
+        }
+        memcpy(&value, rest.data(), sizeof value);
+        rest.remove_prefix(sizeof value);
+        return value;
+    }
+    std::string_view getBytes() {
+        uint32_t length = get<uint32_t>();
+        if (rest.size() < length) {
+            failed = true;
+            return {};
+        }
+        std::string_view data = rest.substr(0, length);
+        rest.remove_prefix(length);
+        return data;
+    }
+    // A count of items that each take at least one byte, so a damaged count
+    // cannot ask for more than the file could hold.
+    uint32_t getCount() {
+        uint32_t count = get<uint32_t>();
+        if (count > rest.size()) failed = true;
+        return failed ? 0 : count;
+    }
+
+private:
+    std::string_view rest;
+};
+
+using FunctionIds = std::unordered_map<const ObjFunction*, uint32_t>;
+
+// Numbers function and everything it references in the order they are
+// written; a callee the inliner copied is referenced from more than one
+// chunk but written once, so INLINE_CALL guards still compare equal.
+bool number(const ObjFunction* function, FunctionIds& ids, std::vector<const ObjFunction*>& order) {
+    if (ids.count(function)) return true;
+    if (function->deferred) return false;
+    ids.emplace(function, static_cast<uint32_t>(order.size()));
+    order.push_back(function);
+    for (const Value& constant : function->chunk.constants) {
+        if (isObjType(constant, Obj::Type::FUNCTION) && !number(AS_FUNCTION(constant), ids, order)) return false;
+    }
+    for (const InlinedCode& code : function->chunk.inlined) {
+        if (!number(code.function, ids, order)) return false;
+    }
+    return true;
+}
+
+bool writeConstant(Writer& out, const Value& value, const FunctionIds& ids) {
+    if (const double* number = std::get_if<double>(&value)) {
+        out.put(Tag::NUMBER);
+        out.put(*number);
+    } else if (const bool* boolean = std::get_if<bool>(&value)) {
+        out.put(Tag::BOOL);
+        out.put(static_cast<uint8_t>(*boolean));
+    } else if (std::holds_alternative<std::nullptr_t>(value)) {
+        out.put(Tag::NIL);
+    } else if (const int32_t* integer = std::get_if<int32_t>(&value)) {
+        out.put(Tag::INT);
+        out.put(*integer);
+    } else if (isObjType(value, Obj::Type::STRING)) {
+        out.put(Tag::STRING);
+        out.putBytes(AS_STRING(value)->view());
+    } else if (isObjType(value, Obj::Type::FUNCTION)) {
+        out.put(Tag::FUNCTION);
+        out.put(ids.at(AS_FUNCTION(value)));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool writeFunction(Writer& out, const ObjFunction* function, const FunctionIds& ids) {
+    const Chunk& chunk = function->chunk;
+    out.put(static_cast<int32_t>(function->arity));
+    out.put(static_cast<int32_t>(function->upvalueCount));
+    out.put(static_cast<int32_t>(function->maxSlots));
+    out.put(static_cast<uint8_t>(function->name != nullptr));
+    if (function->name) out.putBytes(function->name->view());
+    out.putBytes(std::string_view(reinterpret_cast<const char*>(chunk.code.data()), chunk.code.size()));
+    out.put(static_cast<uint32_t>(chunk.lines.size()));
+    for (const LineStart& line : chunk.lines) {
+        out.put(line.offset);
+        out.put(static_cast<int32_t>(line.line));
+    }
+    out.put(static_cast<uint32_t>(chunk.columns.size()));
+    for (const ColumnStart& column : chunk.columns) {
+        out.put(column.offset);
+        out.put(static_cast<int32_t>(column.column));
+    }
+    out.put(static_cast<uint32_t>(chunk.constants.size()));
+    for (const Value& constant : chunk.constants) {
+        if (!writeConstant(out, constant, ids)) return false;
+    }
+    out.put(static_cast<uint32_t>(chunk.inlined.size()));
+    for (const InlinedCode& code : chunk.inlined) {
+        out.put(code.start);
+        out.put(code.end);
+        out.put(ids.at(code.function));
+    }
+    return true;
+}
+
+bool readConstant(Reader& in, VM& vm, const std::vector<ObjFunction*>& functions, Value& value) {
+    switch (in.get<Tag>()) {
+        case Tag::NUMBER: value = Value(in.get<double>()); return true;
+        case Tag::BOOL: value = Value(in.get<uint8_t>() != 0); return true;
+        case Tag::NIL: value = Value(nullptr); return true;
+        case Tag::INT: value = Value(in.get<int32_t>()); return true;
+        case Tag::STRING: {
+            std::string_view chars = in.getBytes();
+            if (in.failed) return false;
+            value = Value(vm.allocateString(chars));
+            return true;
+        }
+        case Tag::FUNCTION: {
+            uint32_t id = in.get<uint32_t>();
+            if (id >= functions.size()) return false;
+            value = Value(static_cast<Obj*>(functions[id]));
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+bool readFunction(Reader& in, VM& vm, const std::vector<ObjFunction*>& functions, ObjFunction* function) {
+    Chunk& chunk = function->chunk;
+    function->arity = in.get<int32_t>();
+    function->upvalueCount = in.get<int32_t>();
+    function->maxSlots = in.get<int32_t>();
+    if (in.get<uint8_t>()) {
+        std::string_view name = in.getBytes();
+        if (in.failed) return false;
+        function->name = vm.allocateString(name);
+    }
+    std::string_view code = in.getBytes();
+    chunk.code.assign(code.begin(), code.end());
+    chunk.lines.resize(in.getCount());
+    for (LineStart& line : chunk.lines) {
+        line.offset = in.get<uint32_t>();
+        line.line = in.get<int32_t>();
+    }
+    chunk.columns.resize(in.getCount());
+    for (ColumnStart& column : chunk.columns) {
+        column.offset = in.get<uint32_t>();
+        column.column = in.get<int32_t>();
+    }
+    chunk.constants.resize(in.getCount());
+    for (Value& constant : chunk.constants) {
+        if (in.failed || !readConstant(in, vm, functions, constant)) return false;
+    }
+    chunk.inlined.resize(in.getCount());
+    for (InlinedCode& code : chunk.inlined) {
+        code.start = in.get<uint32_t>();
+        code.end = in.get<uint32_t>();
+        uint32_t id = in.get<uint32_t>();
+        if (id >= functions.size()) return false;
+        code.function = functions[id];
+    }
+    return !in.failed;
+}
+
+}  // namespace
+
+std::string cachedModulePath(const VM& vm, const std::string& dir, std::string_view source) {
+    uint64_t hash = FNV_OFFSET;
+    const uint8_t settings[] = {static_cast<uint8_t>(FORMAT_VERSION), static_cast<uint8_t>(OPCODE_COUNT),
+                                vm.inlining, vm.loopOptimization};
+    hash = fnv1a(hash, std::string_view(reinterpret_cast<const char*>(settings), sizeof settings));
+    hash = fnv1a(hash, source);
+    char name[32];
+    snprintf(name, sizeof name, "%016llx.loxc", static_cast<unsigned long long>(hash));
+    return dir + "/" + name;
+}
+
+bool saveModule(const ObjFunction* module, const std::string& path) {
+    FunctionIds ids;
+    std::vector<const ObjFunction*> order;
+    if (!number(module, ids, order)) return false;
+
+    Writer payload;
+    payload.put(static_cast<uint32_t>(order.size()));
+    for (const ObjFunction* function : order) {
+        if (!writeFunction(payload, function, ids)) return false;
+    }
+
+    Writer file;
+    file.bytes.append(MAGIC, sizeof MAGIC);
+    file.put(FORMAT_VERSION);
+    file.bytes += payload.bytes;
+    file.put(fnv1a(FNV_OFFSET, payload.bytes));
+
+    // Readers in other processes see the old file or the new one, never half
+    // of one.
+    std::string temporary = path + "." + std::to_string(getpid());
+    if (!writeWholeFile(temporary.c_str(), file.bytes)) return false;
+    if (rename(temporary.c_str(), path.c_str()) != 0) {
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+ObjFunction* loadModule(VM& vm, const std::string& path) {
+    std::unique_ptr<MappedFile> file = MappedFile::open(path.c_str());
+    if (!file) return nullptr;
+    std::string_view bytes = file->contents();
+    constexpr size_t HEADER = sizeof MAGIC + sizeof FORMAT_VERSION;
+    if (bytes.size() < HEADER + sizeof(uint64_t) || memcmp(bytes.data(), MAGIC, sizeof MAGIC) != 0) return nullptr;
+    uint32_t version;
+    memcpy(&version, bytes.data() + sizeof MAGIC, sizeof version);
+    if (version != FORMAT_VERSION) return nullptr;
+    std::string_view payload = bytes.substr(HEADER, bytes.size() - HEADER - sizeof(uint64_t));
+    uint64_t checksum;
+    memcpy(&checksum, bytes.data() + bytes.size() - sizeof checksum, sizeof checksum);
+    if (checksum != fnv1a(FNV_OFFSET, payload)) return nullptr;
+
+    // Functions are allocated up front so constants can refer to any of
+    // them. Nothing collects before the module is stored, and on failure
+    // they are ordinary garbage.
+    Reader in(payload);
+    std::vector<ObjFunction*> functions(in.getCount());
+    if (functions.empty()) return nullptr;
+    for (ObjFunction*& function : functions) {
+        function = vm.newFunction();
+    }
+    for (ObjFunction* function : functions) {
+        if (!readFunction(in, vm, functions, function)) return nullptr;
+    }
+    return functions[0];
+}
+
+static bool isFile(const std::string& path) {
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode);
+}
+
+// The file `import "name";` refers to: name itself when it is absolute,
+// otherwise the first directory on the module path that has it. A name
+// without an extension gets ".lox".
+static std::string resolveModule(const std::vector<std::string>& modulePath, std::string name) {
+    size_t slash = name.rfind('/');
+    if (name.find('.', slash == std::string::npos ? 0 : slash + 1) == std::string::npos) name += ".lox";
+    if (name[0] == '/' || modulePath.empty()) return isFile(name) ? name : "";
+    for (const std::string& dir : modulePath) {
+        std::string candidate = dir.empty() ? name : dir + "/" + name;
+        if (isFile(candidate)) return candidate;
+    }
+    return "";
+}
+
+bool VM::importModule(ObjString* name, ObjFunction*& module) {
+    module = nullptr;
+    // Workers share a frozen heap and cannot define globals for the caller.
+    if (parallelWorker) {
+        runtimeError("Cannot import from a parallel worker.");
+        return false;
+    }
+    std::string path = name->length > 0 ? resolveModule(modulePath, name->c_str()) : "";
+    char* real = path.empty() ? nullptr : realpath(path.c_str(), nullptr);
+    if (real == nullptr) {
+        runtimeError("Could not find module '%s'.", name->c_str());
+        return false;
+    }
+    std::string key(real);
+    free(real);
+    if (modules.count(key)) return true;
+
+    std::unique_ptr<MappedFile> file = MappedFile::open(key.c_str());
+    if (!file) {
+        runtimeError("Could not read module '%s'.", name->c_str());
+        return false;
+    }
+    std::string source(file->contents());
+    std::string cached = moduleCache.empty() ? "" : cachedModulePath(*this, moduleCache, source);
+    ObjFunction* function = cached.empty() ? nullptr : loadModule(*this, cached);
+    if (function == nullptr) {
+        // Compile errors go straight to stderr; keep earlier output ahead of them.
+        out.flush();
+        function = compile(source);
+        if (function == nullptr) {
+            runtimeError("Could not compile module '%s'.", name->c_str());
+            return false;
+        }
+        if (!cached.empty()) saveModule(function, cached);
+    }
+    // Recorded before it runs, so an import cycle finds it and goes on.
+    function->name = name;
+    modules.emplace(std::move(key), function);
+    module = function;
+    return true;
+}
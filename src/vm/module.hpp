@@ -0,0 +1,22 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+class VM;
+class ObjFunction;
+
+// Compiled modules kept on disk between runs. A file holds a module's
+// function and every function nested in it, as VM::compile left them, and
+// is named after a hash of the source and of the settings that shape the
+// bytecode, so an edited module or a run with --no-inline misses instead of
+// loading stale code. Files are only meant for the build that wrote them.
+
+// Where in dir the module compiled from source is kept.
+std::string cachedModulePath(const VM& vm, const std::string& dir, std::string_view source);
+
+// False if a body is still deferred, a constant has no encoding or the file
+// cannot be written.
+bool saveModule(const ObjFunction* module, const std::string& path);
+
+// nullptr if the file is missing, damaged or from another format version.
+ObjFunction* loadModule(VM& vm, const std::string& path);
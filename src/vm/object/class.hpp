@@ -6,7 +6,7 @@
 class ObjClass : public Obj {
 public:
     ObjString* name;
-    std::unordered_map<std::string, Value> methods;
+    StringTable<Value> methods;
     ObjClass* superclass = nullptr;
 
     ObjClass(ObjString* n) : Obj(Type::CLASS), name(n) {}
@@ -1,15 +1,28 @@
 #pragma once
 #include "object.hpp"
 #include "function.hpp"
+#include <memory>
 
-class ObjUpvalue;
-
+// The upvalues live in the same allocation, right after the object; only
+// VM::newClosure creates closures. A variable that is never assigned after
+// its declaration is captured flat, as a copy of its value. Any other is
+// captured as an ObjUpvalue, shared with its frame while that runs and with
+// every closure over it.
 class ObjClosure : public Obj {
 public:
     ObjFunction* function;
-    std::vector<ObjUpvalue*> upvalues;
+    int upvalueCount;
+
+    Value* upvalues() { return reinterpret_cast<Value*>(this + 1); }
+    const Value* upvalues() const { return reinterpret_cast<const Value*>(this + 1); }
+
+    static size_t allocationSize(int upvalueCount) {
+        return sizeof(ObjClosure) + sizeof(Value) * static_cast<size_t>(upvalueCount);
+    }
 
-    ObjClosure(ObjFunction* f) : Obj(Type::CLOSURE), function(f) {
-        upvalues.resize(f->upvalueCount);
+private:
+    friend class VM;
+    explicit ObjClosure(ObjFunction* f) : Obj(Type::CLOSURE), function(f), upvalueCount(f->upvalueCount) {
+        std::uninitialized_fill_n(upvalues(), upvalueCount, Value(nullptr));
     }
 };
@@ -0,0 +1,61 @@
+#pragma once
+#include "object.hpp"
+#include "../value.hpp"
+#include <memory>
+
+class CallFrame {
+public:
+    ObjClosure* closure = nullptr;
+    const uint8_t* ip = nullptr;
+    Value* slots = nullptr;
+};
+
+// A coroutine with its own value and call stacks. The VM runs one fiber at
+// a time and caches its stack pointers; switching saves them into the
+// outgoing fiber and loads the incoming one's.
+class ObjFiber : public Obj {
+public:
+    // WAITING fibers are parked on the event loop until their I/O is ready.
+    enum class State { NEW, SUSPENDED, RUNNING, WAITING, DONE };
+
+    // Both stacks start this small and grow on demand; see VM::ensureStack.
+    static constexpr int INITIAL_FRAMES = 8;
+    static constexpr int INITIAL_SLOTS = 512;
+
+    std::unique_ptr<Value[]> stack;
+    std::unique_ptr<CallFrame[]> frames;
+    int frameCapacity = INITIAL_FRAMES;
+    int stackCapacity;
+
+    Value* stackTop;
+    int frameCount = 0;
+    ObjUpvalue* openUpvalues = nullptr;
+    // The open upvalue over each stack slot, if any, so capturing a slot
+    // again does not walk openUpvalues. Allocated on the first capture.
+    std::unique_ptr<ObjUpvalue*[]> openSlots;
+
+    // Called on the first resume.
+    ObjClosure* entry;
+    // The fiber that resumed this one, while it runs.
+    ObjFiber* caller = nullptr;
+    State state = State::NEW;
+    // Spawned tasks are scheduled by the event loop and may park on I/O.
+    bool task = false;
+    // Host calls running on top of this fiber's C stack. While there are
+    // any, it cannot yield or park.
+    int hostCalls = 0;
+
+    // slots covers at least the entry function's frame.
+    ObjFiber(ObjClosure* entry, int slots)
+        : Obj(Type::FIBER),
+          stack(new Value[slots]),
+          frames(new CallFrame[INITIAL_FRAMES]),
+          stackCapacity(slots),
+          stackTop(stack.get()),
+          entry(entry) {}
+
+    size_t stackBytes() const {
+        size_t slotBytes = sizeof(Value) + (openSlots ? sizeof(ObjUpvalue*) : 0);
+        return slotBytes * stackCapacity + sizeof(CallFrame) * frameCapacity;
+    }
+};
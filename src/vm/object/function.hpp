@@ -1,13 +1,36 @@
 #pragma once
 #include "object.hpp"
 #include "../chunk.hpp"
+#include <memory>
+#include <string>
+
+// The source of a function whose compilation waits for its first call; see
+// VM::lazyCompile.
+struct DeferredBody {
+    std::shared_ptr<const std::string> source;
+    // From the '(' that starts the parameter list to just past the body's
+    // closing brace.
+    int offset;
+    int line;
+    int lineStart;
+    int end;
+    // The parser's FunctionType.
+    uint8_t type;
+    // Whether it is a method of a subclass, which captures `super` as its
+    // only upvalue whether or not the body uses it.
+    bool capturesSuper;
+};
 
 class ObjFunction : public Obj {
 public:
     int arity = 0;
     int upvalueCount = 0;
+    // Stack slots a call needs, from Chunk::maxStackDepth.
+    int maxSlots = 1;
     Chunk chunk;
     ObjString* name = nullptr;
+    // Set until the body is compiled, and the chunk is empty until then.
+    std::unique_ptr<DeferredBody> deferred;
 
     ObjFunction() : Obj(Type::FUNCTION) {}
 };
@@ -6,7 +6,7 @@
 class ObjInstance : public Obj {
 public:
     ObjClass* klass;
-    std::unordered_map<std::string, Value> fields;
+    StringTable<Value> fields;
 
     ObjInstance(ObjClass* k) : Obj(Type::INSTANCE), klass(k) {}
 };
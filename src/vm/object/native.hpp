@@ -9,6 +9,8 @@ class ObjNative : public Obj {
 public:
     NativeFn function;
     int arity;
+    // May run on a parallel worker VM.
+    bool threadSafe = false;
 
     ObjNative(NativeFn function, int arity)
         : Obj(Type::NATIVE), function(function), arity(arity) {}
@@ -1,5 +1,6 @@
 #pragma once
 #include "common/common.hpp"
+#include <cassert>
 
 class VM;
 class ObjString;
@@ -11,28 +12,67 @@ class ObjInstance;
 class ObjBoundMethod;
 class ObjNative;
 class ObjList;
+class ObjFiber;
 
+// Objects are plain structs tagged with their type: there is no vtable, and
+// freeObject switches on type to delete through the right class. The whole
+// header is one word: the heap list's next pointer in the low 48 bits (all
+// user-space addresses on x86-64 and AArch64 fit), the type above it and
+// the mark bit on top.
 class Obj {
 public:
-    enum class Type { STRING, FUNCTION, CLOSURE, UPVALUE, CLASS, INSTANCE, BOUND_METHOD, NATIVE, LIST };
-    Type type;
-    bool marked = false;
-    Obj* next = nullptr;
+    enum class Type : uint8_t { STRING, FUNCTION, CLOSURE, UPVALUE, CLASS, INSTANCE, BOUND_METHOD, NATIVE, LIST, FIBER };
 
-    explicit Obj(Type t) : type(t) {}
-    virtual ~Obj() = default;
+    explicit Obj(Type t) : header(static_cast<uint64_t>(t) << TYPE_SHIFT) {}
+
+    Type type() const { return static_cast<Type>((header >> TYPE_SHIFT) & 0xff); }
+
+    bool marked() const { return (header & MARK_BIT) != 0; }
+    void setMarked(bool marked) { header = marked ? header | MARK_BIT : header & ~MARK_BIT; }
+
+    Obj* next() const { return reinterpret_cast<Obj*>(static_cast<uintptr_t>(header & POINTER_MASK)); }
+    void setNext(Obj* next) {
+        uint64_t bits = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(next));
+        assert((bits & ~POINTER_MASK) == 0);
+        header = (header & ~POINTER_MASK) | bits;
+    }
+
+private:
+    static constexpr int TYPE_SHIFT = 48;
+    static constexpr uint64_t POINTER_MASK = (uint64_t(1) << TYPE_SHIFT) - 1;
+    static constexpr uint64_t MARK_BIT = uint64_t(1) << 63;
+
+    uint64_t header;
 };
 
 #define AS_OBJ(value)       (std::get<Obj*>(value))
 #define AS_STRING(value)    (as<ObjString>(AS_OBJ(value)))
-#define AS_CSTRING(value)   (AS_STRING(value)->str.c_str())
+#define AS_CSTRING(value)   (AS_STRING(value)->c_str())
 #define AS_FUNCTION(value)  (as<ObjFunction>(AS_OBJ(value)))
 #define AS_CLOSURE(value)   (as<ObjClosure>(AS_OBJ(value)))
+#define AS_UPVALUE(value)   (as<ObjUpvalue>(AS_OBJ(value)))
 #define AS_CLASS(value)     (as<ObjClass>(AS_OBJ(value)))
 #define AS_INSTANCE(value)  (as<ObjInstance>(AS_OBJ(value)))
 #define AS_BOUND(value)     (as<ObjBoundMethod>(AS_OBJ(value)))
 #define AS_NATIVE(value)    (as<ObjNative>(AS_OBJ(value)))
 #define AS_LIST(value)      (as<ObjList>(AS_OBJ(value)))
+#define AS_FIBER(value)     (as<ObjFiber>(AS_OBJ(value)))
+
+template<typename T> struct ObjTypeOf;
+template<> struct ObjTypeOf<ObjString> { static constexpr Obj::Type value = Obj::Type::STRING; };
+template<> struct ObjTypeOf<ObjFunction> { static constexpr Obj::Type value = Obj::Type::FUNCTION; };
+template<> struct ObjTypeOf<ObjClosure> { static constexpr Obj::Type value = Obj::Type::CLOSURE; };
+template<> struct ObjTypeOf<ObjUpvalue> { static constexpr Obj::Type value = Obj::Type::UPVALUE; };
+template<> struct ObjTypeOf<ObjClass> { static constexpr Obj::Type value = Obj::Type::CLASS; };
+template<> struct ObjTypeOf<ObjInstance> { static constexpr Obj::Type value = Obj::Type::INSTANCE; };
+template<> struct ObjTypeOf<ObjBoundMethod> { static constexpr Obj::Type value = Obj::Type::BOUND_METHOD; };
+template<> struct ObjTypeOf<ObjNative> { static constexpr Obj::Type value = Obj::Type::NATIVE; };
+template<> struct ObjTypeOf<ObjList> { static constexpr Obj::Type value = Obj::Type::LIST; };
+template<> struct ObjTypeOf<ObjFiber> { static constexpr Obj::Type value = Obj::Type::FIBER; };
 
+// Callers check the tag first (isObjType); debug builds assert it.
 template<typename T>
-inline T* as(Obj* obj) { return dynamic_cast<T*>(obj); }
+inline T* as(Obj* obj) {
+    assert(obj->type() == ObjTypeOf<T>::value);
+    return static_cast<T*>(obj);
+}
@@ -1,21 +1,20 @@
 #include "string.hpp"
 #include "../vm.hpp"
 
-ObjString::ObjString(std::string s) : Obj(Type::STRING), str(std::move(s)) {
+void ObjString::computeHash() {
     hash = 2166136261u;
-    for (char c : str) {
+    for (char c : view()) {
         hash ^= static_cast<uint8_t>(c);
         hash *= 16777619;
     }
 }
 
 ObjString* ObjString::copyString(VM& vm, const char* chars, int length) {
-    std::string s(chars, length);
-    return vm.allocateString(std::move(s));
+    return vm.allocateString(std::string_view(chars, length));
 }
 
 ObjString* ObjString::takeString(VM& vm, char* chars, int length) {
-    std::string s(chars, length);
+    ObjString* string = vm.allocateString(std::string_view(chars, length));
     delete[] chars;
-    return vm.allocateString(std::move(s));
+    return string;
 }
@@ -1,14 +1,47 @@
 #pragma once
 #include "object.hpp"
+#include <cstring>
+#include <string_view>
+#include <unordered_map>
 
+// The characters live in the same allocation, right after the object, and
+// are followed by a NUL. Only VM::allocateString and VM::concatenate create
+// strings.
 class ObjString : public Obj {
 public:
-    std::string str;
-    uint32_t hash;
+    uint32_t length;
+    uint32_t hash = 0;
 
-    ObjString(std::string s);
-    const char* c_str() const { return str.c_str(); }
+    char* chars() { return reinterpret_cast<char*>(this + 1); }
+    const char* chars() const { return reinterpret_cast<const char*>(this + 1); }
+    const char* c_str() const { return chars(); }
+    std::string_view view() const { return std::string_view(chars(), length); }
+
+    static size_t allocationSize(size_t length) { return sizeof(ObjString) + length + 1; }
+    // Called once the characters are in place.
+    void computeHash();
 
     static ObjString* copyString(VM& vm, const char* chars, int length);
     static ObjString* takeString(VM& vm, char* chars, int length);
+
+private:
+    friend class VM;
+    explicit ObjString(uint32_t length) : Obj(Type::STRING), length(length) {}
+};
+
+// Method and field tables key on the string object itself: hashing reads the
+// cached hash, and a lookup with the same name constant that stored the
+// entry matches without comparing characters.
+struct ObjStringHash {
+    size_t operator()(const ObjString* string) const { return string->hash; }
 };
+
+struct ObjStringEqual {
+    bool operator()(const ObjString* a, const ObjString* b) const {
+        return a == b || (a->hash == b->hash && a->length == b->length &&
+                          memcmp(a->chars(), b->chars(), a->length) == 0);
+    }
+};
+
+template <typename T>
+using StringTable = std::unordered_map<ObjString*, T, ObjStringHash, ObjStringEqual>;
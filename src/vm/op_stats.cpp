@@ -0,0 +1,95 @@
+#include "op_stats.hpp"
+#include "object/string.hpp"
+#include "object/function.hpp"
+#include <algorithm>
+#include <ctime>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+uint64_t OpStats::now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+void OpStats::record(ObjFunction* function, uint8_t opcode) {
+    uint64_t time = now();
+    if (lastOp >= 0) {
+        uint64_t elapsed = time - lastTime;
+        ops[lastOp].ticks += elapsed;
+        lastFunctionCounter->ticks += elapsed;
+        pairs[lastOp][opcode]++;
+    }
+    if (function != lastFunction) {
+        lastFunction = function;
+        lastFunctionCounter = &functions[function];
+    }
+    ops[opcode].count++;
+    lastFunctionCounter->count++;
+    lastOp = opcode;
+    lastTime = time;
+}
+
+void OpStats::print(FILE* out) const {
+    uint64_t totalCount = 0;
+    uint64_t totalTicks = 0;
+    for (const Counter& counter : ops) {
+        totalCount += counter.count;
+        totalTicks += counter.ticks;
+    }
+    if (totalCount == 0) return;
+
+    std::vector<int> order;
+    for (int i = 0; i < OPCODE_COUNT; ++i) {
+        if (ops[i].count > 0) order.push_back(i);
+    }
+    std::sort(order.begin(), order.end(), [this](int a, int b) { return ops[a].count > ops[b].count; });
+
+    fprintf(out, "%-16s %14s %7s %16s %7s %10s\n", "opcode", "count", "count%", "ticks", "ticks%", "ticks/op");
+    for (int i : order) {
+        const Counter& counter = ops[i];
+        fprintf(out, "%-16s %14llu %6.2f%% %16llu %6.2f%% %10.1f\n",
+                opcodeName(static_cast<OpCode>(i)),
+                static_cast<unsigned long long>(counter.count), 100.0 * counter.count / totalCount,
+                static_cast<unsigned long long>(counter.ticks),
+                totalTicks ? 100.0 * counter.ticks / totalTicks : 0.0,
+                static_cast<double>(counter.ticks) / counter.count);
+    }
+
+    struct Pair { int first, second; uint64_t count; };
+    std::vector<Pair> topPairs;
+    for (int a = 0; a < OPCODE_COUNT; ++a) {
+        for (int b = 0; b < OPCODE_COUNT; ++b) {
+            if (pairs[a][b] > 0) topPairs.push_back({a, b, pairs[a][b]});
+        }
+    }
+    std::sort(topPairs.begin(), topPairs.end(), [](const Pair& a, const Pair& b) { return a.count > b.count; });
+    if (topPairs.size() > 20) topPairs.resize(20);
+
+    fprintf(out, "\n%-34s %14s %7s\n", "opcode pair", "count", "count%");
+    for (const Pair& pair : topPairs) {
+        std::string name = std::string(opcodeName(static_cast<OpCode>(pair.first))) + " -> " +
+                           opcodeName(static_cast<OpCode>(pair.second));
+        fprintf(out, "%-34s %14llu %6.2f%%\n", name.c_str(),
+                static_cast<unsigned long long>(pair.count), 100.0 * pair.count / totalCount);
+    }
+
+    std::vector<std::pair<ObjFunction*, Counter>> byFunction(functions.begin(), functions.end());
+    std::sort(byFunction.begin(), byFunction.end(),
+              [](const auto& a, const auto& b) { return a.second.ticks > b.second.ticks; });
+
+    fprintf(out, "\n%-34s %14s %16s %7s\n", "function", "count", "ticks", "ticks%");
+    for (const auto& entry : byFunction) {
+        ObjFunction* function = entry.first;
+        fprintf(out, "%-34s %14llu %16llu %6.2f%%\n",
+                function->name ? function->name->c_str() : "script",
+                static_cast<unsigned long long>(entry.second.count),
+                static_cast<unsigned long long>(entry.second.ticks),
+                totalTicks ? 100.0 * entry.second.ticks / totalTicks : 0.0);
+    }
+}
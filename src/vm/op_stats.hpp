@@ -0,0 +1,33 @@
+#pragma once
+#include "chunk.hpp"
+#include <cstdio>
+
+class ObjFunction;
+
+// Runtime instruction counters for VM::run. When enabled, every dispatch
+// charges the ticks since the previous dispatch to the previous opcode and
+// to the function it ran in, and counts the (previous, current) pair.
+class OpStats {
+public:
+    struct Counter {
+        uint64_t count = 0;
+        uint64_t ticks = 0;
+    };
+
+    void record(ObjFunction* function, uint8_t opcode);
+    void print(FILE* out) const;
+
+    const std::unordered_map<ObjFunction*, Counter>& functionCounters() const { return functions; }
+
+private:
+    static uint64_t now();
+
+    std::array<Counter, OPCODE_COUNT> ops{};
+    std::array<std::array<uint64_t, OPCODE_COUNT>, OPCODE_COUNT> pairs{};
+    std::unordered_map<ObjFunction*, Counter> functions;
+
+    ObjFunction* lastFunction = nullptr;
+    Counter* lastFunctionCounter = nullptr;
+    int lastOp = -1;
+    uint64_t lastTime = 0;
+};
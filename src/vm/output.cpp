@@ -0,0 +1,58 @@
+#include "output.hpp"
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+OutputBuffer::OutputBuffer(int fd)
+    : fd(fd), policy(isatty(fd) ? FlushPolicy::LINE : FlushPolicy::FULL) {
+    buffer.reserve(capacity);
+}
+
+OutputBuffer::~OutputBuffer() {
+    flush();
+}
+
+void OutputBuffer::setCapacity(size_t capacity) {
+    this->capacity = capacity;
+    if (buffer.size() >= capacity) flush();
+    buffer.reserve(capacity);
+}
+
+void OutputBuffer::write(const char* data, size_t length) {
+    buffer.append(data, length);
+    written(memchr(data, '\n', length) != nullptr);
+}
+
+void OutputBuffer::writeValue(const Value& value) {
+    appendValue(buffer, value);
+    written(false);
+}
+
+void OutputBuffer::writeLine(const Value& value) {
+    appendValue(buffer, value);
+    buffer += '\n';
+    written(true);
+}
+
+void OutputBuffer::written(bool newline) {
+    if (buffer.size() >= capacity || (newline && policy == FlushPolicy::LINE)) {
+        flush();
+    }
+}
+
+bool OutputBuffer::flush() {
+    const char* data = buffer.data();
+    size_t remaining = buffer.size();
+    while (remaining > 0) {
+        ssize_t n = ::write(fd, data, remaining);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            buffer.clear();
+            return false;
+        }
+        data += n;
+        remaining -= static_cast<size_t>(n);
+    }
+    buffer.clear();
+    return true;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include "common/common.hpp"
+#include "value.hpp"
+#include <string_view>
+
+class OutputBuffer {
+public:
+    enum class FlushPolicy { LINE, FULL };
+
+    static constexpr size_t DEFAULT_CAPACITY = 64 * 1024;
+
+    explicit OutputBuffer(int fd = 1);
+    ~OutputBuffer();
+
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+    void setPolicy(FlushPolicy policy) { this->policy = policy; }
+    void setCapacity(size_t capacity);
+
+    void write(const char* data, size_t length);
+    void write(std::string_view text) { write(text.data(), text.size()); }
+    void writeValue(const Value& value);
+    void writeLine(const Value& value);
+    bool flush();
+
+private:
+    void written(bool newline);
+
+    int fd;
+    FlushPolicy policy;
+    size_t capacity = DEFAULT_CAPACITY;
+    std::string buffer;
+};
@@ -0,0 +1,241 @@
+#include "parallel.hpp"
+#include "vm.hpp"
+#include "object/function.hpp"
+#include "object/closure.hpp"
+#include "object/string.hpp"
+#include <atomic>
+
+WorkStealingPool::WorkStealingPool(size_t threads) {
+    threads = std::max<size_t>(threads, 1);
+    for (size_t i = 0; i < threads; ++i) {
+        queues.push_back(std::make_unique<Queue>());
+    }
+    // Worker 0 is whichever thread calls run().
+    for (size_t i = 1; i < threads; ++i) {
+        this->threads.emplace_back(&WorkStealingPool::loop, this, i);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& thread : threads) thread.join();
+}
+
+void WorkStealingPool::run(size_t tasks, const Task& task) {
+    size_t workers = queues.size();
+    for (size_t w = 0; w < workers; ++w) {
+        std::lock_guard<std::mutex> lock(queues[w]->mutex);
+        for (size_t t = tasks * w / workers; t < tasks * (w + 1) / workers; ++t) {
+            queues[w]->tasks.push_back(t);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        body = &task;
+        active = threads.size();
+        generation++;
+    }
+    wake.notify_all();
+
+    drain(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [this] { return active == 0; });
+    body = nullptr;
+}
+
+void WorkStealingPool::loop(size_t worker) {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        wake.wait(lock, [&] { return stopping || generation != seen; });
+        if (stopping) return;
+        seen = generation;
+        lock.unlock();
+        drain(worker);
+        lock.lock();
+        if (--active == 0) finished.notify_one();
+    }
+}
+
+void WorkStealingPool::drain(size_t worker) {
+    size_t task;
+    while (take(worker, task)) {
+        (*body)(worker, task);
+    }
+}
+
+bool WorkStealingPool::take(size_t worker, size_t& task) {
+    {
+        Queue& own = *queues[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = own.tasks.front();
+            own.tasks.pop_front();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues.size(); ++i) {
+        Queue& victim = *queues[(worker + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+ParallelLists::ParallelLists(size_t threads) : pool(threads) {
+    for (size_t i = 0; i < pool.workerCount(); ++i) {
+        workers.push_back(std::make_unique<VM>());
+        workers.back()->parallelWorker = true;
+    }
+}
+
+ParallelLists::~ParallelLists() = default;
+
+// shared says which of function's upvalues lead out of the closure given to
+// the native. A closure it creates may assign the variables of the call that
+// created it, which belong to that call alone.
+static bool writesSharedState(const ObjFunction* function, const std::vector<bool>& shared) {
+    const Chunk& chunk = function->chunk;
+    for (size_t offset = 0; offset < chunk.code.size(); offset += chunk.instructionLength(offset)) {
+        uint32_t operand;
+        size_t start = chunk.readWide(offset, operand);
+        switch (static_cast<OpCode>(chunk.code[start])) {
+            case OpCode::PRINT:
+            case OpCode::SET_GLOBAL:
+            case OpCode::IMPORT:
+                return true;
+            case OpCode::SET_UPVALUE:
+                if (shared[operand]) return true;
+                break;
+            case OpCode::CLOSURE: {
+                const ObjFunction* nested = AS_FUNCTION(chunk.constants[operand]);
+                std::vector<bool> reaches(nested->upvalueCount);
+                for (int i = 0; i < nested->upvalueCount; ++i) {
+                    const uint8_t* capture = &chunk.code[start + 2 + 2 * i];
+                    reaches[i] = static_cast<Capture>(capture[0]) == Capture::UPVALUE && shared[capture[1]];
+                }
+                if (writesSharedState(nested, reaches)) return true;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    return false;
+}
+
+bool ParallelLists::eligible(VM& vm, Value fn, size_t length) {
+    if (length < MIN_LENGTH || !isObjType(fn, Obj::Type::CLOSURE) || !vm.compileDeferred()) return false;
+    const ObjFunction* function = AS_CLOSURE(fn)->function;
+    return !writesSharedState(function, std::vector<bool>(function->upvalueCount, true));
+}
+
+static void setMarks(VM& vm, bool marked) {
+    for (Obj* object = vm.objects; object != nullptr; object = object->next()) {
+        object->setMarked(marked);
+    }
+}
+
+// Moves everything the worker allocated into the caller's heap, except the
+// worker's root fiber and init string, which it keeps using.
+static void adopt(VM& vm, VM& worker) {
+    worker.pinned.clear();
+    worker.globals.clear();
+    Obj* root = reinterpret_cast<Obj*>(worker.rootFiber);
+    Obj* init = reinterpret_cast<Obj*>(worker.initString);
+    Obj* object = worker.objects;
+    worker.objects = nullptr;
+    while (object != nullptr) {
+        Obj* next = object->next();
+        Obj*& list = object == root || object == init ? worker.objects : vm.objects;
+        object->setNext(list);
+        list = object;
+        object = next;
+    }
+    size_t rootBytes = sizeof(ObjFiber) + worker.rootFiber->stackBytes() +
+                       ObjString::allocationSize(worker.initString->length);
+    vm.bytesAllocated += worker.bytesAllocated - std::min(rootBytes, worker.bytesAllocated);
+    worker.bytesAllocated = rootBytes;
+    worker.nextGC = VM::MIN_HEAP;
+}
+
+bool ParallelLists::forEachChunk(VM& vm, size_t length, const Body& body) {
+    size_t size = chunkSize(length);
+    size_t chunks = (length + size - 1) / size;
+
+    setMarks(vm, true);
+    for (auto& worker : workers) {
+        worker->globals = vm.globals;
+    }
+
+    std::atomic<bool> failed{false};
+    pool.run(chunks, [&](size_t w, size_t chunk) {
+        if (failed.load(std::memory_order_relaxed)) return;
+        size_t begin = chunk * size;
+        size_t end = std::min(begin + size, length);
+        if (!body(*workers[w], begin, end, chunk)) failed = true;
+    });
+
+    for (auto& worker : workers) {
+        adopt(vm, *worker);
+    }
+    setMarks(vm, false);
+    return !failed;
+}
+
+static bool callWorker(VM& worker, Value fn, Value a, Value* b, Value& result) {
+    if (!worker.ensureStack(3)) return false;
+    worker.push(fn);
+    worker.push(a);
+    if (b) worker.push(*b);
+    if (!worker.callFromHost(b ? 2 : 1)) return false;
+    result = worker.pop();
+    return true;
+}
+
+bool ParallelLists::map(VM& vm, const std::vector<Value>& items, Value fn, std::vector<Value>& results) {
+    results.assign(items.size(), Value(nullptr));
+    return forEachChunk(vm, items.size(), [&](VM& worker, size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            if (!callWorker(worker, fn, items[i], nullptr, results[i])) return false;
+            worker.pinned.push_back(results[i]);
+        }
+        return true;
+    });
+}
+
+bool ParallelLists::filter(VM& vm, const std::vector<Value>& items, Value fn, std::vector<char>& keep) {
+    keep.assign(items.size(), 0);
+    return forEachChunk(vm, items.size(), [&](VM& worker, size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            Value result;
+            if (!callWorker(worker, fn, items[i], nullptr, result)) return false;
+            keep[i] = !isFalsey(result);
+        }
+        return true;
+    });
+}
+
+bool ParallelLists::reduce(VM& vm, const std::vector<Value>& items, Value fn, std::vector<Value>& partials) {
+    size_t size = chunkSize(items.size());
+    partials.assign((items.size() + size - 1) / size, Value(nullptr));
+    return forEachChunk(vm, items.size(), [&](VM& worker, size_t begin, size_t end, size_t chunk) {
+        Value acc = items[begin];
+        for (size_t i = begin + 1; i < end; ++i) {
+            Value item = items[i];
+            if (!callWorker(worker, fn, acc, &item, acc)) return false;
+        }
+        partials[chunk] = acc;
+        worker.pinned.push_back(acc);
+        return true;
+    });
+}
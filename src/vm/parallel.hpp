@@ -0,0 +1,83 @@
+#pragma once
+#include "common/common.hpp"
+#include "value.hpp"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+class VM;
+
+// Fork-join pool: run() splits tasks into one contiguous block per worker,
+// the calling thread included. A worker takes from the front of its own
+// block and, when it runs dry, steals from the back of another's.
+class WorkStealingPool {
+public:
+    using Task = std::function<void(size_t worker, size_t task)>;
+
+    explicit WorkStealingPool(size_t threads);
+    ~WorkStealingPool();
+
+    size_t workerCount() const { return queues.size(); }
+    void run(size_t tasks, const Task& body);
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    void loop(size_t worker);
+    void drain(size_t worker);
+    bool take(size_t worker, size_t& task);
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+    const Task* body = nullptr;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    uint64_t generation = 0;
+    size_t active = 0;
+    bool stopping = false;
+};
+
+// Runs a closure over list elements on worker VMs. For the duration of an
+// operation every object in the caller's heap is marked, which freezes it:
+// worker collectors stop at those objects, and the VM refuses writes to
+// marked objects, prints, global assignment and natives that are not
+// thread-safe while it runs as a worker. Any refusal or error fails the
+// whole operation. The caller then reruns it sequentially, so the result
+// and any error are the same as for a plain loop. Objects the workers
+// allocated are spliced into the caller's heap afterwards.
+class ParallelLists {
+public:
+    static constexpr size_t MIN_LENGTH = 64;
+    static constexpr size_t MAX_CHUNKS = 256;
+
+    explicit ParallelLists(size_t threads = std::thread::hardware_concurrency());
+    ~ParallelLists();
+
+    // Whether fn is worth trying in parallel on a list this long. Closures
+    // that print or assign globals or captured variables never are. Compiles
+    // any deferred functions first, since workers cannot.
+    static bool eligible(VM& vm, Value fn, size_t length);
+
+    // Chunk boundaries depend only on the list length, so reductions give
+    // the same result however the chunks are scheduled.
+    static size_t chunkSize(size_t length) { return std::max<size_t>(1, (length + MAX_CHUNKS - 1) / MAX_CHUNKS); }
+
+    bool map(VM& vm, const std::vector<Value>& items, Value fn, std::vector<Value>& results);
+    bool filter(VM& vm, const std::vector<Value>& items, Value fn, std::vector<char>& keep);
+    // Folds each chunk from its first element and stores one value per chunk.
+    bool reduce(VM& vm, const std::vector<Value>& items, Value fn, std::vector<Value>& partials);
+
+private:
+    using Body = std::function<bool(VM& worker, size_t begin, size_t end, size_t chunk)>;
+
+    bool forEachChunk(VM& vm, size_t length, const Body& body);
+
+    WorkStealingPool pool;
+    std::vector<std::unique_ptr<VM>> workers;
+};
@@ -0,0 +1,80 @@
+#include "profiler.hpp"
+#include "vm.hpp"
+#include "object/string.hpp"
+#include "object/function.hpp"
+#include "object/closure.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <sys/time.h>
+
+volatile std::sig_atomic_t Profiler::pending = 0;
+
+static void handleProfileSignal(int) {
+    Profiler::pending = 1;
+}
+
+Profiler::~Profiler() {
+    stop();
+}
+
+bool Profiler::start(int hz) {
+    struct sigaction action = {};
+    action.sa_handler = handleProfileSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, nullptr) != 0) return false;
+
+    struct itimerval timer = {};
+    timer.it_interval.tv_usec = 1000000 / hz;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) return false;
+    running = true;
+    return true;
+}
+
+void Profiler::stop() {
+    if (!running) return;
+    struct itimerval timer = {};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    signal(SIGPROF, SIG_IGN);
+    running = false;
+}
+
+void Profiler::sample(const VM& vm) {
+    scratch.clear();
+    for (int i = 0; i < vm.frameCount; ++i) {
+        const CallFrame& frame = vm.frames[i];
+        ObjFunction* function = frame.closure->function;
+        size_t offset = frame.ip - function->chunk.code.data();
+        if (i < vm.frameCount - 1 && offset > 0) offset--;
+
+        const InlinedCode* inlined = function->chunk.findInlined(offset);
+        if (i > 0) scratch += ';';
+        scratch += function->name ? function->name->view() : std::string_view("script");
+        scratch += ':';
+        scratch += std::to_string(function->chunk.getLine(inlined ? inlined->start - 1 : offset));
+        if (inlined) {
+            scratch += ';';
+            scratch += inlined->function->name->view();
+            scratch += ':';
+            scratch += std::to_string(function->chunk.getLine(offset));
+        }
+    }
+    stacks[scratch]++;
+    samples++;
+}
+
+bool Profiler::write(const std::string& path) const {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) return false;
+
+    std::vector<const std::pair<const std::string, uint64_t>*> sorted;
+    sorted.reserve(stacks.size());
+    for (auto& entry : stacks) sorted.push_back(&entry);
+    std::sort(sorted.begin(), sorted.end(), [](auto* a, auto* b) { return a->first < b->first; });
+
+    for (auto* entry : sorted) {
+        fprintf(file, "%s %llu\n", entry->first.c_str(), static_cast<unsigned long long>(entry->second));
+    }
+    return fclose(file) == 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include "common/common.hpp"
+#include <csignal>
+
+class VM;
+
+// Samples the VM call stack on a SIGPROF timer. The signal handler only
+// raises a flag; VM::run checks it between instructions and calls sample(),
+// so the interpreter state is never read from inside the handler. The flag
+// and the timer are process-wide, so with several isolates only attach a
+// profiler to one of them.
+class Profiler {
+public:
+    static constexpr int DEFAULT_HZ = 997;
+
+    static volatile std::sig_atomic_t pending;
+
+    ~Profiler();
+
+    bool start(int hz = DEFAULT_HZ);
+    void stop();
+    void sample(const VM& vm);
+    bool write(const std::string& path) const;
+
+    uint64_t sampleCount() const { return samples; }
+
+private:
+    std::unordered_map<std::string, uint64_t> stacks;
+    std::string scratch;
+    uint64_t samples = 0;
+    bool running = false;
+};
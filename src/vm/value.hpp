@@ -2,7 +2,24 @@
 #include "common/common.hpp"
 #include "object/object.hpp"
 
-using Value = std::variant<double, bool, std::nullptr_t, Obj*>;
+// Numbers are doubles, except that integral results which fit in 32 bits are
+// kept as int32_t so counters and bitwise code skip float conversions. Scripts
+// cannot observe the difference: both print, compare and hash as numbers.
+using Value = std::variant<double, bool, std::nullptr_t, Obj*, int32_t>;
+
+inline bool isNumber(const Value& v) {
+    return std::holds_alternative<int32_t>(v) || std::holds_alternative<double>(v);
+}
+
+inline double asNumber(const Value& v) {
+    if (std::holds_alternative<int32_t>(v)) return std::get<int32_t>(v);
+    return std::get<double>(v);
+}
+
+inline int32_t toInt(const Value& v) {
+    if (std::holds_alternative<int32_t>(v)) return std::get<int32_t>(v);
+    return static_cast<int32_t>(std::get<double>(v));
+}
 
 inline bool isFalsey(const Value& v) {
     return std::holds_alternative<std::nullptr_t>(v) ||
@@ -10,11 +27,18 @@ inline bool isFalsey(const Value& v) {
 }
 
 inline bool valuesEqual(const Value& a, const Value& b) {
+    if (a.index() != b.index() && isNumber(a) && isNumber(b)) {
+        return asNumber(a) == asNumber(b);
+    }
     return a == b;
 }
 
 inline bool isObjType(const Value& value, Obj::Type type) {
-    return std::holds_alternative<Obj*>(value) && std::get<Obj*>(value)->type == type;
+    return std::holds_alternative<Obj*>(value) && std::get<Obj*>(value)->type() == type;
 }
 
+constexpr size_t NUMBER_BUFFER_SIZE = 32;
+
+size_t formatNumber(double value, char* buffer);
+void appendValue(std::string& out, const Value& value);
 std::string valueToString(const Value& value);
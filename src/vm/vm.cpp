@@ -9,94 +9,277 @@
 #include "object/bound_method.hpp"
 #include "object/native.hpp"
 #include "object/list.hpp"
+#include "object/fiber.hpp"
+#include "mapped_file.hpp"
+#include "profiler.hpp"
+#include "op_stats.hpp"
+#include "parallel.hpp"
+#include "event_loop.hpp"
 #include "../compiler/parser.hpp"
+#include "../compiler/inliner.hpp"
+#include "../compiler/loops.hpp"
 #include <cstdio>
+#include <cstring>
 #include <cstdarg>
 #include <chrono>
 #include <cmath>
+#include <charconv>
+#include <algorithm>
+#include <utility>
 
 VM::VM() {
-    defineNative("clock", 0, clockNative);
+    rootFiber = newFiber(nullptr);
+    rootFiber->state = ObjFiber::State::RUNNING;
+    loadFiber(rootFiber);
+    initString = allocateString("init");
+
+    defineNative("clock", 0, clockNative, true);
     defineNative("input", 1, inputNative);
+    defineNative("write", 1, writeNative);
+    defineNative("flush", 0, flushNative);
+    defineNative("readFile", 1, readFileNative);
+    defineNative("writeFile", 2, writeFileNative);
+    defineNative("openLines", 1, openLinesNative);
+    defineNative("fiber", 1, fiberNative);
+    defineNative("isDone", 1, isDoneNative);
+    defineNative("parallelMap", 2, parallelMapNative);
+    defineNative("parallelFilter", 2, parallelFilterNative);
+    defineNative("parallelReduce", 3, parallelReduceNative);
+    defineNative("spawn", 1, spawnNative);
+    defineNative("sleep", 1, sleepNative);
+    defineNative("runLoop", 0, runLoopNative);
+    defineNative("readFd", 2, readFdNative);
+    defineNative("writeFd", 2, writeFdNative);
+    defineNative("closeFd", 1, closeFdNative);
+    defineNative("openFd", 2, openFdNative);
+    defineNative("pipe", 0, pipeNative);
+    defineNative("socketPair", 0, socketPairNative);
+    defineNative("listenUnix", 1, listenUnixNative);
+    defineNative("connectUnix", 1, connectUnixNative);
+    defineNative("accept", 1, acceptNative);
 }
 
 VM::~VM() {
+    out.flush();
     freeObjects();
 }
 
 bool VM::interpret(const std::string& source) {
-    Parser parser(*this, source);
-    ObjFunction* function = parser.compile();
-    if (!function || parser.hadError) return false;
+    ObjFunction* function = compile(source);
+    if (!function) return false;
+    return interpret(function);
+}
 
+bool VM::interpret(ObjFunction* function) {
+    if (!ensureStack(1)) {
+        runtimeError("Stack overflow.");
+        return false;
+    }
     push(Value(function));
     ObjClosure* closure = newClosure(function);
     pop();
     push(Value(closure));
-    CallFrame* frame = &frames[frameCount++];
-    frame->closure = closure;
-    frame->ip = closure->function->chunk.code.data();
-    frame->slots = stack.data();
+    if (!callFromHost(0)) return false;
+    pop();
+    // Tasks the script spawned keep running after its last statement.
+    if (loop && loop->pending()) return loop->run(*this);
+    return true;
+}
 
-    return run();
+ObjFunction* VM::compile(const std::string& source) {
+    Parser parser(*this, source);
+    ObjFunction* function = parser.compile();
+    if (!function || parser.hadError) return nullptr;
+    if (lazyCompile) deferredPending = true;
+    if (inlining) inlineCalls(function);
+    if (loopOptimization) optimizeLoops(function);
+    return function;
+}
+
+bool VM::callFromHost(int argCount) {
+    ObjFiber* host = fiber;
+    int base = frameCount;
+    host->hostCalls++;
+    bool ok = callValue(peek(argCount), argCount) && (frameCount == base || run());
+    host->hostCalls--;
+    return ok;
+}
+
+bool VM::resumeFromHost(ObjFiber* target, Value value, Value* result) {
+    ObjFiber* host = fiber;
+    if (!ensureStack(2)) {
+        runtimeError("Stack overflow.");
+        return false;
+    }
+    push(Value(target));
+    push(value);
+    if (!resume(peek(1), peek(0))) return false;
+    host->hostCalls++;
+    bool ok = run(host);
+    host->hostCalls--;
+    if (!ok) return false;
+    Value yielded = pop();
+    if (result) *result = yielded;
+    return true;
+}
+
+bool VM::canPark() const {
+    return fiber->task && fiber->caller != nullptr && fiber->hostCalls == 0;
+}
+
+void VM::park() {
+    parkRequested = true;
+}
+
+Value VM::nativeError(std::string message) {
+    nativeFailed = true;
+    nativeErrorMessage = std::move(message);
+    return Value(nullptr);
 }
 
 void VM::runtimeError(const char* format, ...) {
-    va_list args;
-    va_start(args, format);
-    vfprintf(stderr, format, args);
-    va_end(args);
-    fputs("\n", stderr);
-
-    for (int i = frameCount - 1; i >= 0; --i) {
-        CallFrame* frame = &frames[i];
-        ObjFunction* func = frame->closure->function;
-        size_t instruction = frame->ip - func->chunk.code.data() - 1;
-        int line = func->chunk.getLine(instruction);
-        fprintf(stderr, "[line %d] in %s\n", line,
-                func->name ? func->name->str.c_str() : "script");
+    // A failed parallel worker is retried sequentially by its caller,
+    // which reports any real error itself.
+    if (!parallelWorker) {
+        out.flush();
+        va_list args;
+        va_start(args, format);
+        vfprintf(stderr, format, args);
+        va_end(args);
+        fputs("\n", stderr);
+
+        // Deep recursion would print thousands of identical lines, so only
+        // the innermost and outermost frames of each fiber are shown.
+        constexpr int TRACE_EDGE = 16;
+        fiber->frameCount = frameCount;
+        for (ObjFiber* f = fiber; f != nullptr; f = f->caller) {
+            for (int i = f->frameCount - 1; i >= 0; --i) {
+                if (i == f->frameCount - 1 - TRACE_EDGE && i >= TRACE_EDGE) {
+                    fprintf(stderr, "[... %d more frames]\n", i - TRACE_EDGE + 1);
+                    i = TRACE_EDGE - 1;
+                }
+                CallFrame* frame = &f->frames[i];
+                ObjFunction* func = frame->closure->function;
+                size_t instruction = frame->ip - func->chunk.code.data() - 1;
+                int line = func->chunk.getLine(instruction);
+                int column = func->chunk.getColumn(instruction);
+                if (const InlinedCode* inlined = func->chunk.findInlined(instruction)) {
+                    fprintf(stderr, "[line %d:%d] in %s\n", line, column, inlined->function->name->c_str());
+                    line = func->chunk.getLine(inlined->start - 1);
+                    column = func->chunk.getColumn(inlined->start - 1);
+                }
+                fprintf(stderr, "[line %d:%d] in %s\n", line, column,
+                        func->name ? func->name->c_str() : "script");
+            }
+        }
+    }
+
+    // An error unwinds every fiber on the resume chain back to the root.
+    while (fiber != rootFiber) {
+        ObjFiber* unwound = fiber;
+        switchFiber(unwound->caller);
+        finishFiber(unwound);
     }
     frameCount = 0;
-    stackTop = stack.data();
+    stackTop = stack;
+    // Closures that outlive the script keep the values their variables had.
+    closeUpvalues(stack);
+    parkRequested = false;
 }
 
-bool VM::run() {
+bool VM::run(ObjFiber* host) {
+    // A host call ends when its base frame returns. A host resume has no
+    // base frame and ends when control switches back to the host fiber.
+    const int baseFrame = frameCount - 1;
+    ObjFiber* const baseFiber = host ? nullptr : fiber;
     CallFrame* frame = &frames[frameCount - 1];
 
 #define READ_BYTE() (*frame->ip++)
 #define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() (frame->closure->function->chunk.constants[READ_BYTE()])
+// The first operand of an instruction, with the bytes of any WIDE prefixes
+// before it; reading it clears them for the next instruction.
+#define READ_INDEX() (std::exchange(extended, 0) | READ_BYTE())
+#define READ_CONSTANT() (frame->closure->function->chunk.constants[READ_INDEX()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+// Rewrites the running instruction in place. A specialized instruction
+// whose guard fails rewrites itself back and jumps to the generic code.
+// Marked functions may be running on other threads (frozen for a parallel
+// operation, or owned by a CodeCache), so they are never rewritten.
+#define QUICKEN(op) \
+    do { \
+        if (quicken && !frame->closure->function->marked()) { \
+            *const_cast<uint8_t*>(instructionStart) = static_cast<uint8_t>(OpCode::op); \
+        } \
+    } while (false)
+// Outside a collection only frozen or cached objects are marked, and a
+// parallel worker must not write to them.
+#define GUARD_SHARED(shared) \
+    do { \
+        if (shared) { \
+            runtimeError("Cannot modify shared state in a parallel operation."); \
+            return false; \
+        } \
+    } while (false)
 #define BINARY_OP(op) \
     do { \
-        if (!std::holds_alternative<double>(peek(0)) || !std::holds_alternative<double>(peek(1))) { \
+        if (!isNumber(peek(0)) || !isNumber(peek(1))) { \
             runtimeError("Operands must be numbers."); \
             return false; \
         } \
-        double b = std::get<double>(pop()); \
-        double a = std::get<double>(pop()); \
+        double b = asNumber(pop()); \
+        double a = asNumber(pop()); \
         push(Value(a op b)); \
     } while (false)
+#define INT_ARITH_OP(overflows, op) \
+    do { \
+        if (std::holds_alternative<int32_t>(peek(0)) && std::holds_alternative<int32_t>(peek(1))) { \
+            int32_t result; \
+            if (!overflows(std::get<int32_t>(peek(1)), std::get<int32_t>(peek(0)), &result)) { \
+                stackTop--; \
+                stackTop[-1] = Value(result); \
+                break; \
+            } \
+        } \
+        BINARY_OP(op); \
+    } while (false)
+#define COMPARE_OP(op) \
+    do { \
+        if (std::holds_alternative<int32_t>(peek(0)) && std::holds_alternative<int32_t>(peek(1))) { \
+            bool result = std::get<int32_t>(peek(1)) op std::get<int32_t>(peek(0)); \
+            stackTop--; \
+            stackTop[-1] = Value(result); \
+            break; \
+        } \
+        BINARY_OP(op); \
+    } while (false)
 #define BITWISE_OP(op) \
     do { \
-        if (!std::holds_alternative<double>(peek(0)) || !std::holds_alternative<double>(peek(1))) { \
+        if (!isNumber(peek(0)) || !isNumber(peek(1))) { \
             runtimeError("Operands must be numbers."); \
             return false; \
         } \
-        int b = static_cast<int>(std::get<double>(pop())); \
-        int a = static_cast<int>(std::get<double>(pop())); \
-        push(Value(static_cast<double>(a op b))); \
+        int32_t b = toInt(pop()); \
+        int32_t a = toInt(pop()); \
+        push(Value(static_cast<int32_t>(a op b))); \
     } while (false)
 
+    uint32_t extended = 0;
     for (;;) {
         if (bytesAllocated > nextGC) {
-            markRoots();
-            traceReferences();
-            sweep();
-            nextGC = bytesAllocated * 2;
+            collectGarbage();
+            if (memoryLimit != 0 && bytesAllocated > memoryLimit) {
+                runtimeError("Out of memory.");
+                return false;
+            }
+        }
+        if (Profiler::pending && profiler) {
+            Profiler::pending = 0;
+            profiler->sample(*this);
         }
 
+        const uint8_t* instructionStart = frame->ip;
         uint8_t instruction = READ_BYTE();
+        if (opStats) opStats->record(frame->closure->function, instruction);
         switch (static_cast<OpCode>(instruction)) {
             case OpCode::CONSTANT: {
                 Value constant = READ_CONSTANT();
@@ -107,39 +290,82 @@ bool VM::run() {
             case OpCode::TRUE:  push(Value(true)); break;
             case OpCode::FALSE: push(Value(false)); break;
 
-            case OpCode::ADD: {
-                if (isObjType(peek(0), Obj::Type::STRING) && isObjType(peek(1), Obj::Type::STRING)) {
+            case OpCode::ADD: add: {
+                if (std::holds_alternative<int32_t>(peek(0)) && std::holds_alternative<int32_t>(peek(1))) {
+                    INT_ARITH_OP(__builtin_add_overflow, +);
+                    QUICKEN(ADD_NUM);
+                } else if (isObjType(peek(0), Obj::Type::STRING) && isObjType(peek(1), Obj::Type::STRING)) {
                     ObjString* b = AS_STRING(pop());
                     ObjString* a = AS_STRING(pop());
-                    push(Value(allocateString(a->str + b->str)));
-                } else if (std::holds_alternative<double>(peek(0)) && std::holds_alternative<double>(peek(1))) {
+                    push(Value(concatenate(a, b)));
+                    QUICKEN(ADD_STR);
+                } else if (isNumber(peek(0)) && isNumber(peek(1))) {
                     BINARY_OP(+);
+                    QUICKEN(ADD_NUM);
                 } else {
                     runtimeError("Operands must be two numbers or two strings.");
                     return false;
                 }
                 break;
             }
-            case OpCode::SUBTRACT: BINARY_OP(-); break;
-            case OpCode::MULTIPLY: BINARY_OP(*); break;
-            case OpCode::DIVIDE:   BINARY_OP(/); break;
+            case OpCode::SUBTRACT: INT_ARITH_OP(__builtin_sub_overflow, -); break;
+            case OpCode::MULTIPLY: {
+                if (std::holds_alternative<int32_t>(peek(0)) && std::holds_alternative<int32_t>(peek(1))) {
+                    int32_t b = std::get<int32_t>(peek(0));
+                    int32_t a = std::get<int32_t>(peek(1));
+                    int32_t result;
+                    // A zero product with a negative factor is -0, which only a double can hold.
+                    if (!__builtin_mul_overflow(a, b, &result) && (result != 0 || (a >= 0 && b >= 0))) {
+                        stackTop--;
+                        stackTop[-1] = Value(result);
+                        break;
+                    }
+                }
+                BINARY_OP(*);
+                break;
+            }
+            case OpCode::DIVIDE: {
+                if (std::holds_alternative<int32_t>(peek(0)) && std::holds_alternative<int32_t>(peek(1))) {
+                    int32_t b = std::get<int32_t>(peek(0));
+                    int32_t a = std::get<int32_t>(peek(1));
+                    if (b != 0 && !(b == -1 && a == INT32_MIN) && a % b == 0 && !(a == 0 && b < 0)) {
+                        stackTop--;
+                        stackTop[-1] = Value(a / b);
+                        break;
+                    }
+                }
+                BINARY_OP(/);
+                break;
+            }
             case OpCode::MODULO: {
-                if (!std::holds_alternative<double>(peek(0)) || !std::holds_alternative<double>(peek(1))) {
+                if (!isNumber(peek(0)) || !isNumber(peek(1))) {
                     runtimeError("Operands must be numbers.");
                     return false;
                 }
-                double b = std::get<double>(pop());
-                double a = std::get<double>(pop());
+                if (std::holds_alternative<int32_t>(peek(0)) && std::holds_alternative<int32_t>(peek(1))) {
+                    int32_t b = std::get<int32_t>(peek(0));
+                    int32_t a = std::get<int32_t>(peek(1));
+                    if (b > 0 || b < -1) {
+                        int32_t result = a % b;
+                        if (result != 0 || a >= 0) {
+                            stackTop--;
+                            stackTop[-1] = Value(result);
+                            break;
+                        }
+                    }
+                }
+                double b = asNumber(pop());
+                double a = asNumber(pop());
                 push(Value(fmod(a, b)));
                 break;
             }
             case OpCode::POW: {
-                if (!std::holds_alternative<double>(peek(0)) || !std::holds_alternative<double>(peek(1))) {
+                if (!isNumber(peek(0)) || !isNumber(peek(1))) {
                     runtimeError("Operands must be numbers.");
                     return false;
                 }
-                double b = std::get<double>(pop());
-                double a = std::get<double>(pop());
+                double b = asNumber(pop());
+                double a = asNumber(pop());
                 push(Value(pow(a, b)));
                 break;
             }
@@ -149,21 +375,27 @@ bool VM::run() {
             case OpCode::SHIFT_LEFT: BITWISE_OP(<<); break;
             case OpCode::SHIFT_RIGHT: BITWISE_OP(>>); break;
             case OpCode::BIT_NOT:
-                if (!std::holds_alternative<double>(peek(0))) {
+                if (!isNumber(peek(0))) {
                     runtimeError("Operand must be a number.");
                     return false;
                 }
-                push(Value(static_cast<double>(~static_cast<int>(std::get<double>(pop())))));
+                push(Value(static_cast<int32_t>(~toInt(pop()))));
                 break;
             case OpCode::NOT:
                 push(Value(isFalsey(pop())));
                 break;
             case OpCode::NEGATE:
-                if (!std::holds_alternative<double>(peek(0))) {
+                if (std::holds_alternative<int32_t>(peek(0))) {
+                    int32_t value = std::get<int32_t>(peek(0));
+                    if (value != 0 && value != INT32_MIN) {
+                        stackTop[-1] = Value(-value);
+                        break;
+                    }
+                } else if (!std::holds_alternative<double>(peek(0))) {
                     runtimeError("Operand must be a number.");
                     return false;
                 }
-                push(Value(-std::get<double>(pop())));
+                push(Value(-asNumber(pop())));
                 break;
             case OpCode::EQUAL: {
                 Value b = pop();
@@ -171,23 +403,30 @@ bool VM::run() {
                 push(Value(valuesEqual(a, b)));
                 break;
             }
-            case OpCode::GREATER:  BINARY_OP(>); break;
-            case OpCode::LESS:     BINARY_OP(<); break;
+            case OpCode::GREATER: greater:
+                COMPARE_OP(>);
+                QUICKEN(GREATER_NUM);
+                break;
+            case OpCode::LESS: less:
+                COMPARE_OP(<);
+                QUICKEN(LESS_NUM);
+                break;
 
             case OpCode::PRINT: {
-                std::cout << valueToString(pop()) << "\n";
+                GUARD_SHARED(parallelWorker);
+                out.writeLine(pop());
                 break;
             }
             case OpCode::POP: pop(); break;
 
             case OpCode::DEFINE_GLOBAL: {
-                std::string name = READ_STRING()->str;
+                const std::string& name = keyOf(READ_STRING());
                 globals[name] = peek(0);
                 pop();
                 break;
             }
             case OpCode::GET_GLOBAL: {
-                std::string name = READ_STRING()->str;
+                const std::string& name = keyOf(READ_STRING());
                 auto it = globals.find(name);
                 if (it == globals.end()) {
                     runtimeError("Undefined variable '%s'.", name.c_str());
@@ -197,7 +436,8 @@ bool VM::run() {
                 break;
             }
             case OpCode::SET_GLOBAL: {
-                std::string name = READ_STRING()->str;
+                GUARD_SHARED(parallelWorker);
+                const std::string& name = keyOf(READ_STRING());
                 if (globals.find(name) == globals.end()) {
                     runtimeError("Undefined variable '%s'.", name.c_str());
                     return false;
@@ -230,9 +470,34 @@ bool VM::run() {
                 frame->ip -= offset;
                 break;
             }
-            case OpCode::CALL: {
+            case OpCode::CALL: call: {
                 int argCount = READ_BYTE();
+                Value callee = peek(argCount);
+                if (isObjType(callee, Obj::Type::CLOSURE) && AS_CLOSURE(callee)->function->arity == argCount) {
+                    QUICKEN(CALL_CLOSURE);
+                }
+                if (!callValue(callee, argCount)) return false;
+                if (fiber == host) return true;
+                frame = &frames[frameCount - 1];
+                break;
+            }
+            case OpCode::TAIL_CALL: {
+                int argCount = READ_BYTE();
+                ObjFiber* caller = fiber;
+                int depth = frameCount;
                 if (!callValue(peek(argCount), argCount)) return false;
+                if (fiber == host) return true;
+                if (fiber == caller && frameCount == depth + 1) {
+                    // The callee got a frame of its own: slide it down over
+                    // ours. Natives and fiber switches fall through to RETURN.
+                    CallFrame* callee = &frames[depth];
+                    frame = &frames[depth - 1];
+                    closeUpvalues(frame->slots);
+                    stackTop = std::copy(callee->slots, stackTop, frame->slots);
+                    callee->slots = frame->slots;
+                    *frame = *callee;
+                    frameCount = depth;
+                }
                 frame = &frames[frameCount - 1];
                 break;
             }
@@ -240,25 +505,30 @@ bool VM::run() {
                 ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
                 ObjClosure* closure = newClosure(function);
                 push(Value(closure));
-                for (int i = 0; i < closure->upvalues.size(); ++i) {
-                    uint8_t isLocal = READ_BYTE();
+                for (int i = 0; i < closure->upvalueCount; ++i) {
+                    Capture kind = static_cast<Capture>(READ_BYTE());
                     uint8_t index = READ_BYTE();
-                    if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                    if (kind == Capture::LOCAL_VALUE) {
+                        closure->upvalues()[i] = frame->slots[index];
+                    } else if (kind == Capture::LOCAL) {
+                        closure->upvalues()[i] = Value(captureUpvalue(frame->slots + index));
                     } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
+                        closure->upvalues()[i] = frame->closure->upvalues()[index];
                     }
                 }
                 break;
             }
             case OpCode::GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
+                Value upvalue = frame->closure->upvalues()[READ_BYTE()];
+                push(isObjType(upvalue, Obj::Type::UPVALUE) ? *AS_UPVALUE(upvalue)->location : upvalue);
                 break;
             }
             case OpCode::SET_UPVALUE: {
+                // Assigned variables are always boxed.
                 uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
+                ObjUpvalue* upvalue = AS_UPVALUE(frame->closure->upvalues()[slot]);
+                GUARD_SHARED(upvalue->marked());
+                *upvalue->location = peek(0);
                 break;
             }
             case OpCode::CLOSE_UPVALUE:
@@ -274,23 +544,25 @@ bool VM::run() {
                     return false;
                 }
                 ObjInstance* instance = AS_INSTANCE(peek(1));
-                instance->fields[READ_STRING()->str] = peek(0);
+                GUARD_SHARED(instance->marked());
+                instance->fields[READ_STRING()] = peek(0);
                 Value value = pop();
                 pop();
                 push(value);
                 break;
             }
-            case OpCode::GET_PROPERTY: {
+            case OpCode::GET_PROPERTY: getProperty: {
                 if (!isObjType(peek(0), Obj::Type::INSTANCE)) {
                     runtimeError("Only instances have properties.");
                     return false;
                 }
                 ObjInstance* instance = AS_INSTANCE(peek(0));
-                std::string name = READ_STRING()->str;
+                ObjString* name = READ_STRING();
                 auto it = instance->fields.find(name);
                 if (it != instance->fields.end()) {
                     pop();
                     push(it->second);
+                    QUICKEN(GET_FIELD);
                     break;
                 }
                 if (!bindMethod(instance->klass, name)) return false;
@@ -303,10 +575,15 @@ bool VM::run() {
                 ObjString* method = READ_STRING();
                 int argCount = READ_BYTE();
                 if (!invoke(method, argCount)) return false;
+                if (fiber == host) return true;
                 frame = &frames[frameCount - 1];
                 break;
             }
             case OpCode::INHERIT: {
+                if (!isObjType(peek(1), Obj::Type::CLASS)) {
+                    runtimeError("Superclass must be a class.");
+                    return false;
+                }
                 ObjClass* superclass = AS_CLASS(peek(1));
                 ObjClass* subclass = AS_CLASS(peek(0));
                 for (auto& pair : superclass->methods) {
@@ -318,7 +595,7 @@ bool VM::run() {
             case OpCode::GET_SUPER: {
                 ObjString* name = READ_STRING();
                 ObjClass* superclass = AS_CLASS(pop());
-                if (!bindMethod(superclass, name->str)) return false;
+                if (!bindMethod(superclass, name)) return false;
                 break;
             }
             case OpCode::BUILD_LIST: {
@@ -331,19 +608,19 @@ bool VM::run() {
                 push(Value(static_cast<Obj*>(list)));
                 break;
             }
-            case OpCode::GET_SUBSCRIPT: {
+            case OpCode::GET_SUBSCRIPT: getSubscript: {
                 Value index = pop();
                 Value listVal = pop();
                 if (!isObjType(listVal, Obj::Type::LIST)) {
                     runtimeError("Can only subscript lists.");
                     return false;
                 }
-                if (!std::holds_alternative<double>(index)) {
+                if (!isNumber(index)) {
                     runtimeError("Index must be a number.");
                     return false;
                 }
                 ObjList* list = AS_LIST(listVal);
-                int i = static_cast<int>(std::get<double>(index));
+                int i = toInt(index);
                 if (i < 0 || i >= static_cast<int>(list->elements.size())) {
                     runtimeError("Index out of bounds.");
                     return false;
@@ -359,29 +636,219 @@ bool VM::run() {
                     runtimeError("Can only subscript lists.");
                     return false;
                 }
-                if (!std::holds_alternative<double>(index)) {
+                if (!isNumber(index)) {
                     runtimeError("Index must be a number.");
                     return false;
                 }
                 ObjList* list = AS_LIST(listVal);
-                int i = static_cast<int>(std::get<double>(index));
+                int i = toInt(index);
                 if (i < 0 || i >= static_cast<int>(list->elements.size())) {
                     runtimeError("Index out of bounds.");
                     return false;
                 }
+                GUARD_SHARED(list->marked());
                 list->elements[i] = value;
                 push(value);
                 break;
             }
+            case OpCode::YIELD: {
+                Value value = pop();
+                if (fiber->caller == nullptr) {
+                    runtimeError("Cannot yield from the main fiber.");
+                    return false;
+                }
+                if (fiber->hostCalls > 0) {
+                    runtimeError("Cannot yield across a native call.");
+                    return false;
+                }
+                suspend(ObjFiber::State::SUSPENDED, value);
+                if (fiber == host) return true;
+                frame = &frames[frameCount - 1];
+                break;
+            }
+            case OpCode::RESUME: {
+                if (!resume(peek(1), peek(0))) return false;
+                frame = &frames[frameCount - 1];
+                break;
+            }
+            case OpCode::IMPORT: {
+                // Runs the module's top level as a call that leaves nil, or
+                // just pushes nil if it was imported before.
+                ObjFunction* module;
+                if (!importModule(READ_STRING(), module)) return false;
+                if (module == nullptr) {
+                    push(Value(nullptr));
+                    break;
+                }
+                ObjClosure* closure = newClosure(module);
+                push(Value(closure));
+                if (!call(closure, 0)) return false;
+                frame = &frames[frameCount - 1];
+                break;
+            }
+            case OpCode::WIDE: {
+                extended = (extended | READ_BYTE()) << 8;
+                // Wide jumps run here, which keeps the short ones as they were.
+                OpCode op = static_cast<OpCode>(*frame->ip);
+                if (op != OpCode::JUMP && op != OpCode::JUMP_IF_FALSE && op != OpCode::LOOP) break;
+                frame->ip++;
+                uint32_t offset = std::exchange(extended, 0) << 8 | READ_SHORT();
+                if (op == OpCode::LOOP) {
+                    frame->ip -= offset;
+                } else if (op == OpCode::JUMP || isFalsey(peek(0))) {
+                    frame->ip += offset;
+                }
+                break;
+            }
+            case OpCode::INLINE_CALL: {
+                // Falls through into the inlined body if the callee is still
+                // the inlined function, or a class whose init is; otherwise
+                // skips to the original call.
+                int argCount = READ_BYTE();
+                ObjFunction* inlined = AS_FUNCTION(READ_CONSTANT());
+                uint16_t offset = READ_SHORT();
+                Value callee = peek(argCount);
+                if (isObjType(callee, Obj::Type::CLOSURE) && AS_CLOSURE(callee)->function == inlined) break;
+                if (isObjType(callee, Obj::Type::CLASS)) {
+                    ObjClass* klass = AS_CLASS(callee);
+                    auto init = klass->methods.find(initString);
+                    if (init != klass->methods.end() && AS_CLOSURE(init->second)->function == inlined) {
+                        stackTop[-argCount - 1] = Value(newInstance(klass));
+                        break;
+                    }
+                }
+                frame->ip += offset;
+                break;
+            }
+            case OpCode::INLINE_INVOKE: {
+                ObjString* name = READ_STRING();
+                int argCount = READ_BYTE();
+                ObjFunction* inlined = AS_FUNCTION(READ_CONSTANT());
+                uint16_t offset = READ_SHORT();
+                Value receiver = peek(argCount);
+                if (isObjType(receiver, Obj::Type::INSTANCE)) {
+                    ObjInstance* instance = AS_INSTANCE(receiver);
+                    auto method = instance->klass->methods.find(name);
+                    if (method != instance->klass->methods.end() &&
+                        AS_CLOSURE(method->second)->function == inlined &&
+                        instance->fields.find(name) == instance->fields.end()) {
+                        break;
+                    }
+                }
+                frame->ip += offset;
+                break;
+            }
+            case OpCode::CHECK_RANGE: {
+                // Replaces the bound of a counted loop with whether indexing
+                // the list from the index's starting value up to below the
+                // bound stays in range; see optimizeLoops.
+                Value listVal = frame->slots[READ_BYTE()];
+                Value index = frame->slots[READ_BYTE()];
+                Value bound = peek(0);
+                stackTop[-1] = Value(isObjType(listVal, Obj::Type::LIST) && isNumber(index) && isNumber(bound) &&
+                                     asNumber(index) >= 0 &&
+                                     asNumber(bound) <= static_cast<double>(AS_LIST(listVal)->elements.size()));
+                break;
+            }
+            case OpCode::GET_INDEX: {
+                Value listVal = frame->slots[READ_BYTE()];
+                Value index = frame->slots[READ_BYTE()];
+                if (std::get<bool>(frame->slots[READ_BYTE()])) {
+                    push(AS_LIST(listVal)->elements[toInt(index)]);
+                    break;
+                }
+                push(listVal);
+                push(index);
+                goto getSubscript;
+            }
+            case OpCode::ADD_NUM: {
+                if (std::holds_alternative<int32_t>(peek(0)) && std::holds_alternative<int32_t>(peek(1))) {
+                    int32_t result;
+                    if (!__builtin_add_overflow(std::get<int32_t>(peek(1)), std::get<int32_t>(peek(0)), &result)) {
+                        stackTop--;
+                        stackTop[-1] = Value(result);
+                        break;
+                    }
+                } else if (!isNumber(peek(0)) || !isNumber(peek(1))) {
+                    QUICKEN(ADD);
+                    goto add;
+                }
+                double b = asNumber(peek(0));
+                stackTop--;
+                stackTop[-1] = Value(asNumber(stackTop[-1]) + b);
+                break;
+            }
+            case OpCode::ADD_STR: {
+                if (!isObjType(peek(0), Obj::Type::STRING) || !isObjType(peek(1), Obj::Type::STRING)) {
+                    QUICKEN(ADD);
+                    goto add;
+                }
+                ObjString* result = concatenate(AS_STRING(peek(1)), AS_STRING(peek(0)));
+                stackTop--;
+                stackTop[-1] = Value(result);
+                break;
+            }
+            case OpCode::LESS_NUM:
+                if (!isNumber(peek(0)) || !isNumber(peek(1))) {
+                    QUICKEN(LESS);
+                    goto less;
+                }
+                COMPARE_OP(<);
+                break;
+            case OpCode::GREATER_NUM:
+                if (!isNumber(peek(0)) || !isNumber(peek(1))) {
+                    QUICKEN(GREATER);
+                    goto greater;
+                }
+                COMPARE_OP(>);
+                break;
+            case OpCode::GET_FIELD: {
+                // The operand is only consumed on a hit, so the generic
+                // code can reread it.
+                if (isObjType(peek(0), Obj::Type::INSTANCE)) {
+                    ObjInstance* instance = AS_INSTANCE(peek(0));
+                    ObjString* name = AS_STRING(frame->closure->function->chunk.constants[extended | *frame->ip]);
+                    auto it = instance->fields.find(name);
+                    if (it != instance->fields.end()) {
+                        frame->ip++;
+                        extended = 0;
+                        stackTop[-1] = it->second;
+                        break;
+                    }
+                }
+                QUICKEN(GET_PROPERTY);
+                goto getProperty;
+            }
+            case OpCode::CALL_CLOSURE: {
+                int argCount = *frame->ip;
+                Value callee = peek(argCount);
+                if (!isObjType(callee, Obj::Type::CLOSURE) || AS_CLOSURE(callee)->function->arity != argCount) {
+                    QUICKEN(CALL);
+                    goto call;
+                }
+                frame->ip++;
+                if (!call(AS_CLOSURE(callee), argCount)) return false;
+                frame = &frames[frameCount - 1];
+                break;
+            }
             case OpCode::RETURN: {
                 Value result = pop();
                 closeUpvalues(frame->slots);
                 frameCount--;
-                if (frameCount == 0) {
-                    pop();
+                stackTop = frame->slots;
+                if (fiber == baseFiber && frameCount == baseFrame) {
+                    push(result);
                     return true;
                 }
-                stackTop = frame->slots;
+                if (frameCount == 0) {
+                    ObjFiber* finished = fiber;
+                    switchFiber(finished->caller);
+                    finishFiber(finished);
+                    push(result);
+                    if (fiber == host) return true;
+                    frame = &frames[frameCount - 1];
+                    break;
+                }
                 push(result);
                 frame = &frames[frameCount - 1];
                 break;
@@ -391,14 +858,21 @@ bool VM::run() {
 
 #undef READ_BYTE
 #undef READ_SHORT
+#undef READ_INDEX
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef QUICKEN
 #undef BINARY_OP
+#undef INT_ARITH_OP
+#undef COMPARE_OP
 #undef BITWISE_OP
 }
 
-void VM::defineNative(const std::string& name, int arity, Value (*fn)(VM&, const std::vector<Value>&)) {
-    globals[name] = Value(newNative(fn, arity));
+void VM::defineNative(const std::string& name, int arity, Value (*fn)(VM&, const std::vector<Value>&),
+                      bool threadSafe) {
+    ObjNative* native = newNative(fn, arity);
+    native->threadSafe = threadSafe;
+    globals[name] = Value(native);
 }
 
 Value VM::clockNative(VM&, const std::vector<Value>&) {
@@ -408,40 +882,198 @@ Value VM::clockNative(VM&, const std::vector<Value>&) {
 
 Value VM::inputNative(VM& vm, const std::vector<Value>& args) {
     if (args.size() > 0) {
-        std::cout << vm.valueToString(args[0]);
+        vm.out.writeValue(args[0]);
     }
+    vm.out.flush();
     std::string line;
     std::getline(std::cin, line);
     return Value(vm.allocateString(line));
 }
 
-ObjString* VM::allocateString(std::string s) {
-    ObjString* string = new ObjString(std::move(s));
-    string->next = objects;
+Value VM::writeNative(VM& vm, const std::vector<Value>& args) {
+    if (args.size() > 0) {
+        vm.out.writeValue(args[0]);
+    }
+    return Value(nullptr);
+}
+
+Value VM::flushNative(VM& vm, const std::vector<Value>&) {
+    return Value(vm.out.flush());
+}
+
+Value VM::readFileNative(VM& vm, const std::vector<Value>& args) {
+    if (args.empty() || !isObjType(args[0], Obj::Type::STRING)) return Value(nullptr);
+    std::unique_ptr<MappedFile> file = MappedFile::open(AS_CSTRING(args[0]));
+    if (!file) return Value(nullptr);
+    return Value(vm.allocateString(file->contents()));
+}
+
+Value VM::writeFileNative(VM&, const std::vector<Value>& args) {
+    if (args.size() < 2 || !isObjType(args[0], Obj::Type::STRING)) return Value(false);
+    if (isObjType(args[1], Obj::Type::STRING)) {
+        return Value(writeWholeFile(AS_CSTRING(args[0]), AS_STRING(args[1])->view()));
+    }
+    return Value(writeWholeFile(AS_CSTRING(args[0]), valueToString(args[1])));
+}
+
+Value VM::openLinesNative(VM& vm, const std::vector<Value>& args) {
+    if (args.empty() || !isObjType(args[0], Obj::Type::STRING)) return Value(nullptr);
+    std::shared_ptr<LineReader> reader = LineReader::open(AS_CSTRING(args[0]));
+    if (!reader) return Value(nullptr);
+    NativeFn next = [reader](VM& vm, const std::vector<Value>&) -> Value {
+        std::string_view line;
+        if (!reader->next(line)) return Value(nullptr);
+        return Value(vm.allocateString(line));
+    };
+    return Value(vm.newNative(std::move(next), 0));
+}
+
+ParallelLists& VM::parallelLists() {
+    if (!parallel) parallel = std::make_unique<ParallelLists>();
+    return *parallel;
+}
+
+// The parallel natives try the worker pool first and fall back to a plain
+// loop on this VM, which also reports any error the closure raises.
+Value VM::parallelMapNative(VM& vm, const std::vector<Value>& args) {
+    if (args.size() < 2 || !isObjType(args[0], Obj::Type::LIST)) {
+        return vm.nativeError("parallelMap expects a list and a function.");
+    }
+    // The result list plus the function and one argument per call.
+    if (!vm.ensureStack(3)) return vm.nativeError("Stack overflow.");
+    ObjList* list = AS_LIST(args[0]);
+    ObjList* result = vm.newList();
+    vm.push(Value(result));
+    if (ParallelLists::eligible(vm, args[1], list->elements.size()) &&
+        vm.parallelLists().map(vm, list->elements, args[1], result->elements)) {
+        return vm.pop();
+    }
+
+    result->elements.clear();
+    for (size_t i = 0; i < list->elements.size(); ++i) {
+        vm.push(args[1]);
+        vm.push(list->elements[i]);
+        if (!vm.callFromHost(1)) return vm.nativeError("");
+        result->elements.push_back(vm.pop());
+    }
+    return vm.pop();
+}
+
+Value VM::parallelFilterNative(VM& vm, const std::vector<Value>& args) {
+    if (args.size() < 2 || !isObjType(args[0], Obj::Type::LIST)) {
+        return vm.nativeError("parallelFilter expects a list and a function.");
+    }
+    if (!vm.ensureStack(3)) return vm.nativeError("Stack overflow.");
+    ObjList* list = AS_LIST(args[0]);
+    ObjList* result = vm.newList();
+    vm.push(Value(result));
+    std::vector<char> keep;
+    if (ParallelLists::eligible(vm, args[1], list->elements.size()) &&
+        vm.parallelLists().filter(vm, list->elements, args[1], keep)) {
+        for (size_t i = 0; i < keep.size(); ++i) {
+            if (keep[i]) result->elements.push_back(list->elements[i]);
+        }
+        return vm.pop();
+    }
+
+    for (size_t i = 0; i < list->elements.size(); ++i) {
+        Value item = list->elements[i];
+        vm.push(args[1]);
+        vm.push(item);
+        if (!vm.callFromHost(1)) return vm.nativeError("");
+        if (!isFalsey(vm.pop())) result->elements.push_back(item);
+    }
+    return vm.pop();
+}
+
+// Reduces each chunk in parallel and then folds the chunk results into
+// initial in order, so fn must be associative to match a sequential fold.
+Value VM::parallelReduceNative(VM& vm, const std::vector<Value>& args) {
+    if (args.size() < 3 || !isObjType(args[0], Obj::Type::LIST)) {
+        return vm.nativeError("parallelReduce expects a list, a function and an initial value.");
+    }
+    if (!vm.ensureStack(4)) return vm.nativeError("Stack overflow.");
+    ObjList* list = AS_LIST(args[0]);
+    ObjList* partials = vm.newList();
+    vm.push(Value(partials));
+    const std::vector<Value>* items = &list->elements;
+    if (ParallelLists::eligible(vm, args[1], list->elements.size()) &&
+        vm.parallelLists().reduce(vm, list->elements, args[1], partials->elements)) {
+        items = &partials->elements;
+    }
+
+    Value acc = args[2];
+    for (size_t i = 0; i < items->size(); ++i) {
+        vm.push(args[1]);
+        vm.push(acc);
+        vm.push((*items)[i]);
+        if (!vm.callFromHost(2)) return vm.nativeError("");
+        acc = vm.pop();
+    }
+    vm.pop();
+    return acc;
+}
+
+Value VM::fiberNative(VM& vm, const std::vector<Value>& args) {
+    if (args.empty() || !isObjType(args[0], Obj::Type::CLOSURE)) {
+        return vm.nativeError("fiber expects a function.");
+    }
+    return Value(vm.newFiber(AS_CLOSURE(args[0])));
+}
+
+Value VM::isDoneNative(VM&, const std::vector<Value>& args) {
+    if (args.empty() || !isObjType(args[0], Obj::Type::FIBER)) return Value(nullptr);
+    return Value(AS_FIBER(args[0])->state == ObjFiber::State::DONE);
+}
+
+ObjString* VM::allocateString(std::string_view s) {
+    ObjString* string = newString(s.size());
+    memcpy(string->chars(), s.data(), s.size());
+    string->computeHash();
+    return string;
+}
+
+ObjString* VM::concatenate(const ObjString* a, const ObjString* b) {
+    ObjString* string = newString(static_cast<size_t>(a->length) + b->length);
+    memcpy(string->chars(), a->chars(), a->length);
+    memcpy(string->chars() + a->length, b->chars(), b->length);
+    string->computeHash();
+    return string;
+}
+
+// Allocates a string with room for length characters and terminates it;
+// the caller fills in the characters.
+ObjString* VM::newString(size_t length) {
+    assert(length <= UINT32_MAX);
+    void* memory = ::operator new(ObjString::allocationSize(length));
+    ObjString* string = new (memory) ObjString(static_cast<uint32_t>(length));
+    string->chars()[length] = '\0';
+    string->setNext(objects);
     objects = string;
-    bytesAllocated += sizeof(ObjString) + string->str.capacity();
+    bytesAllocated += ObjString::allocationSize(length);
     return string;
 }
 
 ObjFunction* VM::newFunction() {
     ObjFunction* function = new ObjFunction();
-    function->next = objects;
+    function->setNext(objects);
     objects = function;
     bytesAllocated += sizeof(ObjFunction);
     return function;
 }
 
 ObjClosure* VM::newClosure(ObjFunction* function) {
-    ObjClosure* closure = new ObjClosure(function);
-    closure->next = objects;
+    void* memory = ::operator new(ObjClosure::allocationSize(function->upvalueCount));
+    ObjClosure* closure = new (memory) ObjClosure(function);
+    closure->setNext(objects);
     objects = closure;
-    bytesAllocated += sizeof(ObjClosure) + sizeof(ObjUpvalue*) * function->upvalueCount;
+    bytesAllocated += ObjClosure::allocationSize(function->upvalueCount);
     return closure;
 }
 
 ObjUpvalue* VM::newUpvalue(Value* slot) {
     ObjUpvalue* upvalue = new ObjUpvalue(slot);
-    upvalue->Obj::next = objects;
+    upvalue->setNext(objects);
     objects = upvalue;
     bytesAllocated += sizeof(ObjUpvalue);
     return upvalue;
@@ -449,7 +1081,7 @@ ObjUpvalue* VM::newUpvalue(Value* slot) {
 
 ObjClass* VM::newClass(ObjString* name) {
     ObjClass* klass = new ObjClass(name);
-    klass->next = objects;
+    klass->setNext(objects);
     objects = klass;
     bytesAllocated += sizeof(ObjClass);
     return klass;
@@ -457,7 +1089,7 @@ ObjClass* VM::newClass(ObjString* name) {
 
 ObjInstance* VM::newInstance(ObjClass* klass) {
     ObjInstance* instance = new ObjInstance(klass);
-    instance->next = objects;
+    instance->setNext(objects);
     objects = instance;
     bytesAllocated += sizeof(ObjInstance);
     return instance;
@@ -465,7 +1097,7 @@ ObjInstance* VM::newInstance(ObjClass* klass) {
 
 ObjBoundMethod* VM::newBoundMethod(Value receiver, ObjClosure* method) {
     ObjBoundMethod* bound = new ObjBoundMethod(receiver, method);
-    bound->next = objects;
+    bound->setNext(objects);
     objects = bound;
     bytesAllocated += sizeof(ObjBoundMethod);
     return bound;
@@ -473,7 +1105,7 @@ ObjBoundMethod* VM::newBoundMethod(Value receiver, ObjClosure* method) {
 
 ObjNative* VM::newNative(NativeFn function, int arity) {
     ObjNative* native = new ObjNative(function, arity);
-    native->next = objects;
+    native->setNext(objects);
     objects = native;
     bytesAllocated += sizeof(ObjNative);
     return native;
@@ -481,24 +1113,61 @@ ObjNative* VM::newNative(NativeFn function, int arity) {
 
 ObjList* VM::newList() {
     ObjList* list = new ObjList();
-    list->next = objects;
+    list->setNext(objects);
     objects = list;
     bytesAllocated += sizeof(ObjList);
     return list;
 }
 
+ObjFiber* VM::newFiber(ObjClosure* entry) {
+    int slots = ObjFiber::INITIAL_SLOTS;
+    if (entry) slots = std::max(slots, entry->function->maxSlots);
+    ObjFiber* fiber = new ObjFiber(entry, slots);
+    fiber->setNext(objects);
+    objects = fiber;
+    bytesAllocated += sizeof(ObjFiber) + fiber->stackBytes();
+    return fiber;
+}
+
+void VM::collectGarbage() {
+    auto start = std::chrono::steady_clock::now();
+    markRoots();
+    traceReferences();
+    sweep();
+    nextGC = std::max(bytesAllocated * 2, MIN_HEAP);
+    if (memoryLimit != 0) nextGC = std::min(nextGC, memoryLimit);
+
+    uint64_t pause = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    gcStats.collections++;
+    gcStats.totalPauseNs += pause;
+    gcStats.maxPauseNs = std::max(gcStats.maxPauseNs, pause);
+}
+
 void VM::markRoots() {
-    for (Value* slot = stack.data(); slot < stackTop; ++slot) {
-        markValue(*slot);
+    fiber->stackTop = stackTop;
+    fiber->frameCount = frameCount;
+    fiber->openUpvalues = openUpvalues;
+    markObject(reinterpret_cast<Obj*>(fiber));
+    markObject(reinterpret_cast<Obj*>(rootFiber));
+    markObject(reinterpret_cast<Obj*>(initString));
+    for (auto& pair : globals) {
+        markValue(pair.second);
     }
-    for (int i = 0; i < frameCount; ++i) {
-        markObject(reinterpret_cast<Obj*>(frames[i].closure));
+    for (const Value& value : pinned) {
+        markValue(value);
     }
-    for (ObjUpvalue* upvalue = openUpvalues; upvalue != nullptr; upvalue = upvalue->next) {
-        markObject(reinterpret_cast<Obj*>(upvalue));
+    for (auto& pair : modules) {
+        markObject(reinterpret_cast<Obj*>(pair.second));
     }
-    for (auto& pair : globals) {
-        markValue(pair.second);
+    if (loop) {
+        loop->forEachRoot([this](Obj* object) { markObject(object); },
+                          [this](const Value& value) { markValue(value); });
+    }
+    if (opStats) {
+        for (auto& pair : opStats->functionCounters()) {
+            markObject(reinterpret_cast<Obj*>(pair.first));
+        }
     }
 }
 
@@ -511,11 +1180,12 @@ void VM::traceReferences() {
 }
 
 void VM::blackenObject(Obj* object) {
-    switch (object->type) {
+    switch (object->type()) {
         case Obj::Type::CLASS: {
             ObjClass* klass = reinterpret_cast<ObjClass*>(object);
             markObject(reinterpret_cast<Obj*>(klass->name));
             for (auto& pair : klass->methods) {
+                markObject(reinterpret_cast<Obj*>(pair.first));
                 markValue(pair.second);
             }
             break;
@@ -523,8 +1193,8 @@ void VM::blackenObject(Obj* object) {
         case Obj::Type::CLOSURE: {
             ObjClosure* closure = reinterpret_cast<ObjClosure*>(object);
             markObject(reinterpret_cast<Obj*>(closure->function));
-            for (int i = 0; i < closure->upvalues.size(); ++i) {
-                markObject(reinterpret_cast<Obj*>(closure->upvalues[i]));
+            for (int i = 0; i < closure->upvalueCount; ++i) {
+                markValue(closure->upvalues()[i]);
             }
             break;
         }
@@ -540,6 +1210,7 @@ void VM::blackenObject(Obj* object) {
             ObjInstance* instance = reinterpret_cast<ObjInstance*>(object);
             markObject(reinterpret_cast<Obj*>(instance->klass));
             for (auto& pair : instance->fields) {
+                markObject(reinterpret_cast<Obj*>(pair.first));
                 markValue(pair.second);
             }
             break;
@@ -563,6 +1234,23 @@ void VM::blackenObject(Obj* object) {
             }
             break;
         }
+        case Obj::Type::FIBER: {
+            ObjFiber* f = reinterpret_cast<ObjFiber*>(object);
+            markObject(reinterpret_cast<Obj*>(f->entry));
+            markObject(reinterpret_cast<Obj*>(f->caller));
+            // A finished fiber has released its stacks.
+            if (!f->stack) break;
+            for (Value* slot = f->stack.get(); slot < f->stackTop; ++slot) {
+                markValue(*slot);
+            }
+            for (int i = 0; i < f->frameCount; ++i) {
+                markObject(reinterpret_cast<Obj*>(f->frames[i].closure));
+            }
+            for (ObjUpvalue* upvalue = f->openUpvalues; upvalue != nullptr; upvalue = upvalue->next) {
+                markObject(reinterpret_cast<Obj*>(upvalue));
+            }
+            break;
+        }
     }
 }
 
@@ -570,15 +1258,15 @@ void VM::sweep() {
     Obj* previous = nullptr;
     Obj* object = objects;
     while (object != nullptr) {
-        if (object->marked) {
-            object->marked = false;
+        if (object->marked()) {
+            object->setMarked(false);
             previous = object;
-            object = object->next;
+            object = object->next();
         } else {
             Obj* unreached = object;
-            object = object->next;
+            object = object->next();
             if (previous != nullptr) {
-                previous->next = object;
+                previous->setNext(object);
             } else {
                 objects = object;
             }
@@ -588,8 +1276,8 @@ void VM::sweep() {
 }
 
 void VM::markObject(Obj* object) {
-    if (object == nullptr || object->marked) return;
-    object->marked = true;
+    if (object == nullptr || object->marked()) return;
+    object->setMarked(true);
     grayStack.push_back(object);
 }
 
@@ -600,23 +1288,43 @@ void VM::markValue(const Value& value) {
 }
 
 void VM::freeObject(Obj* object) {
-    switch (object->type) {
-        case Obj::Type::STRING: delete static_cast<ObjString*>(object); break;
-        case Obj::Type::FUNCTION: delete static_cast<ObjFunction*>(object); break;
-        case Obj::Type::CLOSURE: delete static_cast<ObjClosure*>(object); break;
-        case Obj::Type::UPVALUE: delete static_cast<ObjUpvalue*>(object); break;
-        case Obj::Type::CLASS: delete static_cast<ObjClass*>(object); break;
-        case Obj::Type::INSTANCE: delete static_cast<ObjInstance*>(object); break;
-        case Obj::Type::BOUND_METHOD: delete static_cast<ObjBoundMethod*>(object); break;
-        case Obj::Type::NATIVE: delete static_cast<ObjNative*>(object); break;
-        case Obj::Type::LIST: delete static_cast<ObjList*>(object); break;
+    size_t size = 0;
+    switch (object->type()) {
+        case Obj::Type::STRING: {
+            ObjString* string = static_cast<ObjString*>(object);
+            size = ObjString::allocationSize(string->length);
+            string->~ObjString();
+            ::operator delete(string);
+            break;
+        }
+        case Obj::Type::FUNCTION: size = sizeof(ObjFunction); delete static_cast<ObjFunction*>(object); break;
+        case Obj::Type::CLOSURE: {
+            ObjClosure* closure = static_cast<ObjClosure*>(object);
+            size = ObjClosure::allocationSize(closure->upvalueCount);
+            closure->~ObjClosure();
+            ::operator delete(closure);
+            break;
+        }
+        case Obj::Type::UPVALUE: size = sizeof(ObjUpvalue); delete static_cast<ObjUpvalue*>(object); break;
+        case Obj::Type::CLASS: size = sizeof(ObjClass); delete static_cast<ObjClass*>(object); break;
+        case Obj::Type::INSTANCE: size = sizeof(ObjInstance); delete static_cast<ObjInstance*>(object); break;
+        case Obj::Type::BOUND_METHOD: size = sizeof(ObjBoundMethod); delete static_cast<ObjBoundMethod*>(object); break;
+        case Obj::Type::NATIVE: size = sizeof(ObjNative); delete static_cast<ObjNative*>(object); break;
+        case Obj::Type::LIST: size = sizeof(ObjList); delete static_cast<ObjList*>(object); break;
+        case Obj::Type::FIBER: {
+            ObjFiber* fiber = static_cast<ObjFiber*>(object);
+            size = sizeof(ObjFiber) + fiber->stackBytes();
+            delete fiber;
+            break;
+        }
     }
+    bytesAllocated -= std::min(size, bytesAllocated);
 }
 
 void VM::freeObjects() {
     Obj* object = objects;
     while (object != nullptr) {
-        Obj* next = object->next;
+        Obj* next = object->next();
         freeObject(object);
         object = next;
     }
@@ -629,7 +1337,12 @@ bool VM::call(ObjClosure* closure, int argCount) {
         return false;
     }
 
-    if (frameCount == FRAMES_MAX) {
+    // Compiling the body works out how many slots it needs.
+    if (closure->function->deferred && !compileDeferred(closure->function)) return false;
+
+    // The callee and its arguments are already on the stack.
+    int slots = closure->function->maxSlots - argCount - 1;
+    if ((frameCount == fiber->frameCapacity && !growFrames()) || !ensureStack(slots)) {
         runtimeError("Stack overflow.");
         return false;
     }
@@ -641,10 +1354,40 @@ bool VM::call(ObjClosure* closure, int argCount) {
     return true;
 }
 
+// Inlining looks for its callees across the whole script, so deferred
+// bodies only get the loop pass.
+static bool compileBody(VM& vm, ObjFunction* function) {
+    // Compile errors go straight to stderr; keep earlier output ahead of them.
+    vm.out.flush();
+    Parser parser(vm, *function->deferred);
+    if (!parser.compileDeferred(function)) return false;
+    if (vm.loopOptimization) optimizeLoops(function);
+    return true;
+}
+
+bool VM::compileDeferred(ObjFunction* function) {
+    if (!compileBody(*this, function)) {
+        runtimeError("Could not compile %s.", function->name->c_str());
+        return false;
+    }
+    return true;
+}
+
+bool VM::compileDeferred() {
+    if (!deferredPending) return true;
+    for (Obj* object = objects; object != nullptr; object = object->next()) {
+        if (object->type() != Obj::Type::FUNCTION) continue;
+        ObjFunction* function = reinterpret_cast<ObjFunction*>(object);
+        if (function->deferred && !compileBody(*this, function)) return false;
+    }
+    deferredPending = false;
+    return true;
+}
+
 bool VM::callValue(Value callee, int argCount) {
     if (std::holds_alternative<Obj*>(callee)) {
         Obj* obj = std::get<Obj*>(callee);
-        switch (obj->type) {
+        switch (obj->type()) {
             case Obj::Type::BOUND_METHOD: {
                 ObjBoundMethod* bound = AS_BOUND(callee);
                 stackTop[-argCount - 1] = bound->receiver;
@@ -653,7 +1396,7 @@ bool VM::callValue(Value callee, int argCount) {
             case Obj::Type::CLASS: {
                 ObjClass* klass = AS_CLASS(callee);
                 stackTop[-argCount - 1] = Value(newInstance(klass));
-                auto init = klass->methods.find("init");
+                auto init = klass->methods.find(initString);
                 if (init != klass->methods.end()) {
                     return call(AS_CLOSURE(init->second), argCount);
                 } else if (argCount != 0) {
@@ -666,8 +1409,25 @@ bool VM::callValue(Value callee, int argCount) {
                 return call(AS_CLOSURE(callee), argCount);
             case Obj::Type::NATIVE: {
                 ObjNative* native = AS_NATIVE(callee);
+                if (parallelWorker && !native->threadSafe) {
+                    runtimeError("Cannot call this native in a parallel operation.");
+                    return false;
+                }
                 Value result = native->function(*this, std::vector<Value>(stackTop - argCount, stackTop));
+                if (nativeFailed) {
+                    // An empty message means a nested call already reported
+                    // its error and unwound the VM.
+                    nativeFailed = false;
+                    if (!nativeErrorMessage.empty()) runtimeError("%s", nativeErrorMessage.c_str());
+                    return false;
+                }
                 stackTop -= argCount + 1;
+                if (parkRequested) {
+                    // The event loop resumes the fiber with the call's result.
+                    parkRequested = false;
+                    suspend(ObjFiber::State::WAITING, Value(nullptr));
+                    return true;
+                }
                 push(result);
                 return true;
             }
@@ -679,6 +1439,11 @@ bool VM::callValue(Value callee, int argCount) {
     return false;
 }
 
+const std::string& VM::keyOf(const ObjString* name) {
+    nameKey.assign(name->chars(), name->length);
+    return nameKey;
+}
+
 bool VM::invoke(ObjString* name, int argCount) {
     Value receiver = peek(argCount);
     if (!isObjType(receiver, Obj::Type::INSTANCE)) {
@@ -687,7 +1452,7 @@ bool VM::invoke(ObjString* name, int argCount) {
     }
     ObjInstance* instance = AS_INSTANCE(receiver);
 
-    auto field = instance->fields.find(name->str);
+    auto field = instance->fields.find(name);
     if (field != instance->fields.end()) {
         stackTop[-argCount - 1] = field->second;
         return callValue(field->second, argCount);
@@ -697,18 +1462,18 @@ bool VM::invoke(ObjString* name, int argCount) {
 }
 
 bool VM::invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
-    auto method = klass->methods.find(name->str);
+    auto method = klass->methods.find(name);
     if (method == klass->methods.end()) {
-        runtimeError("Undefined property '%s'.", name->str.c_str());
+        runtimeError("Undefined property '%s'.", name->c_str());
         return false;
     }
     return call(AS_CLOSURE(method->second), argCount);
 }
 
-bool VM::bindMethod(ObjClass* klass, const std::string& name) {
+bool VM::bindMethod(ObjClass* klass, ObjString* name) {
     auto method = klass->methods.find(name);
     if (method == klass->methods.end()) {
-        runtimeError("Undefined property '%s'.", name.c_str());
+        runtimeError("Undefined property '%s'.", name->c_str());
         return false;
     }
     ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method->second));
@@ -718,16 +1483,21 @@ bool VM::bindMethod(ObjClass* klass, const std::string& name) {
 }
 
 ObjUpvalue* VM::captureUpvalue(Value* local) {
+    if (!fiber->openSlots) {
+        fiber->openSlots.reset(new ObjUpvalue*[fiber->stackCapacity]());
+        bytesAllocated += sizeof(ObjUpvalue*) * static_cast<size_t>(fiber->stackCapacity);
+    }
+    ObjUpvalue*& open = fiber->openSlots[local - stack];
+    if (open != nullptr) return open;
+
+    // Only the running frame's slots are captured, so this passes no more
+    // than its upvalues above local.
     ObjUpvalue* prevUpvalue = nullptr;
     ObjUpvalue* upvalue = openUpvalues;
     while (upvalue != nullptr && upvalue->location > local) {
         prevUpvalue = upvalue;
         upvalue = upvalue->next;
     }
-    if (upvalue != nullptr && upvalue->location == local) {
-        return upvalue;
-    }
-
     ObjUpvalue* createdUpvalue = newUpvalue(local);
     createdUpvalue->next = upvalue;
 
@@ -736,58 +1506,232 @@ ObjUpvalue* VM::captureUpvalue(Value* local) {
     } else {
         prevUpvalue->next = createdUpvalue;
     }
-
+    open = createdUpvalue;
     return createdUpvalue;
 }
 
 void VM::closeUpvalues(Value* last) {
     while (openUpvalues != nullptr && openUpvalues->location >= last) {
         ObjUpvalue* upvalue = openUpvalues;
+        fiber->openSlots[upvalue->location - stack] = nullptr;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
         openUpvalues = upvalue->next;
     }
 }
 
+// Pops the fiber and the value passed to it, then switches to the fiber.
+// The value becomes the result of its pending yield, or the argument of its
+// entry function on the first resume.
+bool VM::resume(Value target, Value value) {
+    if (!isObjType(target, Obj::Type::FIBER)) {
+        runtimeError("Can only resume fibers.");
+        return false;
+    }
+    ObjFiber* next = AS_FIBER(target);
+    if (next->state == ObjFiber::State::DONE) {
+        runtimeError("Cannot resume a finished fiber.");
+        return false;
+    }
+    if (next->state == ObjFiber::State::RUNNING) {
+        runtimeError("Cannot resume a running fiber.");
+        return false;
+    }
+    if (next->state == ObjFiber::State::WAITING) {
+        runtimeError("Cannot resume a fiber waiting on I/O.");
+        return false;
+    }
+
+    stackTop -= 2;
+    ObjFiber::State state = next->state;
+    next->caller = fiber;
+    next->state = ObjFiber::State::RUNNING;
+    switchFiber(next);
+    if (state == ObjFiber::State::SUSPENDED) {
+        push(value);
+        return true;
+    }
+    push(Value(next->entry));
+    int argCount = next->entry->function->arity == 0 ? 0 : 1;
+    if (argCount == 1) push(value);
+    return call(next->entry, argCount);
+}
+
+// Switches back to the fiber that resumed this one and hands it value.
+void VM::suspend(ObjFiber::State state, Value value) {
+    ObjFiber* suspended = fiber;
+    switchFiber(suspended->caller);
+    suspended->state = state;
+    suspended->caller = nullptr;
+    push(value);
+}
+
+void VM::switchFiber(ObjFiber* next) {
+    fiber->stackTop = stackTop;
+    fiber->frameCount = frameCount;
+    fiber->openUpvalues = openUpvalues;
+    loadFiber(next);
+}
+
+// Moves the running fiber's values to a larger array. Frame slots, open
+// upvalues and the cached stack pointers all point into it and are rebased;
+// callers must reload anything else they cached, as run() does after calls.
+bool VM::growStack(int slots) {
+    int used = static_cast<int>(stackTop - stack);
+    if (used + slots > maxStackSlots) return false;
+    int capacity = std::min(std::max(fiber->stackCapacity * 2, used + slots), maxStackSlots);
+
+    Value* old = stack;
+    std::unique_ptr<Value[]> grown(new Value[capacity]);
+    std::copy(old, stackTop, grown.get());
+    auto rebase = [&](Value* slot) { return grown.get() + (slot - old); };
+    for (int i = 0; i < frameCount; ++i) {
+        frames[i].slots = rebase(frames[i].slots);
+    }
+    for (ObjUpvalue* upvalue = openUpvalues; upvalue != nullptr; upvalue = upvalue->next) {
+        upvalue->location = rebase(upvalue->location);
+    }
+    stackTop = rebase(stackTop);
+
+    size_t slotBytes = sizeof(Value);
+    if (fiber->openSlots) {
+        std::unique_ptr<ObjUpvalue*[]> open(new ObjUpvalue*[capacity]());
+        std::copy(fiber->openSlots.get(), fiber->openSlots.get() + used, open.get());
+        fiber->openSlots = std::move(open);
+        slotBytes += sizeof(ObjUpvalue*);
+    }
+    bytesAllocated += slotBytes * static_cast<size_t>(capacity - fiber->stackCapacity);
+    fiber->stack = std::move(grown);
+    fiber->stackCapacity = capacity;
+    stack = fiber->stack.get();
+    return true;
+}
+
+bool VM::growFrames() {
+    if (fiber->frameCapacity >= maxFrames) return false;
+    int capacity = std::min(fiber->frameCapacity * 2, maxFrames);
+
+    std::unique_ptr<CallFrame[]> grown(new CallFrame[capacity]);
+    std::copy(frames, frames + frameCount, grown.get());
+    bytesAllocated += sizeof(CallFrame) * static_cast<size_t>(capacity - fiber->frameCapacity);
+    fiber->frames = std::move(grown);
+    fiber->frameCapacity = capacity;
+    frames = fiber->frames.get();
+    return true;
+}
+
+void VM::loadFiber(ObjFiber* next) {
+    fiber = next;
+    stack = next->stack.get();
+    stackTop = next->stackTop;
+    frames = next->frames.get();
+    frameCount = next->frameCount;
+    openUpvalues = next->openUpvalues;
+}
+
+// Releases the stacks of a fiber that returned or was unwound by an error;
+// it must not be the running fiber. Closures over its variables keep the
+// values they had.
+void VM::finishFiber(ObjFiber* done) {
+    for (ObjUpvalue* upvalue = done->openUpvalues; upvalue != nullptr; upvalue = upvalue->next) {
+        upvalue->closed = *upvalue->location;
+        upvalue->location = &upvalue->closed;
+    }
+    done->state = ObjFiber::State::DONE;
+    done->caller = nullptr;
+    done->entry = nullptr;
+    bytesAllocated -= std::min(done->stackBytes(), bytesAllocated);
+    done->stack.reset();
+    done->frames.reset();
+    done->openSlots.reset();
+    done->stackCapacity = 0;
+    done->frameCapacity = 0;
+    done->stackTop = nullptr;
+    done->frameCount = 0;
+    done->openUpvalues = nullptr;
+}
+
 void VM::defineMethod(ObjString* name) {
     Value method = peek(0);
     ObjClass* klass = AS_CLASS(peek(1));
-    klass->methods[name->str] = method;
+    klass->methods[name] = method;
     pop();
 }
 
-std::string valueToString(const Value& value) {
+size_t formatNumber(double value, char* buffer) {
+    char* end = buffer + NUMBER_BUFFER_SIZE;
+    if (value >= -9007199254740992.0 && value <= 9007199254740992.0) {
+        int64_t integral = static_cast<int64_t>(value);
+        if (static_cast<double>(integral) == value && !(integral == 0 && std::signbit(value))) {
+            return std::to_chars(buffer, end, integral).ptr - buffer;
+        }
+    }
+    // Past 2^53 every double is integral; print them in full, as print always
+    // has, until the digits would outgrow the buffer.
+    if (std::fabs(value) < 1e21) return std::to_chars(buffer, end, value, std::chars_format::fixed).ptr - buffer;
+    return std::to_chars(buffer, end, value).ptr - buffer;
+}
+
+void appendValue(std::string& out, const Value& value) {
+    if (std::holds_alternative<int32_t>(value)) {
+        char buffer[NUMBER_BUFFER_SIZE];
+        out.append(buffer, std::to_chars(buffer, buffer + NUMBER_BUFFER_SIZE, std::get<int32_t>(value)).ptr);
+        return;
+    }
     if (std::holds_alternative<double>(value)) {
-        std::ostringstream oss;
-        oss << std::fixed << std::setprecision(10) << std::get<double>(value);
-        std::string s = oss.str();
-        s.erase(s.find_last_not_of('0') + 1, std::string::npos);
-        if (s.back() == '.') s.pop_back();
-        return s;
-    }
-    if (std::holds_alternative<bool>(value)) return std::get<bool>(value) ? "true" : "false";
-    if (std::holds_alternative<std::nullptr_t>(value)) return "nil";
-    if (std::holds_alternative<Obj*>(value)) {
-        Obj* obj = std::get<Obj*>(value);
-        if (obj->type == Obj::Type::STRING) return AS_STRING(value)->str;
-        if (obj->type == Obj::Type::FUNCTION) {
+        char buffer[NUMBER_BUFFER_SIZE];
+        out.append(buffer, formatNumber(std::get<double>(value), buffer));
+        return;
+    }
+    if (std::holds_alternative<bool>(value)) {
+        out += std::get<bool>(value) ? "true" : "false";
+        return;
+    }
+    if (std::holds_alternative<std::nullptr_t>(value)) {
+        out += "nil";
+        return;
+    }
+    Obj* obj = std::get<Obj*>(value);
+    switch (obj->type()) {
+        case Obj::Type::STRING: out += AS_STRING(value)->view(); return;
+        case Obj::Type::FUNCTION: {
             ObjFunction* f = AS_FUNCTION(value);
-            return f->name ? "<fn " + f->name->str + ">" : "<script>";
+            if (f->name) {
+                out += "<fn ";
+                out += f->name->view();
+                out += ">";
+            } else {
+                out += "<script>";
+            }
+            return;
         }
-        if (obj->type == Obj::Type::CLASS) return AS_CLASS(value)->name->str;
-        if (obj->type == Obj::Type::INSTANCE) return AS_INSTANCE(value)->klass->name->str + " instance";
-        if (obj->type == Obj::Type::BOUND_METHOD) return "<bound method>";
-        if (obj->type == Obj::Type::NATIVE) return "<native fn>";
-        if (obj->type == Obj::Type::LIST) {
+        case Obj::Type::CLOSURE: appendValue(out, Value(static_cast<Obj*>(AS_CLOSURE(value)->function))); return;
+        case Obj::Type::CLASS: out += AS_CLASS(value)->name->view(); return;
+        case Obj::Type::INSTANCE:
+            out += AS_INSTANCE(value)->klass->name->view();
+            out += " instance";
+            return;
+        case Obj::Type::BOUND_METHOD: out += "<bound method>"; return;
+        case Obj::Type::NATIVE: out += "<native fn>"; return;
+        case Obj::Type::FIBER: out += "<fiber>"; return;
+        case Obj::Type::LIST: {
             ObjList* list = AS_LIST(value);
-            std::string result = "[";
+            out += "[";
             for (size_t i = 0; i < list->elements.size(); i++) {
-                if (i > 0) result += ", ";
-                result += valueToString(list->elements[i]);
+                if (i > 0) out += ", ";
+                appendValue(out, list->elements[i]);
             }
-            result += "]";
-            return result;
+            out += "]";
+            return;
         }
+        default:
+            break;
     }
-    return "<object>";
+    out += "<object>";
+}
+
+std::string valueToString(const Value& value) {
+    std::string result;
+    appendValue(result, value);
+    return result;
 }
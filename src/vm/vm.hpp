@@ -1,44 +1,114 @@
 #pragma once
 #include "chunk.hpp"
 #include "object/object.hpp"
+#include "object/fiber.hpp"
 #include "value.hpp"
+#include "output.hpp"
+#include "profiler.hpp"
+#include "op_stats.hpp"
 #include <array>
 #include <functional>
 
-using NativeFn = std::function<Value(VM&, const std::vector<Value>&)>;
+class ParallelLists;
+class EventLoop;
 
-class CallFrame {
-public:
-    ObjClosure* closure = nullptr;
-    const uint8_t* ip = nullptr;
-    Value* slots = nullptr;
-};
+using NativeFn = std::function<Value(VM&, const std::vector<Value>&)>;
 
 class VM {
 public:
-    static constexpr int FRAMES_MAX = 64;
-    static constexpr int STACK_MAX = FRAMES_MAX * 256;
+    static constexpr int DEFAULT_MAX_FRAMES = 100000;
+    static constexpr int DEFAULT_MAX_SLOTS = 1 << 22;
 
-    std::array<CallFrame, FRAMES_MAX> frames;
-    int frameCount = 0;
+    Obj* objects = nullptr;
 
-    std::array<Value, STACK_MAX> stack;
-    Value* stackTop = stack.data();
+    // The main fiber runs scripts and host calls; fiber is the one running
+    // now. The fields below cache fiber's stacks for the interpreter loop.
+    ObjFiber* rootFiber = nullptr;
+    ObjFiber* fiber = nullptr;
+    CallFrame* frames = nullptr;
+    int frameCount = 0;
+    Value* stack = nullptr;
+    Value* stackTop = nullptr;
+    ObjUpvalue* openUpvalues = nullptr;
+    // Key for looking up initializers; lives as long as the VM.
+    ObjString* initString = nullptr;
+    // Per-fiber limits. Going past either is a stack overflow.
+    int maxFrames = DEFAULT_MAX_FRAMES;
+    int maxStackSlots = DEFAULT_MAX_SLOTS;
 
     std::unordered_map<std::string, Value> globals;
-    Obj* objects = nullptr;
-    ObjUpvalue* openUpvalues = nullptr;
+
+    static constexpr size_t MIN_HEAP = 1024 * 1024;
 
     size_t bytesAllocated = 0;
-    size_t nextGC = 1024 * 1024;
+    size_t nextGC = MIN_HEAP;
+    // Zero means unlimited. Checked after each collection, so the heap can
+    // overshoot by whatever one instruction allocates.
+    size_t memoryLimit = 0;
+
+    struct GCStats {
+        uint64_t collections = 0;
+        uint64_t totalPauseNs = 0;
+        uint64_t maxPauseNs = 0;
+    };
+    GCStats gcStats;
+
+    OutputBuffer out;
+    Profiler* profiler = nullptr;
+    OpStats* opStats = nullptr;
+
+    // Values the host keeps alive outside the stack.
+    std::vector<Value> pinned;
+    // Set on the worker VMs of parallel list natives; see ParallelLists.
+    bool parallelWorker = false;
+    // Rewrites generic instructions into type-specialized ones as they run.
+    // Off with --no-quicken, for comparing against the generic path.
+    bool quicken = true;
+    // Copies small functions into their callers after compiling. Off with
+    // --no-inline.
+    bool inlining = true;
+    // Hoists invariant loads and proven bounds checks out of loops after
+    // compiling. Off with --no-loop-opt.
+    bool loopOptimization = true;
+    // Leaves the bodies of functions declared at the top of a script, and of
+    // the methods of its top-level classes, uncompiled until their first
+    // call. Compile errors in them surface then. On with --lazy.
+    bool lazyCompile = false;
+    // Directories `import` searches, in order; empty searches the working
+    // directory. Each module runs once per VM, however often it is imported.
+    std::vector<std::string> modulePath;
+    // Directory where compiled modules are kept between runs, keyed by a hash
+    // of their source; empty compiles them on every run. Set with
+    // --module-cache.
+    std::string moduleCache;
 
     VM();
     ~VM();
 
     bool interpret(const std::string& source);
+    // Runs an already compiled script, which may belong to a CodeCache.
+    bool interpret(ObjFunction* function);
+    ObjFunction* compile(const std::string& source);
+    // Compiles every function still waiting for its first call, which
+    // parallel workers cannot do on the shared heap. False on a compile error.
+    bool compileDeferred();
+    // Calls the value below the top argCount slots and leaves its result
+    // in place of the callee and arguments. Safe to use from inside a native.
+    bool callFromHost(int argCount);
+    // Resumes target from native code and returns once control comes back
+    // to the current fiber, storing what target yielded or returned.
+    bool resumeFromHost(ObjFiber* target, Value value, Value* result = nullptr);
+    // Whether a native may park the running fiber instead of blocking.
+    bool canPark() const;
+    // Parks the running fiber once the current native returns.
+    void park();
     void runtimeError(const char* format, ...);
+    // Called by a native to abort the script with a runtime error once it
+    // returns. An empty message aborts silently.
+    Value nativeError(std::string message);
 
-    ObjString* allocateString(std::string s);
+    ObjString* allocateString(std::string_view s);
+    ObjString* concatenate(const ObjString* a, const ObjString* b);
     ObjFunction* newFunction();
     ObjClosure* newClosure(ObjFunction* function);
     ObjUpvalue* newUpvalue(Value* slot);
@@ -47,26 +117,66 @@ public:
     ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
     ObjNative* newNative(NativeFn function, int arity);
     ObjList* newList();
-
+    ObjFiber* newFiber(ObjClosure* entry);
+
+    // Makes room for slots more values on the running fiber's stack, which
+    // may move it. False if that would pass maxStackSlots.
+    bool ensureStack(int slots) {
+        return stackTop - stack + slots <= fiber->stackCapacity || growStack(slots);
+    }
+    // Unchecked: call() reserves a function's maxSlots for its frame, and
+    // natives and hosts that push more call ensureStack first.
     void push(Value value) { *stackTop++ = value; }
     Value pop() { return *--stackTop; }
     Value peek(int distance) const { return stackTop[-1 - distance]; }
 
 private:
-    bool run();
+    bool run(ObjFiber* host = nullptr);
     bool call(ObjClosure* closure, int argCount);
+    bool compileDeferred(ObjFunction* function);
+    // Compiles, or loads from moduleCache, the module that name resolves to
+    // and sets module to it; sets nullptr if it was imported before. False
+    // after a runtime error.
+    bool importModule(ObjString* name, ObjFunction*& module);
     bool callValue(Value callee, int argCount);
     bool invoke(ObjString* name, int argCount);
     bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount);
-    bool bindMethod(ObjClass* klass, const std::string& name);
+    bool bindMethod(ObjClass* klass, ObjString* name);
     ObjUpvalue* captureUpvalue(Value* local);
     void closeUpvalues(Value* last);
     void defineMethod(ObjString* name);
-
-    void defineNative(const std::string& name, int arity, Value (*fn)(VM&, const std::vector<Value>&));
+    bool resume(Value target, Value value);
+    void suspend(ObjFiber::State state, Value value);
+    void switchFiber(ObjFiber* next);
+    void loadFiber(ObjFiber* next);
+    void finishFiber(ObjFiber* done);
+    ObjString* newString(size_t length);
+    // Globals are still keyed by std::string; lookups copy the name into one
+    // reused buffer instead of building a temporary each time.
+    const std::string& keyOf(const ObjString* name);
+    bool growStack(int slots);
+    bool growFrames();
+
+    void defineNative(const std::string& name, int arity, Value (*fn)(VM&, const std::vector<Value>&),
+                      bool threadSafe = false);
+    ParallelLists& parallelLists();
+    EventLoop& eventLoop();
 
     std::vector<Obj*> grayStack;
 
+    bool nativeFailed = false;
+    // Whether a script compiled with lazyCompile may have left functions
+    // uncompiled.
+    bool deferredPending = false;
+    bool parkRequested = false;
+    std::string nativeErrorMessage;
+    std::string nameKey;
+    // Modules imported so far, by resolved path.
+    std::unordered_map<std::string, ObjFunction*> modules;
+    std::unique_ptr<ParallelLists> parallel;
+    std::unique_ptr<EventLoop> loop;
+
+    void collectGarbage();
     void markRoots();
     void traceReferences();
     void sweep();
@@ -78,4 +188,26 @@ private:
 
     static Value clockNative(VM&, const std::vector<Value>&);
     static Value inputNative(VM&, const std::vector<Value>&);
+    static Value writeNative(VM&, const std::vector<Value>&);
+    static Value flushNative(VM&, const std::vector<Value>&);
+    static Value readFileNative(VM&, const std::vector<Value>&);
+    static Value writeFileNative(VM&, const std::vector<Value>&);
+    static Value openLinesNative(VM&, const std::vector<Value>&);
+    static Value fiberNative(VM&, const std::vector<Value>&);
+    static Value isDoneNative(VM&, const std::vector<Value>&);
+    static Value parallelMapNative(VM&, const std::vector<Value>&);
+    static Value parallelFilterNative(VM&, const std::vector<Value>&);
+    static Value parallelReduceNative(VM&, const std::vector<Value>&);
+    static Value spawnNative(VM&, const std::vector<Value>&);
+    static Value sleepNative(VM&, const std::vector<Value>&);
+    static Value runLoopNative(VM&, const std::vector<Value>&);
+    static Value readFdNative(VM&, const std::vector<Value>&);
+    static Value writeFdNative(VM&, const std::vector<Value>&);
+    static Value closeFdNative(VM&, const std::vector<Value>&);
+    static Value openFdNative(VM&, const std::vector<Value>&);
+    static Value pipeNative(VM&, const std::vector<Value>&);
+    static Value socketPairNative(VM&, const std::vector<Value>&);
+    static Value listenUnixNative(VM&, const std::vector<Value>&);
+    static Value connectUnixNative(VM&, const std::vector<Value>&);
+    static Value acceptNative(VM&, const std::vector<Value>&);
 };
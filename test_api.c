@@ -0,0 +1,246 @@
+/* Exercises the C API the way an embedding host does. Plain C, so it also
+ * checks that intercpp.h compiles as C. */
+#include "intercpp.h"
+#include <stdio.h>
+#include <string.h>
+
+static int failures = 0;
+
+#define CHECK(condition)                                                \
+    do {                                                                \
+        if (!(condition)) {                                             \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,      \
+                    __LINE__, #condition);                              \
+            failures++;                                                 \
+        }                                                               \
+    } while (0)
+
+static IcppResult run(IcppVM* vm, const char* source) {
+    return icpp_interpret(vm, source, strlen(source));
+}
+
+static int hostAdd(IcppVM* vm, int argCount, void* userData) {
+    int* calls = (int*)userData;
+    (*calls)++;
+    if (argCount != 2 || icpp_type(vm, -1) != ICPP_TYPE_NUMBER ||
+        icpp_type(vm, -2) != ICPP_TYPE_NUMBER) {
+        icpp_error(vm, "hostAdd expects two numbers.");
+        return -1;
+    }
+    icpp_push_number(vm, icpp_to_number(vm, -2) + icpp_to_number(vm, -1));
+    return 1;
+}
+
+static void testCalls(void) {
+    IcppVM* vm = icpp_new();
+    CHECK(icpp_api_version() == INTERCPP_API_VERSION);
+    CHECK(run(vm, "fun greet(name) { return \"hello \" + name; }") == ICPP_OK);
+    CHECK(icpp_get_top(vm) == 0);
+
+    /* Compile once, call many times. */
+    for (int i = 0; i < 3; i++) {
+        CHECK(icpp_get_global(vm, "greet") == 1);
+        CHECK(icpp_type(vm, -1) == ICPP_TYPE_CALLABLE);
+        CHECK(icpp_push_string(vm, "world", 5) == 1);
+        CHECK(icpp_call(vm, 1) == ICPP_OK);
+        size_t length = 0;
+        const char* reply = icpp_to_string(vm, -1, &length);
+        CHECK(reply != NULL && length == 11 && strcmp(reply, "hello world") == 0);
+        icpp_pop(vm, 1);
+        CHECK(icpp_get_top(vm) == 0);
+    }
+
+    /* A loaded script runs only when called. */
+    const char* script = "var loaded = 41 + 1;";
+    CHECK(icpp_load(vm, script, strlen(script)) == ICPP_OK);
+    CHECK(icpp_get_global(vm, "loaded") == 0);
+    icpp_pop(vm, 1);
+    CHECK(icpp_call(vm, 0) == ICPP_OK);
+    icpp_pop(vm, 1);
+    CHECK(icpp_get_global(vm, "loaded") == 1);
+    CHECK(icpp_to_number(vm, -1) == 42);
+    icpp_pop(vm, 1);
+
+    const char* broken = "var = ;";
+    CHECK(icpp_load(vm, broken, strlen(broken)) == ICPP_COMPILE_ERROR);
+    CHECK(icpp_get_top(vm) == 0);
+
+    /* A runtime error reports, fails the call and resets the stack. */
+    CHECK(icpp_push_nil(vm) == 1);
+    CHECK(icpp_get_global(vm, "greet") == 1);
+    CHECK(icpp_push_number(vm, 1) == 1);
+    CHECK(icpp_call(vm, 1) == ICPP_RUNTIME_ERROR);
+    CHECK(icpp_get_top(vm) == 0);
+    icpp_free(vm);
+}
+
+static void testStack(void) {
+    IcppVM* vm = icpp_new();
+    CHECK(icpp_push_nil(vm) == 1);
+    CHECK(icpp_push_bool(vm, 1) == 1);
+    CHECK(icpp_push_number(vm, 2.5) == 1);
+    CHECK(icpp_push_string(vm, "four", 4) == 1);
+    CHECK(icpp_push_value(vm, -2) == 1);
+    CHECK(icpp_get_top(vm) == 5);
+
+    CHECK(icpp_type(vm, -5) == ICPP_TYPE_NIL);
+    CHECK(icpp_type(vm, -4) == ICPP_TYPE_BOOL);
+    CHECK(icpp_type(vm, -3) == ICPP_TYPE_NUMBER);
+    CHECK(icpp_type(vm, -2) == ICPP_TYPE_STRING);
+    CHECK(icpp_type(vm, -1) == ICPP_TYPE_NUMBER);
+    CHECK(icpp_type(vm, -6) == ICPP_TYPE_NONE);
+    CHECK(icpp_type(vm, 0) == ICPP_TYPE_NONE);
+    CHECK(icpp_to_bool(vm, -4) == 1);
+    CHECK(icpp_to_bool(vm, -5) == 0);
+    CHECK(icpp_to_number(vm, -1) == 2.5);
+    CHECK(icpp_to_string(vm, -1, NULL) == NULL);
+
+    /* Globals set from the host are visible to scripts. */
+    icpp_set_global(vm, "fromHost");
+    CHECK(icpp_get_top(vm) == 4);
+    CHECK(run(vm, "var doubled = fromHost * 2;") == ICPP_OK);
+    CHECK(icpp_get_global(vm, "doubled") == 1);
+    CHECK(icpp_to_number(vm, -1) == 5);
+
+    /* Missing globals push nil. */
+    CHECK(icpp_get_global(vm, "missing") == 0);
+    CHECK(icpp_type(vm, -1) == ICPP_TYPE_NIL);
+
+    icpp_pop(vm, 100);
+    CHECK(icpp_get_top(vm) == 0);
+    icpp_free(vm);
+}
+
+static void testNatives(void) {
+    IcppVM* vm = icpp_new();
+    int calls = 0;
+    icpp_register_native(vm, "hostAdd", 2, hostAdd, &calls);
+    CHECK(run(vm, "var sum = 0;\n"
+                  "for (var i = 0; i < 10; i = i + 1) sum = hostAdd(sum, i);") == ICPP_OK);
+    CHECK(calls == 10);
+    CHECK(icpp_get_global(vm, "sum") == 1);
+    CHECK(icpp_to_number(vm, -1) == 45);
+    icpp_pop(vm, 1);
+
+    /* A native that fails raises a runtime error in the script. */
+    CHECK(run(vm, "hostAdd(1, \"two\");") == ICPP_RUNTIME_ERROR);
+    CHECK(calls == 11);
+    CHECK(icpp_get_top(vm) == 0);
+    icpp_free(vm);
+}
+
+static void testMemoryLimit(void) {
+    IcppVM* vm = icpp_new();
+    icpp_set_memory_limit(vm, 1 << 20);
+    /* Garbage is collected under the limit... */
+    CHECK(run(vm, "for (var i = 0; i < 100000; i = i + 1) { var s = \"x\" + \"y\"; }") == ICPP_OK);
+    CHECK(icpp_memory_used(vm) <= (1 << 20));
+    /* ...but live data past it fails the script. */
+    CHECK(run(vm, "var keep = \"x\";\n"
+                  "for (var i = 0; i < 30; i = i + 1) keep = keep + keep;") == ICPP_RUNTIME_ERROR);
+    CHECK(icpp_get_top(vm) == 0);
+
+    /* The VM stays usable. */
+    CHECK(run(vm, "var small = 1;") == ICPP_OK);
+    icpp_free(vm);
+}
+
+/* A closure that escaped from a fiber unwound by an error keeps its value
+ * after the fiber is collected. */
+static void testFiberError(void) {
+    IcppVM* vm = icpp_new();
+    CHECK(run(vm, "var read;\n"
+                  "fun body(x) {\n"
+                  "  var kept = x;\n"
+                  "  fun get() { return kept; }\n"
+                  "  read = get;\n"
+                  "  return kept + nil;\n"
+                  "}\n"
+                  "resume(fiber(body), 7);") == ICPP_RUNTIME_ERROR);
+    CHECK(run(vm, "var junk;\n"
+                  "for (var i = 0; i < 100000; i = i + 1) junk = [i, \"x\" + \"y\"];\n"
+                  "var got = read();") == ICPP_OK);
+    CHECK(icpp_get_global(vm, "got") == 1);
+    CHECK(icpp_to_number(vm, -1) == 7);
+    icpp_free(vm);
+}
+
+#define POOL_JOBS 64
+
+typedef struct {
+    IcppResult status;
+    char reply[32];
+    int calls;
+} JobResult;
+
+static void jobDone(IcppResult status, const char* result, size_t length, void* userData) {
+    JobResult* job = (JobResult*)userData;
+    job->status = status;
+    job->calls++;
+    if (result != NULL && length < sizeof(job->reply)) memcpy(job->reply, result, length + 1);
+}
+
+static void testPool(void) {
+    IcppPool* pool = icpp_pool_new(4);
+    CHECK(icpp_pool_size(pool) == 4);
+
+    const char* source =
+        "fun handle(name) {\n"
+        "  var sum = 0;\n"
+        "  for (var i = 0; i < 1000; i = i + 1) sum = sum + i;\n"
+        "  if (sum != 499500) return \"wrong\";\n"
+        "  return \"job \" + name;\n"
+        "}\n"
+        "fun fail() { return nil + 1; }";
+    IcppScript* script = icpp_pool_compile(pool, source, strlen(source));
+    CHECK(script != NULL);
+    /* Every isolate shares the one compiled copy. */
+    CHECK(icpp_pool_compile(pool, source, strlen(source)) == script);
+    CHECK(icpp_pool_compile(pool, "var = ;", 7) == NULL);
+
+    JobResult results[POOL_JOBS];
+    char names[POOL_JOBS][8];
+    memset(results, 0, sizeof(results));
+    for (int i = 0; i < POOL_JOBS; i++) {
+        const char* args[1] = {names[i]};
+        snprintf(names[i], sizeof(names[i]), "%d", i);
+        icpp_pool_submit(pool, script, "handle", args, 1, jobDone, &results[i]);
+    }
+    icpp_pool_wait(pool);
+    for (int i = 0; i < POOL_JOBS; i++) {
+        char expected[32];
+        snprintf(expected, sizeof(expected), "job %d", i);
+        CHECK(results[i].calls == 1);
+        CHECK(results[i].status == ICPP_OK);
+        CHECK(strcmp(results[i].reply, expected) == 0);
+    }
+
+    /* A failing job reports through its callback; the pool keeps working. */
+    JobResult failed = {ICPP_OK, "", 0};
+    icpp_pool_submit(pool, script, "fail", NULL, 0, jobDone, &failed);
+    icpp_pool_wait(pool);
+    CHECK(failed.calls == 1);
+    CHECK(failed.status == ICPP_RUNTIME_ERROR);
+
+    JobResult last = {ICPP_RUNTIME_ERROR, "", 0};
+    const char* args[1] = {"last"};
+    icpp_pool_submit(pool, script, "handle", args, 1, jobDone, &last);
+    icpp_pool_free(pool);
+    CHECK(last.calls == 1);
+    CHECK(strcmp(last.reply, "job last") == 0);
+}
+
+int main(void) {
+    testCalls();
+    testStack();
+    testNatives();
+    testMemoryLimit();
+    testFiberError();
+    testPool();
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}